@@ -1,837 +1,4806 @@
 #include <lauxlib.h>
+#include <limits.h>
 #include <lua.h>
 #include <lualib.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<luajit.h>)
+#include <luajit.h>
+#endif
+#endif
 
 #ifdef ELUNE_VERSION
 #define LUALUA_IS_ELUNE
 #endif
 
+typedef struct lualua_Sandbox lualua_Sandbox;
+typedef struct lualua_Alloc lualua_Alloc;
+typedef struct lualua_Profile lualua_Profile;
+typedef struct lualua_Future lualua_Future;
+typedef struct lualua_CachedString lualua_CachedString;
+
+/*
+ * Instrumentation counters, kept for each sandbox and for each host state
+ * across all of its sandboxes. A sandbox's counters are only touched by the
+ * thread running it and a host state's only from the host, so userdata that
+ * sandboxes finalize on worker threads are added to the host's counters by
+ * lualua_finish. State methods carry their position in lualua_state_index
+ * as an upvalue, which lualua_checkstate counts calls by. Building with
+ * LUALUA_NOSTATS compiles them out.
+ */
+#ifndef LUALUA_NOSTATS
+typedef struct {
+  double calls;
+  double time; /* in seconds, of the calls that returned while timing */
+} lualua_MethodStats;
+
+typedef struct {
+  double safecalls;   /* calls through lualua_safecall */
+  double errors;      /* errors raised by lualua_assert */
+  double callbacks;   /* host callbacks from sandbox code */
+  double newuserdata; /* host-backed userdata created */
+  double gcuserdata;  /* host-backed userdata finalized */
+  double bytescopied; /* string bytes copied between host and sandbox */
+  int nmethods;
+  lualua_MethodStats *methods; /* indexed like lualua_state_index */
+} lualua_Stats;
+
+#define LUALUA_COUNT(sb, field, n) \
+  ((sb)->stats.field += (n), (sb)->hoststats->field += (n))
+#else
+#define LUALUA_COUNT(sb, field, n) ((void)0)
+#endif
+
 typedef struct {
   lua_State *state;
   int stackmax;
   int stateowner;
+  lualua_Sandbox *sandbox;
+  int threadref; /* sandbox registry ref to a wrapped thread, or LUA_NOREF */
 } lualua_State;
 
-static const char lualua_host_refname[] =
-    "github.com/lua-wow-tools/lualua/host";
+/*
+ * Per-sandbox bookkeeping, kept as a userdata in the sandbox registry so
+ * that it lives exactly as long as the sandbox. Callbacks reach it through
+ * an upvalue rather than through registry lookups.
+ */
+struct lualua_Sandbox {
+  lua_State *host;
+  int hostrefs;            /* host registry ref to the host ref table */
+  int ncallbacks;          /* live host refs held by C closures */
+  int nuserdata;           /* live host refs held by userdata */
+  int wrapperref;          /* host ref table ref to the callback wrapper */
+  lualua_State *wrapper;   /* state passed to every host callback */
+  lualua_Alloc *alloc;     /* NULL when the runtime allocator is in use */
+  double budget;           /* instructions left, or negative for no budget */
+  int granularity;         /* instructions between budget checks */
+  int exceeded;            /* whether the budget ran out in this call */
+  int depth;               /* nesting of protected calls */
+  int closing;             /* whether lua_close is running finalizers */
+  int trying;              /* whether errors should leave the stack alone */
+  int ntokensgced;         /* gctokens finalized so far */
+  lualua_Profile *profile; /* NULL unless profiling */
+  const void *pool;        /* pool that created the state, or NULL */
+  int idle;                /* whether the state is waiting in its pool */
+  lualua_Future *future;   /* non-NULL while running on a worker thread */
+  int ffi;                 /* nesting of pcalls made through lualua.ffi */
+  int *deferred;           /* host refs to release once the host is free */
+  int ndeferred;
+  int maxdeferred;
+  const void *buffers;          /* environment shared by buffer userdata */
+  const void *userdata;         /* environment shared by host-backed userdata */
+  const void *userdatamt;       /* default metatable of host-backed userdata */
+  lualua_CachedString *strings; /* NULL unless the string cache is on */
+  int nstrings;
+  double stringhits;
+  double stringmisses;
+#ifndef LUALUA_NOSTATS
+  lualua_Stats stats;
+  lualua_Stats *hoststats; /* shared by every sandbox of the host */
+  double asyncgced;        /* gcuserdata not yet added to hoststats */
+#endif
+};
+
+#define LUALUA_GRANULARITY 1000
+#define LUALUA_ERRBUDGET (LUA_ERRFILE + 1)
+#define LUALUA_ERRDEAD (LUA_ERRFILE + 2)
+
+/*
+ * Each sandbox keeps host values it refers to in its own host ref table,
+ * which is dropped when the sandbox closes. Refs still in it at that point
+ * were never finalized and are counted as orphaned. The counts may be
+ * updated from worker threads, so they are only accessed atomically.
+ */
+enum { LUALUA_CALLBACK, LUALUA_USERDATA };
+
+static struct {
+  int states;
+  int callbacks;
+  int userdata;
+  int orphaned;
+} lualua_refs;
+
 static const char lualua_sandbox_refname[] =
     "github.com/lua-wow-tools/lualua/sandbox";
 static const char lualua_state_metatable[] = "lualua state";
 static const char lualua_gctoken_metatable[] = "lualua gctoken";
+static const char lualua_future_metatable[] = "lualua future";
+static const char lualua_workers_refname[] =
+    "github.com/lua-wow-tools/lualua/workers";
+/* Weak table from each sandbox, as a light userdata, to the state owning it. */
+static const char lualua_owners_refname[] =
+    "github.com/lua-wow-tools/lualua/owners";
+#ifndef LUALUA_NOSTATS
+static const char lualua_stats_refname[] =
+    "github.com/lua-wow-tools/lualua/stats";
+#endif
 
-static int lualua_gctoken_gc(lua_State *SS) {
-  int ref = *(int *)lua_touserdata(SS, 1);
-  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
-  lua_getfield(SS, -1, "host");
-  lua_State *L = lua_touserdata(SS, -1);
-  lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
-  luaL_unref(L, -1, ref);
-  lua_pop(L, 1);
+/*
+ * Sandbox allocators. Each sandbox gets a lualua_Alloc that accounts for its
+ * memory and, while sandbox code runs, enforces its memlimit. The pool mode
+ * serves small blocks from per-size-class free lists carved out of slabs;
+ * the arena mode bump-allocates and returns memory only when the state is
+ * closed. Both hand out whole chunks that are freed with the allocator.
+ */
+
+#define LUALUA_ALIGN 8
+#define LUALUA_NCLASSES 32 /* pooled sizes, in steps of LUALUA_ALIGN */
+#define LUALUA_SLABSIZE 16384
+#define LUALUA_CHUNKSIZE 65536
+
+enum { LUALUA_ALLOC_DEFAULT, LUALUA_ALLOC_POOL, LUALUA_ALLOC_ARENA };
+
+static const char *const lualua_allocatornames[] = {"default", "pool",
+                                                    "arena", NULL};
+
+typedef union lualua_Chunk {
+  union lualua_Chunk *next;
+  double align;
+} lualua_Chunk;
+
+struct lualua_Alloc {
+  int mode;
+  int enforce;          /* whether limit applies right now */
+  size_t limit;         /* 0 for no limit */
+  size_t bytes;         /* bytes in use by the sandbox */
+  size_t peak;          /* high water mark of bytes */
+  double allocs;        /* blocks allocated */
+  double frees;         /* blocks freed */
+  size_t freed;         /* bytes released, including by shrinking */
+  size_t cyclemark;     /* freed as of the end of the last GC cycle */
+  size_t lastfreed;     /* bytes released during the last GC cycle */
+  size_t used;          /* arena bytes handed out */
+  lualua_Chunk *chunks; /* slabs or arena chunks */
+  char *next;           /* current bump region */
+  size_t avail;
+  char *last; /* most recent arena block */
+  void *freelists[LUALUA_NCLASSES];
+};
+
+static size_t lualua_roundup(size_t size) {
+  return (size + LUALUA_ALIGN - 1) & ~(size_t)(LUALUA_ALIGN - 1);
+}
+
+static void *lualua_newchunk(lualua_Alloc *a, size_t size) {
+  lualua_Chunk *c = malloc(sizeof(*c) + size);
+  if (c == NULL) {
+    return NULL;
+  }
+  c->next = a->chunks;
+  a->chunks = c;
+  return c + 1;
+}
+
+static void *lualua_bump(lualua_Alloc *a, size_t size, size_t chunksize) {
+  if (size > a->avail) {
+    if (size > chunksize / 4) {
+      /* Big blocks get their own chunk, keeping the current region. */
+      return lualua_newchunk(a, size);
+    }
+    char *region = lualua_newchunk(a, chunksize);
+    if (region == NULL) {
+      return NULL;
+    }
+    a->next = region;
+    a->avail = chunksize;
+  }
+  void *p = a->next;
+  a->next += size;
+  a->avail -= size;
+  return p;
+}
+
+static void *lualua_poolalloc(lualua_Alloc *a, void *ptr, size_t osize,
+                              size_t nsize) {
+  size_t oclass = ptr == NULL ? 0 : lualua_roundup(osize) / LUALUA_ALIGN;
+  size_t nclass = lualua_roundup(nsize) / LUALUA_ALIGN;
+  if (oclass > LUALUA_NCLASSES && nclass > LUALUA_NCLASSES) {
+    return realloc(ptr, nsize);
+  }
+  if (oclass == nclass && ptr != NULL) {
+    return ptr;
+  }
+  void *p = NULL;
+  if (nclass > LUALUA_NCLASSES) {
+    p = malloc(nsize);
+  } else if (nclass > 0) {
+    void **freelist = &a->freelists[nclass - 1];
+    if (*freelist != NULL) {
+      p = *freelist;
+      *freelist = *(void **)p;
+    } else {
+      p = lualua_bump(a, nclass * LUALUA_ALIGN, LUALUA_SLABSIZE);
+    }
+  }
+  if (p == NULL && nsize > 0) {
+    return NULL;
+  }
+  if (ptr != NULL) {
+    if (p != NULL) {
+      memcpy(p, ptr, osize < nsize ? osize : nsize);
+    }
+    if (oclass > LUALUA_NCLASSES) {
+      free(ptr);
+    } else {
+      void **freelist = &a->freelists[oclass - 1];
+      *(void **)ptr = *freelist;
+      *freelist = ptr;
+    }
+  }
+  return p;
+}
+
+static void *lualua_arenaalloc(lualua_Alloc *a, void *ptr, size_t osize,
+                               size_t nsize) {
+  size_t orounded = ptr == NULL ? 0 : lualua_roundup(osize);
+  size_t nrounded = lualua_roundup(nsize);
+  if (ptr != NULL && ptr == a->last && nrounded <= orounded + a->avail) {
+    /* Resize the most recent block in place, releasing any slack. */
+    ptrdiff_t delta = (ptrdiff_t)nrounded - (ptrdiff_t)orounded;
+    a->next += delta;
+    a->avail -= delta;
+    a->used += delta;
+    if (nsize == 0) {
+      a->last = NULL;
+    }
+    return nsize == 0 ? NULL : ptr;
+  }
+  if (nrounded <= orounded) {
+    return nsize == 0 ? NULL : ptr;
+  }
+  void *p = lualua_bump(a, nrounded, LUALUA_CHUNKSIZE);
+  if (p == NULL) {
+    return NULL;
+  }
+  a->used += nrounded;
+  a->last = (char *)p + nrounded == a->next ? p : NULL;
+  if (ptr != NULL) {
+    memcpy(p, ptr, osize);
+  }
+  return p;
+}
+
+static void *lualua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  lualua_Alloc *a = ud;
+  if (ptr == NULL) {
+    osize = 0;
+  }
+  if (nsize > osize && a->enforce && a->limit != 0) {
+    size_t footprint = a->mode == LUALUA_ALLOC_ARENA ? a->used : a->bytes;
+    if (footprint + (nsize - osize) > a->limit) {
+      return NULL;
+    }
+  }
+  void *p;
+  if (a->mode == LUALUA_ALLOC_POOL) {
+    p = lualua_poolalloc(a, ptr, osize, nsize);
+  } else if (a->mode == LUALUA_ALLOC_ARENA) {
+    p = lualua_arenaalloc(a, ptr, osize, nsize);
+  } else if (nsize == 0) {
+    free(ptr);
+    p = NULL;
+  } else {
+    p = realloc(ptr, nsize);
+  }
+  if (p == NULL && nsize > 0) {
+    return NULL;
+  }
+  if (ptr == NULL) {
+    a->allocs++;
+  } else if (nsize == 0) {
+    a->frees++;
+  }
+  if (nsize < osize) {
+    a->freed += osize - nsize;
+  }
+  a->bytes = a->bytes - osize + nsize;
+  if (a->bytes > a->peak) {
+    a->peak = a->bytes;
+  }
+  return p;
+}
+
+static void lualua_freealloc(lualua_Alloc *a) {
+  while (a->chunks != NULL) {
+    lualua_Chunk *c = a->chunks;
+    a->chunks = c->next;
+    free(c);
+  }
+  free(a);
+}
+
+/* Compare to the panic function installed by luaL_newstate. */
+static int lualua_panic(lua_State *SS) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+          lua_tostring(SS, -1));
   return 0;
 }
 
-static int lualua_newstate(lua_State *L) {
-  lualua_State *p = lua_newuserdata(L, sizeof(*p));
-  luaL_getmetatable(L, lualua_state_metatable);
-  lua_setmetatable(L, -2);
-  lua_State *SS = luaL_newstate();
-  lua_newtable(SS);
-  lua_pushlightuserdata(SS, L);
-  lua_setfield(SS, -2, "host");
-  lua_newtable(SS);
-  lua_newtable(SS);
-  lua_pushstring(SS, "k");
-  lua_setfield(SS, -2, "__mode");
+/* Whether the runtime takes lualua allocators, probed once per process. */
+static struct {
+  pthread_mutex_t mutex;
+  int probed;
+  int hasallocator;
+} lualua_probe = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+static int lualua_hasallocator(void) {
+  pthread_mutex_lock(&lualua_probe.mutex);
+  if (!lualua_probe.probed) {
+    lualua_Alloc a = {0};
+    lua_State *SS = lua_newstate(lualua_alloc, &a);
+    if (SS != NULL) {
+      lua_close(SS);
+    }
+    lualua_probe.hasallocator = SS != NULL;
+    lualua_probe.probed = 1;
+  }
+  int hasallocator = lualua_probe.hasallocator;
+  pthread_mutex_unlock(&lualua_probe.mutex);
+  return hasallocator;
+}
+
+/* Builds a sandbox state with a lualua allocator, if the runtime allows. */
+static lua_State *lualua_newsandbox(lua_State *L, int narg,
+                                    lualua_Alloc **alloc) {
+  int mode = LUALUA_ALLOC_DEFAULT;
+  lua_Number limit = 0;
+  if (!lua_isnoneornil(L, narg)) {
+    luaL_checktype(L, narg, LUA_TTABLE);
+    lua_getfield(L, narg, "allocator");
+    mode = luaL_checkoption(L, -1, "default", lualua_allocatornames);
+    lua_getfield(L, narg, "memlimit");
+    limit = luaL_optnumber(L, -1, 0);
+    luaL_argcheck(L, limit >= 0, narg, "negative memlimit");
+    lua_pop(L, 2);
+  }
+  lualua_Alloc *a = calloc(1, sizeof(*a));
+  if (a == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  a->mode = mode;
+  a->limit = (size_t)limit;
+  lua_State *SS = lua_newstate(lualua_alloc, a);
+  if (SS == NULL) {
+    lualua_freealloc(a);
+    /* LuaJIT on 64-bit platforms insists on its own allocator. */
+    if (mode != LUALUA_ALLOC_DEFAULT || limit != 0) {
+      luaL_error(L, "custom allocators are not supported");
+    }
+    SS = luaL_newstate();
+    a = NULL;
+  } else {
+    lua_atpanic(SS, lualua_panic);
+  }
+  *alloc = a;
+  return SS;
+}
+
+/*
+ * Finalizer of an unreferenced userdata, so it runs once per GC cycle after
+ * the sweep. It records what the cycle freed and arms the next cycle.
+ */
+static int lualua_sentinel_gc(lua_State *SS) {
+  lualua_Alloc *a = lua_touserdata(SS, lua_upvalueindex(1));
+  a->lastfreed = a->freed - a->cyclemark;
+  a->cyclemark = a->freed;
+  lua_newuserdata(SS, 0);
+  lua_getmetatable(SS, 1);
   lua_setmetatable(SS, -2);
-  lua_setfield(SS, -2, "gctokens");
+  return 0;
+}
+
+static void lualua_newsentinel(lua_State *SS, lualua_Alloc *a) {
+  lua_newuserdata(SS, 0);
   lua_newtable(SS);
   lua_pushstring(SS, "__gc");
-  lua_pushcfunction(SS, lualua_gctoken_gc);
-  lua_settable(SS, -3);
-  lua_pushstring(SS, "__metatable");
-  lua_pushstring(SS, lualua_gctoken_metatable);
+  lua_pushlightuserdata(SS, a);
+  lua_pushcclosure(SS, lualua_sentinel_gc, 1);
   lua_settable(SS, -3);
-  lua_setfield(SS, -2, "gctokenmt");
-  lua_setfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
-  p->state = SS;
-  p->stackmax = LUA_MINSTACK;
-  p->stateowner = 1;
-  return 1;
+  lua_setmetatable(SS, -2);
+  lua_pop(SS, 1);
 }
 
-static lualua_State *lualua_checkstate(lua_State *L, int index) {
-  return luaL_checkudata(L, index, lualua_state_metatable);
+static lualua_Sandbox *lualua_getsandbox(lua_State *SS) {
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "sandbox");
+  lualua_Sandbox *sb = lua_touserdata(SS, -1);
+  lua_pop(SS, 2);
+  return sb;
 }
 
-static int lualua_isacceptablestackindex(lualua_State *S, int index) {
-  return (index > 0 && index <= S->stackmax) ||
-         (index < 0 && -index <= lua_gettop(S->state));
+/*
+ * Sampling profiler. Samples are taken from the count hook and aggregated
+ * in host memory, keyed by the identities of the functions on the sandbox
+ * stack, so that profiling does not allocate in the sandbox.
+ */
+
+#define LUALUA_PROFILEDEPTH 64
+#define LUALUA_PROFILEBUCKETS 1024
+
+typedef struct lualua_Frame {
+  struct lualua_Frame *next;
+  const void *fn;
+  char label[1];
+} lualua_Frame;
+
+typedef struct lualua_Sample {
+  struct lualua_Sample *next;
+  unsigned hash;
+  double count;
+  int nframes;
+  const void *frames[1]; /* root first */
+} lualua_Sample;
+
+struct lualua_Profile {
+  int interval; /* instructions between samples */
+  int elapsed;  /* instructions since the last sample */
+  lualua_Frame *frames[LUALUA_PROFILEBUCKETS];
+  lualua_Sample *samples[LUALUA_PROFILEBUCKETS];
+};
+
+static unsigned lualua_hashpointer(unsigned h, const void *p) {
+  size_t x = (size_t)p;
+  return (h ^ (unsigned)(x ^ (x >> 16) ^ (x >> 32 >> 16))) * 16777619u;
 }
 
-static int lualua_ispseudoindex(int index) {
-  return index == LUA_GLOBALSINDEX || index == LUA_REGISTRYINDEX ||
-#ifdef LUALUA_IS_ELUNE
-         index == LUA_ERRORHANDLERINDEX ||
-#endif
-         index == LUA_ENVIRONINDEX;
+/* Labels the function at level on first sight. */
+static void lualua_addframe(lua_State *SS, lualua_Profile *p, const void *fn,
+                            lua_Debug *ar) {
+  unsigned bucket = lualua_hashpointer(2166136261u, fn) % LUALUA_PROFILEBUCKETS;
+  for (lualua_Frame *f = p->frames[bucket]; f != NULL; f = f->next) {
+    if (f->fn == fn) {
+      return;
+    }
+  }
+  lua_getinfo(SS, "Sn", ar);
+  size_t len = strlen(ar->short_src) + 32;
+  len += ar->name != NULL ? strlen(ar->name) : 1;
+  lualua_Frame *f = malloc(sizeof(*f) + len);
+  if (f == NULL) {
+    return;
+  }
+  snprintf(f->label, len + 1, "%s (%s:%d)", ar->name ? ar->name : "?",
+           ar->short_src, ar->linedefined);
+  for (char *c = f->label; *c; ++c) {
+    if (*c == ';') { /* the folded format separates frames with ';' */
+      *c = ',';
+    }
+  }
+  f->fn = fn;
+  f->next = p->frames[bucket];
+  p->frames[bucket] = f;
 }
 
-static int lualua_isacceptableindex(lualua_State *S, int index) {
-  return lualua_isacceptablestackindex(S, index) || lualua_ispseudoindex(index);
+static void lualua_sample(lua_State *SS, lualua_Profile *p) {
+  const void *frames[LUALUA_PROFILEDEPTH];
+  lua_Debug ar;
+  int n = 0;
+  while (n < LUALUA_PROFILEDEPTH && lua_getstack(SS, n, &ar)) {
+    lua_getinfo(SS, "f", &ar);
+    const void *fn = lua_topointer(SS, -1);
+    lua_pop(SS, 1);
+    lualua_addframe(SS, p, fn, &ar);
+    frames[LUALUA_PROFILEDEPTH - ++n] = fn;
+  }
+  const void **root = frames + LUALUA_PROFILEDEPTH - n;
+  unsigned hash = 2166136261u;
+  for (int i = 0; i < n; ++i) {
+    hash = lualua_hashpointer(hash, root[i]);
+  }
+  lualua_Sample **bucket = &p->samples[hash % LUALUA_PROFILEBUCKETS];
+  for (lualua_Sample *s = *bucket; s != NULL; s = s->next) {
+    if (s->hash == hash && s->nframes == n &&
+        memcmp(s->frames, root, n * sizeof(*root)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+  lualua_Sample *s = malloc(sizeof(*s) + n * sizeof(*root));
+  if (s == NULL) {
+    return;
+  }
+  s->hash = hash;
+  s->count = 1;
+  s->nframes = n;
+  memcpy(s->frames, root, n * sizeof(*root));
+  s->next = *bucket;
+  *bucket = s;
 }
 
-static void lualua_assert(lua_State *L, lualua_State *S, int cond,
-                          const char *msg) {
-  if (!cond) {
-    lua_settop(S->state, 0);
-    luaL_error(L, msg);
+static const char *lualua_framelabel(lualua_Profile *p, const void *fn) {
+  unsigned bucket = lualua_hashpointer(2166136261u, fn) % LUALUA_PROFILEBUCKETS;
+  for (lualua_Frame *f = p->frames[bucket]; f != NULL; f = f->next) {
+    if (f->fn == fn) {
+      return f->label;
+    }
   }
+  return "?";
 }
 
-static int lualua_absoluteindex(lualua_State *S, int index) {
-  int top = lua_gettop(S->state);
-  return (index < 0 && -index <= top) ? (top + index + 1) : index;
+static void lualua_freeprofile(lualua_Profile *p) {
+  for (int i = 0; i < LUALUA_PROFILEBUCKETS; ++i) {
+    while (p->frames[i] != NULL) {
+      lualua_Frame *f = p->frames[i];
+      p->frames[i] = f->next;
+      free(f);
+    }
+    while (p->samples[i] != NULL) {
+      lualua_Sample *s = p->samples[i];
+      p->samples[i] = s->next;
+      free(s);
+    }
+  }
+  free(p);
 }
 
-static int lualua_checkacceptableindex(lua_State *L, int index,
-                                       lualua_State *S) {
-  int k = luaL_checkint(L, index);
-  lualua_assert(L, S, lualua_isacceptableindex(S, k), "invalid index");
-  return lualua_absoluteindex(S, k);
+/* Instructions until the hook next needs to run. */
+static int lualua_hookcount(lualua_Sandbox *sb) {
+  int count = INT_MAX;
+  if (sb->budget >= 0) {
+    count = sb->budget < sb->granularity ? (int)sb->budget + 1
+                                         : sb->granularity;
+  }
+  if (sb->profile != NULL) {
+    int left = sb->profile->interval - sb->profile->elapsed;
+    count = left < count ? left : count;
+  }
+  return count;
 }
 
-static int lualua_checkacceptablestackindex(lua_State *L, int index,
-                                            lualua_State *S) {
-  int k = luaL_checkint(L, index);
-  lualua_assert(L, S, lualua_isacceptablestackindex(S, k), "invalid index");
-  return lualua_absoluteindex(S, k);
+/*
+ * Count hook charging the sandbox budget and taking profiler samples. Once
+ * the budget runs out, the hook fires on every instruction so that sandbox
+ * code cannot pcall its way past it.
+ */
+static void lualua_hook(lua_State *SS, lua_Debug *ar) {
+  lualua_Sandbox *sb = lualua_getsandbox(SS);
+  if (ar->event != LUA_HOOKCOUNT) {
+    return;
+  }
+  if (!sb->exceeded) {
+    int count = lua_gethookcount(SS);
+    lualua_Profile *p = sb->profile;
+    if (p != NULL && (p->elapsed += count) >= p->interval) {
+      p->elapsed = 0;
+      lualua_sample(SS, p);
+    }
+    if (sb->budget >= 0 && (sb->budget -= count) < 0) {
+      sb->budget = 0;
+      sb->exceeded = 1;
+    }
+  }
+  if (sb->exceeded) {
+    lua_sethook(SS, lualua_hook, LUA_MASKCOUNT, 1);
+    luaL_error(SS, "instruction budget exceeded");
+  }
+  if (sb->budget >= 0 || sb->profile != NULL) {
+    lua_sethook(SS, lualua_hook, LUA_MASKCOUNT, lualua_hookcount(sb));
+  } else {
+    lua_sethook(SS, NULL, 0, 0);
+  }
 }
 
-static void lualua_checkoverflow(lua_State *L, lualua_State *S, int space) {
-  lualua_assert(L, S, S->stackmax - lua_gettop(S->state) >= space,
-                "stack overflow");
+/*
+ * LuaJIT does not run count hooks in compiled code, so hooked calls run with
+ * the JIT compiler off and the traces compiled so far flushed.
+ */
+static void lualua_setjit(lua_State *SS, int on) {
+#ifdef LUAJIT_VERSION
+  if (!on) {
+    luaJIT_setmode(SS, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_FLUSH);
+  }
+  luaJIT_setmode(SS, 0,
+                 LUAJIT_MODE_ENGINE | (on ? LUAJIT_MODE_ON : LUAJIT_MODE_OFF));
+#else
+  (void)SS;
+  (void)on;
+#endif
 }
 
-static void lualua_checkunderflow(lua_State *L, lualua_State *S, int space) {
-  lualua_assert(L, S, lua_gettop(S->state) >= space, "stack underflow");
+/*
+ * Runs sandbox code under lua_pcall, or lua_resume if resume is set, with
+ * the memory limit, instruction budget and profiler in force. Running out
+ * of budget yields LUALUA_ERRBUDGET.
+ */
+static int lualua_run(lualua_State *S, int nargs, int nresults, int errfunc,
+                      int resume) {
+  lualua_Sandbox *sb = S->sandbox;
+  lualua_Alloc *a = sb->alloc;
+  int enforce = a != NULL && a->enforce;
+  if (a != NULL) {
+    a->enforce = 1;
+  }
+  int hooked = sb->depth++ == 0 && (sb->budget >= 0 || sb->profile != NULL);
+  if (hooked) {
+    lualua_setjit(S->state, 0);
+    lua_sethook(S->state, lualua_hook, LUA_MASKCOUNT, lualua_hookcount(sb));
+  }
+  int result = resume ? lua_resume(S->state, nargs)
+                      : lua_pcall(S->state, nargs, nresults, errfunc);
+  if (result != 0 && result != LUA_YIELD && sb->exceeded) {
+    result = LUALUA_ERRBUDGET;
+  }
+  if (--sb->depth == 0) {
+    sb->exceeded = 0;
+    if (hooked) {
+      lua_sethook(S->state, NULL, 0, 0);
+      lualua_setjit(S->state, 1);
+    }
+  }
+  if (a != NULL) {
+    a->enforce = enforce;
+  }
+  return result;
 }
 
-static int lualua_state_gc(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  if (S->stateowner) {
-    lua_close(S->state);
+static int lualua_protectedcall(lualua_State *S, int nargs, int nresults,
+                                int errfunc) {
+  return lualua_run(S, nargs, nresults, errfunc, 0);
+}
+
+/* Sets the budget from the values at the given host indices. */
+static void lualua_dosetbudget(lua_State *L, lualua_Sandbox *sb, int narg,
+                               int budget, int granularity) {
+  lua_Number n = luaL_optnumber(L, budget, -1);
+  luaL_argcheck(L, lua_isnil(L, budget) || n >= 0, narg, "negative budget");
+  int g = luaL_optint(L, granularity, LUALUA_GRANULARITY);
+  luaL_argcheck(L, g > 0, narg, "invalid granularity");
+  sb->budget = n;
+  sb->granularity = g;
+}
+
+/*
+ * Worker threads for asynchronous calls. The pool is shared by the whole
+ * process, started on the first callasync and stopped when the last host
+ * state that loaded lualua closes. While a sandbox runs on a worker, its
+ * future is set; the host may not touch it, host callbacks fail, and host
+ * refs released by sandbox finalizers are deferred until the host joins.
+ */
+
+#define LUALUA_MAXWORKERS 64
+
+typedef struct lualua_Future {
+  struct lualua_Future *next; /* in the job queue */
+  lualua_State *S;
+  int nargs;
+  int nresults;
+  int status;
+  int done;     /* whether the call returned, guarded by the pool mutex */
+  int finished; /* whether the host has seen it return */
+} lualua_Future;
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work; /* signaled when jobs are queued or on shutdown */
+  pthread_cond_t done; /* broadcast whenever a job returns */
+  lualua_Future *head;
+  lualua_Future *tail;
+  int users; /* host states that loaded lualua */
+  int stop;
+  int nworkers;
+  pthread_t workers[LUALUA_MAXWORKERS];
+} lualua_workers = {PTHREAD_MUTEX_INITIALIZER,
+                   PTHREAD_COND_INITIALIZER,
+                   PTHREAD_COND_INITIALIZER,
+                   NULL,
+                   NULL,
+                   0,
+                   0,
+                   0,
+                   {0}};
+
+static void *lualua_worker(void *ud) {
+  pthread_mutex_lock(&lualua_workers.mutex);
+  for (;;) {
+    while (!lualua_workers.stop && lualua_workers.head == NULL) {
+      pthread_cond_wait(&lualua_workers.work, &lualua_workers.mutex);
+    }
+    if (lualua_workers.stop) {
+      break;
+    }
+    lualua_Future *f = lualua_workers.head;
+    lualua_workers.head = f->next;
+    pthread_mutex_unlock(&lualua_workers.mutex);
+    f->status = lualua_protectedcall(f->S, f->nargs, f->nresults, 0);
+    pthread_mutex_lock(&lualua_workers.mutex);
+    f->done = 1;
+    pthread_cond_broadcast(&lualua_workers.done);
   }
-  return 0;
+  pthread_mutex_unlock(&lualua_workers.mutex);
+  return NULL;
 }
 
-static void lualua_safecall(lua_State *L, lualua_State *S, int nargs,
-                            int nresults) {
-  if (lua_pcall(S->state, nargs, nresults, 0) != 0) {
-    lua_pushstring(L, lua_tostring(S->state, -1));
-    lua_settop(S->state, 0);
-    lua_error(L);
+/* Queues f, starting the workers if need be. Returns 0 on failure. */
+static int lualua_submit(lualua_Future *f) {
+  pthread_mutex_lock(&lualua_workers.mutex);
+  if (lualua_workers.nworkers == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > LUALUA_MAXWORKERS ? LUALUA_MAXWORKERS : n;
+    pthread_t *workers = lualua_workers.workers;
+    while (lualua_workers.nworkers < n &&
+           pthread_create(&workers[lualua_workers.nworkers], NULL,
+                          lualua_worker, NULL) == 0) {
+      lualua_workers.nworkers++;
+    }
+  }
+  int ok = lualua_workers.nworkers > 0;
+  if (ok) {
+    f->next = NULL;
+    if (lualua_workers.head == NULL) {
+      lualua_workers.head = f;
+    } else {
+      lualua_workers.tail->next = f;
+    }
+    lualua_workers.tail = f;
+    pthread_cond_signal(&lualua_workers.work);
   }
+  pthread_mutex_unlock(&lualua_workers.mutex);
+  return ok;
 }
 
-static int lualua_call(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int nargs = luaL_checkint(L, 2);
-  int nresults = luaL_checkint(L, 3);
-  lualua_checkunderflow(L, S, nargs + 1);
-  lualua_safecall(L, S, nargs, nresults);
-  return 0;
+static int lualua_isdone(lualua_Future *f) {
+  pthread_mutex_lock(&lualua_workers.mutex);
+  int done = f->done;
+  pthread_mutex_unlock(&lualua_workers.mutex);
+  return done;
 }
 
-static int lualua_argerror(lua_State *L, lualua_State *S, int narg,
-                           const char *extramsg) {
-  lua_Debug ar;
-  if (!lua_getstack(S->state, 0, &ar)) { /* no stack frame? */
-    return luaL_error(L, "bad argument #%d (%s)", narg, extramsg);
+/* Releases the host refs of sandbox objects collected while it was busy. */
+static void lualua_releasedeferred(lualua_Sandbox *sb) {
+  lua_State *L = sb->host;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sb->hostrefs);
+  for (int i = 0; i < sb->ndeferred; ++i) {
+    luaL_unref(L, -1, sb->deferred[i]);
   }
-  lua_getinfo(S->state, "n", &ar);
-  if (strcmp(ar.namewhat, "method") == 0) {
-    narg--;          /* do not count `self' */
-    if (narg == 0) { /* error is in the self argument itself? */
-      return luaL_error(L, "calling '%s' on bad self (%s)", ar.name, extramsg);
+  lua_pop(L, 1);
+  sb->ndeferred = 0;
+#ifndef LUALUA_NOSTATS
+  sb->hoststats->gcuserdata += sb->asyncgced;
+  sb->asyncgced = 0;
+#endif
+}
+
+/* Waits for f to return and hands its sandbox back to the host. */
+static void lualua_finish(lualua_Future *f) {
+  if (f->finished) {
+    return;
+  }
+  pthread_mutex_lock(&lualua_workers.mutex);
+  /*
+   * Run f here if no worker took it yet: the caller may itself be a worker,
+   * as with sandboxes calling asynchronously through openlualua, and waiting
+   * would deadlock once every worker waits on a queued job.
+   */
+  lualua_Future **p = &lualua_workers.head;
+  lualua_Future *prev = NULL;
+  while (*p != NULL && *p != f) {
+    prev = *p;
+    p = &prev->next;
+  }
+  if (*p == f) {
+    *p = f->next;
+    if (lualua_workers.tail == f) {
+      lualua_workers.tail = prev;
     }
+    pthread_mutex_unlock(&lualua_workers.mutex);
+    f->status = lualua_protectedcall(f->S, f->nargs, f->nresults, 0);
+    pthread_mutex_lock(&lualua_workers.mutex);
+    f->done = 1;
   }
-  if (ar.name == NULL) {
-    ar.name = "?";
+  while (!f->done) {
+    pthread_cond_wait(&lualua_workers.done, &lualua_workers.mutex);
   }
-  return luaL_error(L, "bad argument #%d to '%s' (%s)", narg, ar.name,
-                    extramsg);
+  pthread_mutex_unlock(&lualua_workers.mutex);
+  f->finished = 1;
+  lualua_Sandbox *sb = f->S->sandbox;
+  sb->future = NULL;
+  lualua_releasedeferred(sb);
 }
 
-static int lualua_typerror(lua_State *L, lualua_State *S, int narg,
-                           const char *tname) {
-  const char *msg = lua_pushfstring(L, "%s expected, got %s", tname,
-                                    luaL_typename(S->state, narg));
-  return lualua_argerror(L, S, narg, msg);
+static int lualua_workers_gc(lua_State *L) {
+  pthread_mutex_lock(&lualua_workers.mutex);
+  int stop = --lualua_workers.users == 0;
+  lualua_workers.stop = stop;
+  pthread_cond_broadcast(&lualua_workers.work);
+  pthread_mutex_unlock(&lualua_workers.mutex);
+  if (stop) {
+    for (int i = 0; i < lualua_workers.nworkers; ++i) {
+      pthread_join(lualua_workers.workers[i], NULL);
+    }
+    lualua_workers.nworkers = 0;
+    lualua_workers.stop = 0;
+  }
+  return 0;
 }
 
-static int lualua_tagerror(lua_State *L, lualua_State *S, int narg, int tag) {
-  return lualua_typerror(L, S, narg, lua_typename(S->state, tag));
+static void lualua_countref(lualua_Sandbox *sb, int kind, int delta) {
+  if (kind == LUALUA_CALLBACK) {
+    sb->ncallbacks += delta;
+    __sync_add_and_fetch(&lualua_refs.callbacks, delta);
+  } else {
+    sb->nuserdata += delta;
+    __sync_add_and_fetch(&lualua_refs.userdata, delta);
+  }
 }
 
-static int lualua_checknumber(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lua_Number value = lua_tonumber(S->state, index);
-  if (value == 0 && !lua_isnumber(S->state, index)) {
-    return lualua_tagerror(L, S, index, LUA_TNUMBER);
+/* Releases a host ref held by a collected sandbox object. */
+static void lualua_releaseref(lualua_Sandbox *sb, int ref, int kind) {
+  lualua_countref(sb, kind, -1);
+  int busy = sb->future != NULL || sb->ffi != 0;
+#ifndef LUALUA_NOSTATS
+  if (kind == LUALUA_USERDATA && busy) {
+    sb->stats.gcuserdata++;
+    sb->asyncgced++;
+  } else if (kind == LUALUA_USERDATA) {
+    LUALUA_COUNT(sb, gcuserdata, 1);
+  }
+#endif
+  if (busy) {
+    /*
+     * The host is busy on another thread or in an FFI call; lualua_finish or
+     * the next method call releases the ref.
+     */
+    if (sb->ndeferred == sb->maxdeferred) {
+      int n = sb->maxdeferred * 2 + 16;
+      int *deferred = realloc(sb->deferred, n * sizeof(*deferred));
+      if (deferred == NULL) {
+        return;
+      }
+      sb->deferred = deferred;
+      sb->maxdeferred = n;
+    }
+    sb->deferred[sb->ndeferred++] = ref;
+    return;
+  }
+  lua_State *L = sb->host;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sb->hostrefs);
+  luaL_unref(L, -1, ref);
+  lua_pop(L, 1);
+}
+
+typedef struct {
+  int ref;
+  int kind;
+  int handedoff; /* whether a collected token passed the ref on to this one */
+} lualua_Gctoken;
+
+/*
+ * Lua 5.1 runs the finalizers of a cycle newest first, so a token may be
+ * collected before an older object whose __gc still calls its callback.
+ * Tokens therefore hand their ref to a fresh token, which is only collected
+ * in the next cycle. lua_close finalizes everything at once, so closing
+ * sandboxes release refs right away.
+ */
+static int lualua_gctoken_gc(lua_State *SS) {
+  lualua_Gctoken *t = lua_touserdata(SS, 1);
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(1));
+  if (t->handedoff || sb->closing) {
+    lualua_releaseref(sb, t->ref, t->kind);
+  } else {
+    lualua_Gctoken *u = lua_newuserdata(SS, sizeof(*u));
+    u->ref = t->ref;
+    u->kind = t->kind;
+    u->handedoff = 1;
+    lua_getmetatable(SS, 1);
+    lua_setmetatable(SS, -2);
+  }
+  ++sb->ntokensgced;
+  return 0;
+}
+
+/*
+ * Host-backed userdata hold their own host ref and release it from __gc.
+ * They start out with a shared, protected metatable; metatables set by the
+ * host get the same __gc unless they already have one, in which case the
+ * ref falls back to a gctoken kept in the weak gctokens table.
+ */
+typedef struct {
+  int ref;
+  int tokenized; /* whether a gctoken owns the ref instead */
+} lualua_Hostdata;
+
+/*
+ * Returns the userdata at index if its environment is env and it holds at
+ * least size bytes; needs one slot.
+ */
+static void *lualua_touserdatain(lua_State *SS, int index, const void *env,
+                                 size_t size) {
+  if (lua_type(SS, index) != LUA_TUSERDATA || lua_objlen(SS, index) < size) {
+    return NULL;
+  }
+  lua_getfenv(SS, index);
+  int same = lua_topointer(SS, -1) == env;
+  lua_pop(SS, 1);
+  return same ? lua_touserdata(SS, index) : NULL;
+}
+
+/* Returns the host-backed userdata at index, or NULL; needs one slot. */
+static lualua_Hostdata *lualua_tohostdata(lua_State *SS, int index,
+                                          lualua_Sandbox *sb) {
+  return lualua_touserdatain(SS, index, sb->userdata, sizeof(lualua_Hostdata));
+}
+
+/*
+ * lualua userdata are recognized by their environments, so neither may
+ * theirs be changed nor may others get one of theirs. Checks setting the
+ * table on top as the environment of the value at index; needs one slot.
+ */
+static int lualua_canchangeenv(lua_State *SS, lualua_Sandbox *sb, int index) {
+  const void *env = lua_topointer(SS, -1);
+  return env != sb->userdata && env != sb->buffers &&
+         lualua_touserdatain(SS, index, sb->userdata, 0) == NULL &&
+         lualua_touserdatain(SS, index, sb->buffers, 0) == NULL;
+}
+
+static int lualua_userdata_gc(lua_State *SS) {
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(1));
+  lualua_Hostdata *u = lualua_tohostdata(SS, 1, sb);
+  if (u != NULL && !u->tokenized && u->ref != LUA_NOREF) {
+    lualua_releaseref(sb, u->ref, LUALUA_USERDATA);
+    u->ref = LUA_NOREF;
+  }
+  return 0;
+}
+
+static lualua_State *lualua_newwrapper(lua_State *L, lua_State *SS,
+                                       lualua_Sandbox *sb) {
+  lualua_State *p = lua_newuserdata(L, sizeof(*p));
+  luaL_getmetatable(L, lualua_state_metatable);
+  lua_setmetatable(L, -2);
+  p->state = SS;
+  p->stackmax = LUA_MINSTACK;
+  p->stateowner = 0;
+  p->sandbox = sb;
+  p->threadref = LUA_NOREF;
+  return p;
+}
+
+static int lualua_newstate(lua_State *L) {
+  lualua_Alloc *alloc;
+  lua_State *SS = lualua_newsandbox(L, 1, &alloc);
+  lualua_State *p = lua_newuserdata(L, sizeof(*p));
+  luaL_getmetatable(L, lualua_state_metatable);
+  lua_setmetatable(L, -2);
+  lua_newtable(SS);
+#ifndef LUALUA_NOSTATS
+  /* The sandbox's method counters follow it in the same userdata. */
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_stats_refname);
+  lualua_Stats *stats = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  lualua_Sandbox *sb = lua_newuserdata(
+      SS, sizeof(*sb) + stats->nmethods * sizeof(*stats->methods));
+#else
+  lualua_Sandbox *sb = lua_newuserdata(SS, sizeof(*sb));
+#endif
+  lua_setfield(SS, -2, "sandbox");
+  sb->host = L;
+  sb->alloc = alloc;
+  sb->budget = -1;
+  sb->granularity = LUALUA_GRANULARITY;
+  sb->exceeded = 0;
+  sb->depth = 0;
+  sb->closing = 0;
+  sb->trying = 0;
+  sb->ntokensgced = 0;
+  sb->profile = NULL;
+  sb->pool = NULL;
+  sb->idle = 0;
+  sb->future = NULL;
+  sb->ffi = 0;
+  sb->deferred = NULL;
+  sb->ndeferred = 0;
+  sb->maxdeferred = 0;
+  sb->strings = NULL;
+  sb->nstrings = 0;
+  sb->stringhits = 0;
+  sb->stringmisses = 0;
+  sb->ncallbacks = 0;
+  sb->nuserdata = 0;
+#ifndef LUALUA_NOSTATS
+  memset(&sb->stats, 0, sizeof(sb->stats));
+  sb->stats.nmethods = stats->nmethods;
+  sb->stats.methods = (lualua_MethodStats *)(sb + 1);
+  memset(sb->stats.methods, 0, stats->nmethods * sizeof(*stats->methods));
+  sb->hoststats = stats;
+  sb->asyncgced = 0;
+#endif
+  __sync_add_and_fetch(&lualua_refs.states, 1);
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  sb->hostrefs = luaL_ref(L, LUA_REGISTRYINDEX);
+  sb->wrapper = lualua_newwrapper(L, SS, sb);
+  sb->wrapperref = luaL_ref(L, -2);
+  lua_pop(L, 1);
+  lua_newtable(SS);
+  lua_newtable(SS);
+  lua_pushstring(SS, "k");
+  lua_setfield(SS, -2, "__mode");
+  lua_setmetatable(SS, -2);
+  lua_setfield(SS, -2, "gctokens");
+  lua_newtable(SS);
+  lua_newtable(SS);
+  lua_pushstring(SS, "kv");
+  lua_setfield(SS, -2, "__mode");
+  lua_setmetatable(SS, -2);
+  lua_setfield(SS, -2, "mtcopies");
+  lua_newtable(SS);
+  lua_newtable(SS);
+  lua_pushstring(SS, "k");
+  lua_setfield(SS, -2, "__mode");
+  lua_setmetatable(SS, -2);
+  lua_setfield(SS, -2, "mtoriginals");
+  lua_newtable(SS);
+  lua_newtable(SS);
+  lua_pushstring(SS, "k");
+  lua_setfield(SS, -2, "__mode");
+  lua_setmetatable(SS, -2);
+  lua_setfield(SS, -2, "finished");
+  lua_newtable(SS);
+  lua_pushstring(SS, "__gc");
+  lua_pushlightuserdata(SS, sb);
+  lua_pushcclosure(SS, lualua_gctoken_gc, 1);
+  lua_settable(SS, -3);
+  lua_pushstring(SS, "__metatable");
+  lua_pushstring(SS, lualua_gctoken_metatable);
+  lua_settable(SS, -3);
+  lua_setfield(SS, -2, "gctokenmt");
+  lua_newtable(SS);
+  sb->buffers = lua_topointer(SS, -1);
+  lua_setfield(SS, -2, "buffers");
+  lua_newtable(SS);
+  sb->userdata = lua_topointer(SS, -1);
+  lua_setfield(SS, -2, "userdata");
+  lua_newtable(SS);
+  sb->userdatamt = lua_topointer(SS, -1);
+  lua_pushstring(SS, "__gc");
+  lua_pushlightuserdata(SS, sb);
+  lua_pushcclosure(SS, lualua_userdata_gc, 1);
+  lua_settable(SS, -3);
+  lua_pushstring(SS, "__metatable");
+  lua_pushboolean(SS, 0);
+  lua_settable(SS, -3);
+  lua_setfield(SS, -2, "userdatamt");
+  lua_setfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  if (alloc != NULL) {
+    lualua_newsentinel(SS, alloc);
+  }
+  p->state = SS;
+  p->stackmax = LUA_MINSTACK;
+  p->stateowner = 1;
+  p->sandbox = sb;
+  p->threadref = LUA_NOREF;
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_owners_refname);
+  lua_pushlightuserdata(L, sb);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* Compare to luaL_testudata, which Lua 5.1 lacks. */
+static lualua_State *lualua_tostate(lua_State *L, int index) {
+  lualua_State *S = lua_touserdata(L, index);
+  if (S == NULL || !lua_getmetatable(L, index)) {
+    return NULL;
+  }
+  luaL_getmetatable(L, lualua_state_metatable);
+  int same = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return same ? S : NULL;
+}
+
+static lualua_State *lualua_checkstate(lua_State *L, int index) {
+  lualua_State *S = luaL_checkudata(L, index, lualua_state_metatable);
+  if (S->sandbox->future != NULL) {
+    luaL_error(L, "state is busy");
+  }
+  if (S->sandbox->ndeferred != 0) {
+    lualua_releasedeferred(S->sandbox);
+  }
+#ifndef LUALUA_NOSTATS
+  intptr_t method = (intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+  if (method != 0 && index == 1) {
+    S->sandbox->stats.methods[method - 1].calls++;
+    S->sandbox->hoststats->methods[method - 1].calls++;
+  }
+#endif
+  return S;
+}
+
+static int lualua_isacceptablestackindex(lualua_State *S, int index) {
+  return (index > 0 && index <= S->stackmax) ||
+         (index < 0 && -index <= lua_gettop(S->state));
+}
+
+static int lualua_ispseudoindex(int index) {
+  return index == LUA_GLOBALSINDEX || index == LUA_REGISTRYINDEX ||
+#ifdef LUALUA_IS_ELUNE
+         index == LUA_ERRORHANDLERINDEX ||
+#endif
+         index == LUA_ENVIRONINDEX;
+}
+
+static int lualua_isacceptableindex(lualua_State *S, int index) {
+  return lualua_isacceptablestackindex(S, index) || lualua_ispseudoindex(index);
+}
+
+/* Empties the stack of a state whose method failed, unless under try. */
+static void lualua_clearstack(lualua_State *S) {
+  if (!S->sandbox->trying) {
+    lua_settop(S->state, 0);
+  }
+}
+
+static void lualua_assert(lua_State *L, lualua_State *S, int cond,
+                          const char *msg) {
+  if (!cond) {
+    LUALUA_COUNT(S->sandbox, errors, 1);
+    lualua_clearstack(S);
+    luaL_error(L, msg);
+  }
+}
+
+static int lualua_absoluteindex(lualua_State *S, int index) {
+  int top = lua_gettop(S->state);
+  return (index < 0 && -index <= top) ? (top + index + 1) : index;
+}
+
+static int lualua_checkacceptableindex(lua_State *L, int index,
+                                       lualua_State *S) {
+  int k = luaL_checkint(L, index);
+  lualua_assert(L, S, lualua_isacceptableindex(S, k), "invalid index");
+  return lualua_absoluteindex(S, k);
+}
+
+static int lualua_checkacceptablestackindex(lua_State *L, int index,
+                                            lualua_State *S) {
+  int k = luaL_checkint(L, index);
+  lualua_assert(L, S, lualua_isacceptablestackindex(S, k), "invalid index");
+  return lualua_absoluteindex(S, k);
+}
+
+static void lualua_checkoverflow(lua_State *L, lualua_State *S, int space) {
+  lualua_assert(L, S, S->stackmax - lua_gettop(S->state) >= space,
+                "stack overflow");
+}
+
+static void lualua_checkunderflow(lua_State *L, lualua_State *S, int space) {
+  lualua_assert(L, S, lua_gettop(S->state) >= space, "stack underflow");
+}
+
+/*
+ * Host string cache. Strings moved into a sandbox are interned there, which
+ * means hashing them on every transfer. The cache maps the address of a
+ * host string to a sandbox registry ref for an equal sandbox string, so a
+ * hot key costs a pointer hash and a short compare instead. Entries keep a
+ * copy of their contents, since a collected host string's address may be
+ * reused by a different string.
+ */
+
+#define LUALUA_MAXCACHEDSTRING 40
+
+struct lualua_CachedString {
+  const char *key; /* address of the host string's contents */
+  size_t len;
+  int ref; /* sandbox registry ref, or LUA_NOREF if the entry is empty */
+  char copy[LUALUA_MAXCACHEDSTRING];
+};
+
+/* Pushes a host string onto the sandbox; needs one slot. */
+static void lualua_pushhoststring(lualua_Sandbox *sb, lua_State *SS,
+                                  const char *s, size_t len) {
+  if (sb->nstrings == 0 || len > LUALUA_MAXCACHEDSTRING) {
+    LUALUA_COUNT(sb, bytescopied, len);
+    lua_pushlstring(SS, s, len);
+    return;
+  }
+  unsigned h = lualua_hashpointer(2166136261u, s);
+  lualua_CachedString *c = &sb->strings[h % sb->nstrings];
+  if (c->key == s && c->len == len && c->ref != LUA_NOREF &&
+      memcmp(c->copy, s, len) == 0) {
+    sb->stringhits++;
+    lua_rawgeti(SS, LUA_REGISTRYINDEX, c->ref);
+    return;
+  }
+  sb->stringmisses++;
+  LUALUA_COUNT(sb, bytescopied, len);
+  luaL_unref(SS, LUA_REGISTRYINDEX, c->ref);
+  lua_pushlstring(SS, s, len);
+  c->ref = luaL_ref(SS, LUA_REGISTRYINDEX);
+  c->key = s;
+  c->len = len;
+  memcpy(c->copy, s, len);
+  lua_rawgeti(SS, LUA_REGISTRYINDEX, c->ref);
+}
+
+/*
+ * Pushes the host scalar at index onto the sandbox; needs one slot. Returns 0
+ * without pushing anything if the value is not a scalar.
+ */
+static int lualua_pushhostscalar(lua_State *L, lualua_State *S, int index) {
+  switch (lua_type(L, index)) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+      lua_pushnil(S->state);
+      return 1;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(S->state, lua_toboolean(L, index));
+      return 1;
+    case LUA_TNUMBER:
+      lua_pushnumber(S->state, lua_tonumber(L, index));
+      return 1;
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, index, &len);
+      lualua_pushhoststring(S->sandbox, S->state, s, len);
+      return 1;
+    }
+    default:
+      return 0;
+  }
+}
+
+static void lualua_pusharg(lua_State *L, lualua_State *S, int narg) {
+  if (!lualua_pushhostscalar(L, S, narg)) {
+    lualua_clearstack(S);
+    luaL_typerror(L, narg, "scalar");
+  }
+}
+
+/* Forgets every entry, releasing their refs unless release is 0. */
+static void lualua_clearstrings(lualua_Sandbox *sb, lua_State *SS,
+                                int release) {
+  for (int i = 0; i < sb->nstrings; ++i) {
+    if (release) {
+      luaL_unref(SS, LUA_REGISTRYINDEX, sb->strings[i].ref);
+    }
+    sb->strings[i].key = NULL;
+    sb->strings[i].ref = LUA_NOREF;
+  }
+}
+
+/* Pushes a value from one side onto the other as a string, or nil. */
+static void lualua_copystring(lualua_Sandbox *sb, lua_State *to,
+                              lua_State *from, int index) {
+  size_t len;
+  const char *s = lua_tolstring(from, index, &len);
+  if (s == NULL) {
+    lua_pushnil(to);
+  } else {
+    LUALUA_COUNT(sb, bytescopied, len);
+    lua_pushlstring(to, s, len);
+  }
+}
+
+static int lualua_state_gc(lua_State *L) {
+  lualua_State *S = luaL_checkudata(L, 1, lualua_state_metatable);
+  /* The callback wrapper may outlive its sandbox, so leave it alone. */
+  if (!S->stateowner && S->threadref == LUA_NOREF) {
+    return 0;
+  }
+  if (S->sandbox->future != NULL) {
+    lualua_finish(S->sandbox->future);
+  }
+  if (S->threadref != LUA_NOREF) {
+    luaL_unref(S->state, LUA_REGISTRYINDEX, S->threadref);
+  }
+  if (S->stateowner) {
+    free(S->sandbox->deferred);
+    /* Finalizers may still push strings, so turn the cache off. */
+    free(S->sandbox->strings);
+    S->sandbox->strings = NULL;
+    S->sandbox->nstrings = 0;
+    /* Finalizers run by lua_close still need the host refs. */
+    int hostrefs = S->sandbox->hostrefs;
+    int wrapperref = S->sandbox->wrapperref;
+    lualua_Alloc *alloc = S->sandbox->alloc;
+    lualua_Profile *profile = S->sandbox->profile;
+    S->sandbox->closing = 1;
+    lua_close(S->state);
+    if (alloc != NULL) {
+      lualua_freealloc(alloc);
+    }
+    if (profile != NULL) {
+      lualua_freeprofile(profile);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hostrefs);
+    luaL_unref(L, -1, wrapperref);
+    int orphaned = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      orphaned += lua_type(L, -1) != LUA_TNUMBER;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    __sync_add_and_fetch(&lualua_refs.orphaned, orphaned);
+    __sync_sub_and_fetch(&lualua_refs.states, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, hostrefs);
+  }
+  return 0;
+}
+
+static void lualua_safecall(lua_State *L, lualua_State *S, int nargs,
+                            int nresults) {
+  LUALUA_COUNT(S->sandbox, safecalls, 1);
+  if (lualua_protectedcall(S, nargs, nresults, 0) != 0) {
+    lualua_copystring(S->sandbox, L, S->state, -1);
+    lua_pop(S->state, 1);
+    lualua_clearstack(S);
+    lua_error(L);
+  }
+}
+
+static int lualua_call(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int nargs = luaL_checkint(L, 2);
+  int nresults = luaL_checkint(L, 3);
+  lualua_checkunderflow(L, S, nargs + 1);
+  lualua_safecall(L, S, nargs, nresults);
+  return 0;
+}
+
+/*
+ * Pushes what objects made through the state at host index 1 keep alive:
+ * that state, unless it is the callback wrapper, which may outlive its
+ * sandbox. The state owning the sandbox is pushed instead then.
+ */
+static void lualua_pushanchor(lua_State *L, lualua_State *S) {
+  if (S->stateowner || S->threadref != LUA_NOREF) {
+    lua_pushvalue(L, 1);
+    return;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_owners_refname);
+  lua_pushlightuserdata(L, S->sandbox);
+  lua_rawget(L, -2);
+  lua_remove(L, -2);
+  /* Finalizers run by lua_close may call back after the owner is gone. */
+  lualua_assert(L, S, !lua_isnil(L, -1), "state is closing");
+}
+
+/* Makes the userdata on top keep the anchor below it alive, and pops that. */
+static void lualua_setanchor(lua_State *L) {
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, -3);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  lua_remove(L, -2);
+}
+
+static int lualua_callasync(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int nargs = luaL_checkint(L, 2);
+  int nresults = luaL_checkint(L, 3);
+  lualua_assert(L, S, S->sandbox->depth == 0,
+                "cannot call asynchronously from a callback");
+  lualua_checkunderflow(L, S, nargs + 1);
+  lualua_checkoverflow(L, S, 1);
+  lualua_pushanchor(L, S);
+  lualua_Future *f = lua_newuserdata(L, sizeof(*f));
+  f->S = S;
+  f->nargs = nargs;
+  f->nresults = nresults;
+  f->status = 0;
+  f->done = 0;
+  f->finished = 1; /* until submitted, so that __gc does not wait on it */
+  luaL_getmetatable(L, lualua_future_metatable);
+  lua_setmetatable(L, -2);
+  /* Keep the state alive for as long as the future. */
+  lualua_setanchor(L);
+  S->sandbox->future = f;
+  f->finished = 0;
+  if (!lualua_submit(f)) {
+    S->sandbox->future = NULL;
+    f->finished = 1;
+    return luaL_error(L, "unable to start worker threads");
+  }
+  return 1;
+}
+
+static int lualua_argerror(lua_State *L, lualua_State *S, int narg,
+                           const char *extramsg) {
+  lua_Debug ar;
+  if (!lua_getstack(S->state, 0, &ar)) { /* no stack frame? */
+    return luaL_error(L, "bad argument #%d (%s)", narg, extramsg);
+  }
+  lua_getinfo(S->state, "n", &ar);
+  if (strcmp(ar.namewhat, "method") == 0) {
+    narg--;          /* do not count `self' */
+    if (narg == 0) { /* error is in the self argument itself? */
+      return luaL_error(L, "calling '%s' on bad self (%s)", ar.name, extramsg);
+    }
+  }
+  if (ar.name == NULL) {
+    ar.name = "?";
+  }
+  return luaL_error(L, "bad argument #%d to '%s' (%s)", narg, ar.name,
+                    extramsg);
+}
+
+static int lualua_typerror(lua_State *L, lualua_State *S, int narg,
+                           const char *tname) {
+  const char *msg = lua_pushfstring(L, "%s expected, got %s", tname,
+                                    luaL_typename(S->state, narg));
+  return lualua_argerror(L, S, narg, msg);
+}
+
+static int lualua_tagerror(lua_State *L, lualua_State *S, int narg, int tag) {
+  return lualua_typerror(L, S, narg, lua_typename(S->state, tag));
+}
+
+static int lualua_checknumber(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lua_Number value = lua_tonumber(S->state, index);
+  if (value == 0 && !lua_isnumber(S->state, index)) {
+    return lualua_tagerror(L, S, index, LUA_TNUMBER);
+  }
+  lua_pushnumber(L, value);
+  return 1;
+}
+
+static int lualua_checkstack(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = luaL_checkint(L, 2);
+  int value = lua_checkstack(S->state, index);
+  if (value && index > 0) {
+    S->stackmax += index;
+  }
+  lua_pushboolean(L, value);
+  return 1;
+}
+
+static int lualua_checkstring(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  if (!lua_isstring(S->state, index)) {
+    return lualua_tagerror(L, S, index, LUA_TSTRING);
+  }
+  lualua_copystring(S->sandbox, L, S->state, index);
+  return 1;
+}
+
+/*
+ * Raw-first fast paths. Accesses that cannot run metamethods cannot raise
+ * errors either, so they are done directly instead of through a protected
+ * trampoline. Each returns 0, leaving the stack untouched, when the access
+ * has to take the slow path.
+ */
+
+static void lualua_checktemporaries(lua_State *L, lualua_State *S, int n) {
+  if (!lua_checkstack(S->state, n)) {
+    luaL_error(L, "stack overflow");
+  }
+}
+
+static int lualua_fastconcat(lua_State *SS, int n) {
+  for (int i = 1; i <= n; ++i) {
+    if (!lua_isstring(SS, -i)) {
+      return 0;
+    }
+  }
+  lua_concat(SS, n);
+  return 1;
+}
+
+/* Expects the key on top; replaces it with the value. */
+static int lualua_fastget(lua_State *SS, int index) {
+  if (lua_type(SS, index) != LUA_TTABLE) {
+    return 0;
+  }
+  lua_pushvalue(SS, -1);
+  lua_rawget(SS, index);
+  if (!lua_isnil(SS, -1) || !luaL_getmetafield(SS, index, "__index")) {
+    lua_remove(SS, -2);
+    return 1;
+  }
+  lua_pop(SS, 2);
+  return 0;
+}
+
+static int lualua_fastlessthan(lua_State *SS, int index1, int index2,
+                               int *result) {
+  int t1 = lua_type(SS, index1);
+  int t2 = lua_type(SS, index2);
+  if (t1 == LUA_TNUMBER && t2 == LUA_TNUMBER) {
+    *result = lua_tonumber(SS, index1) < lua_tonumber(SS, index2);
+    return 1;
+  } else if (t1 == LUA_TSTRING && t2 == LUA_TSTRING) {
+    *result = lua_lessthan(SS, index1, index2);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Expects the key and then the value on top; pops both. A relative index
+ * is fine since it is used before anything is pushed.
+ */
+static int lualua_fastset(lua_State *SS, int index) {
+  int keytype = lua_type(SS, -2);
+  lua_Number n = lua_tonumber(SS, -2);
+  if (lua_type(SS, index) != LUA_TTABLE || keytype == LUA_TNIL ||
+      (keytype == LUA_TNUMBER && n != n)) {
+    return 0;
+  }
+  lua_pushvalue(SS, index);
+  lua_pushvalue(SS, -3);
+  lua_rawget(SS, -2);
+  if (!lua_isnil(SS, -1) || !luaL_getmetafield(SS, -2, "__newindex")) {
+    lua_pop(SS, 1);
+    lua_insert(SS, -3);
+    lua_rawset(SS, -3);
+    lua_pop(SS, 1);
+    return 1;
+  }
+  lua_pop(SS, 3);
+  return 0;
+}
+
+static int lualua_doconcat(lua_State *SS) {
+  lua_concat(SS, lua_gettop(SS));
+  return 1;
+}
+
+static int lualua_concat(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int n = luaL_checkint(L, 2);
+  if (n >= 0) {
+    lualua_checkunderflow(L, S, n);
+    lualua_checkoverflow(L, S, 1);
+    if (lualua_fastconcat(S->state, n)) {
+      return 0;
+    }
+    lua_pushcfunction(S->state, lualua_doconcat);
+    lua_insert(S->state, -n - 1);
+    lualua_safecall(L, S, n, 1);
+  }
+  return 0;
+}
+
+static int lualua_createtable(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int narr = luaL_checkint(L, 2);
+  int nrec = luaL_checkint(L, 3);
+  lualua_checkoverflow(L, S, 1);
+  lua_createtable(S->state, narr, nrec);
+  return 0;
+}
+
+static int lualua_bufwriter(lua_State *SS, const void *p, size_t sz,
+                            void *ud) {
+  luaL_addlstring(ud, p, sz);
+  return 0;
+}
+
+static int lualua_dump(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checkoverflow(L, S, 1);
+  lua_pushvalue(S->state, index);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  int value = lua_dump(S->state, lualua_bufwriter, &b);
+  lua_pop(S->state, 1);
+  lualua_assert(L, S, value == 0, "unable to dump given function");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/*
+ * Bulk table iteration. Scalar keys and values are converted in C; others
+ * come back as host tables holding their type name and, unless opts.refs is
+ * false, a sandbox registry ref to them that the host must release.
+ */
+
+#define LUALUA_BATCHSIZE 64
+
+typedef struct {
+  int max;  /* entries per batch */
+  int refs; /* whether to ref keys and values that are not scalars */
+} lualua_Batch;
+
+static void lualua_optbatch(lua_State *L, int narg, lualua_Batch *b) {
+  b->max = LUALUA_BATCHSIZE;
+  b->refs = 1;
+  if (lua_isnoneornil(L, narg)) {
+    return;
+  }
+  luaL_checktype(L, narg, LUA_TTABLE);
+  lua_getfield(L, narg, "max");
+  b->max = luaL_optint(L, -1, LUALUA_BATCHSIZE);
+  luaL_argcheck(L, b->max > 0, narg, "invalid max");
+  lua_getfield(L, narg, "refs");
+  b->refs = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_pop(L, 2);
+}
+
+/* Pushes a sandbox key or value onto the host; needs one sandbox slot. */
+static void lualua_pushentry(lua_State *L, lualua_State *S, int index,
+                             int refs) {
+  lua_State *SS = S->state;
+  switch (lua_type(SS, index)) {
+    case LUA_TNIL:
+      lua_pushnil(L);
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(L, lua_toboolean(SS, index));
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(L, lua_tonumber(SS, index));
+      break;
+    case LUA_TSTRING:
+      lualua_copystring(S->sandbox, L, SS, index);
+      break;
+    default:
+      lua_createtable(L, 0, 2);
+      lua_pushstring(L, luaL_typename(SS, index));
+      lua_setfield(L, -2, "type");
+      if (refs) {
+        lua_pushvalue(SS, index);
+        lua_pushinteger(L, luaL_ref(SS, LUA_REGISTRYINDEX));
+        lua_setfield(L, -2, "ref");
+      }
+  }
+}
+
+/*
+ * Pops a key and stores up to max of the entries after it in the host tables
+ * at keys and values. Returns how many it stored; if that is max, the last
+ * key is left on the stack for the next batch. Needs three sandbox slots.
+ */
+static int lualua_nextbatch(lua_State *L, lualua_State *S, int index,
+                            const lualua_Batch *b, int keys, int values) {
+  lua_State *SS = S->state;
+  for (int n = 1; n <= b->max; ++n) {
+    if (!lua_next(SS, index)) {
+      return n - 1;
+    }
+    lualua_pushentry(L, S, -2, b->refs);
+    lua_rawseti(L, keys, n);
+    lualua_pushentry(L, S, -1, b->refs);
+    lua_rawseti(L, values, n);
+    lua_pop(SS, 1);
+  }
+  return b->max;
+}
+
+static int lualua_entries(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_Batch b;
+  lualua_optbatch(L, 3, &b);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checkunderflow(L, S, 1);
+  lualua_checktemporaries(L, S, 3);
+  lua_settop(L, 3);
+  lua_newtable(L);
+  lua_newtable(L);
+  int n = lualua_nextbatch(L, S, index, &b, 4, 5);
+  lua_pushboolean(L, n == b.max);
+  return 3;
+}
+
+static int lualua_equal(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index1 = lualua_checkacceptableindex(L, 2, S);
+  int index2 = lualua_checkacceptableindex(L, 3, S);
+  int value = lua_equal(S->state, index1, index2);
+  lua_pushboolean(L, value);
+  return 1;
+}
+
+static int lualua_error(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkunderflow(L, S, 1);
+  lualua_copystring(S->sandbox, L, S->state, -1);
+  lua_pop(S->state, 1);
+  lualua_clearstack(S);
+  return lua_error(L);
+}
+
+/* Bounds the collections of one GCCOLLECT, should finalizers make tokens. */
+#define LUALUA_MAXCOLLECTS 8
+
+/* Counts the userdata that rely on a gctoken in the weak table. */
+static int lualua_counttokens(lua_State *SS) {
+  int n = 0;
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "gctokens");
+  lua_pushnil(SS);
+  while (lua_next(SS, -2)) {
+    ++n;
+    lua_pop(SS, 1);
+  }
+  lua_pop(SS, 2);
+  return n;
+}
+
+static int lualua_dogc(lua_State *SS) {
+  int what = lua_tointeger(SS, 1);
+  int data = lua_tointeger(SS, 2);
+  if (what != LUA_GCCOLLECT) {
+    lua_pushinteger(SS, lua_gc(SS, what, data));
+    return 1;
+  }
+  /*
+   * Tokens release their refs a cycle after they are collected, and tokens
+   * held by finalized objects are only collected a cycle after those, so
+   * collect again while tokens are being finalized. A weak table entry is
+   * cleared a cycle before its token is finalized, and one whose userdata is
+   * finalized a cycle before that, so while the table holds any, stop only
+   * after two cycles in a row changed neither.
+   */
+  lualua_Sandbox *sb = lualua_getsandbox(SS);
+  int ntokens = lualua_counttokens(SS);
+  int idle = 0;
+  int ncollects = 0;
+  while (idle < (ntokens > 0 ? 2 : 1) && ncollects++ < LUALUA_MAXCOLLECTS) {
+    int ntokensgced = sb->ntokensgced;
+    int before = ntokens;
+    lua_gc(SS, LUA_GCCOLLECT, 0);
+    ntokens = lualua_counttokens(SS);
+    idle = sb->ntokensgced == ntokensgced && ntokens == before ? idle + 1 : 0;
+  }
+  lua_pushinteger(SS, 0);
+  return 1;
+}
+
+static int lualua_gc(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int what = luaL_checkint(L, 2);
+  int data = luaL_optint(L, 3, 0);
+  int result;
+  switch (what) {
+    case LUA_GCCOLLECT:
+    case LUA_GCSTEP:
+      /* These may run finalizers, which may run sandbox code. */
+      lualua_checkoverflow(L, S, 3);
+      lua_pushcfunction(S->state, lualua_dogc);
+      lua_pushinteger(S->state, what);
+      lua_pushinteger(S->state, data);
+      lualua_safecall(L, S, 2, 1);
+      result = lua_tointeger(S->state, -1);
+      lua_pop(S->state, 1);
+      break;
+    case LUA_GCSTOP:
+    case LUA_GCRESTART:
+    case LUA_GCCOUNT:
+    case LUA_GCCOUNTB:
+    case LUA_GCSETPAUSE:
+    case LUA_GCSETSTEPMUL:
+      result = lua_gc(S->state, what, data);
+      break;
+    default:
+      return luaL_argerror(L, 2, "invalid option");
+  }
+  lua_pushinteger(L, result);
+  return 1;
+}
+
+static int lualua_getbudget(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  if (S->sandbox->budget < 0) {
+    lua_pushnil(L);
+  } else {
+    lua_pushnumber(L, S->sandbox->budget);
+  }
+  return 1;
+}
+
+static int lualua_getfenv(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checkoverflow(L, S, 1);
+  lua_getfenv(S->state, index);
+  return 0;
+}
+
+static int lualua_dogetfield(lua_State *SS) {
+  lua_gettable(SS, 1);
+  return 1;
+}
+
+static void lualua_getfieldop(lua_State *L, lualua_State *S, int index,
+                              const char *k, size_t klen) {
+  lualua_checktemporaries(L, S, 4);
+  lualua_pushhoststring(S->sandbox, S->state, k, klen);
+  if (lualua_fastget(S->state, index)) {
+    return;
+  }
+  lua_pushvalue(S->state, index);
+  lua_insert(S->state, -2);
+  lua_pushcfunction(S->state, lualua_dogetfield);
+  lua_insert(S->state, -3);
+  lualua_safecall(L, S, 2, 1);
+}
+
+static int lualua_getfield(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  size_t klen;
+  const char *k = luaL_checklstring(L, 3, &klen);
+  lualua_checkoverflow(L, S, 3);
+  lualua_getfieldop(L, S, index, k, klen);
+  return 0;
+}
+
+static int lualua_getglobal(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t klen;
+  const char *k = luaL_checklstring(L, 2, &klen);
+  lualua_checkoverflow(L, S, 1);
+  lualua_pushhoststring(S->sandbox, S->state, k, klen);
+  lua_gettable(S->state, LUA_GLOBALSINDEX);
+  return 0;
+}
+
+static int lualua_getmetatable(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checkoverflow(L, S, 1);
+  lualua_checktemporaries(L, S, 2);
+  lua_State *SS = S->state;
+  int result = lua_getmetatable(SS, index);
+  if (result && lua_topointer(SS, -1) == S->sandbox->userdatamt) {
+    lua_pop(SS, 1);
+    result = 0;
+  } else if (result && lua_type(SS, index) == LUA_TUSERDATA) {
+    /* Show the host the table it set rather than lualua's copy. */
+    lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+    lua_getfield(SS, -1, "mtoriginals");
+    lua_pushvalue(SS, -3);
+    lua_rawget(SS, -2);
+    if (lua_isnil(SS, -1)) {
+      lua_pop(SS, 1);
+    } else {
+      lua_replace(SS, -4);
+    }
+    lua_pop(SS, 2);
+  }
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_dogettable(lua_State *SS) {
+  lua_gettable(SS, -2);
+  return 1;
+}
+
+static void lualua_gettableop(lua_State *L, lualua_State *S, int index) {
+  lualua_checktemporaries(L, S, 3);
+  if (lualua_fastget(S->state, index)) {
+    return;
+  }
+  lua_pushvalue(S->state, index);
+  lua_pushcfunction(S->state, lualua_dogettable);
+  lua_insert(S->state, -3);
+  lua_insert(S->state, -2);
+  lualua_safecall(L, S, 2, 1);
+}
+
+static int lualua_gettable(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checkoverflow(L, S, 2);
+  lualua_gettableop(L, S, index);
+  return 0;
+}
+
+static int lualua_gettop(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_pushnumber(L, lua_gettop(S->state));
+  return 1;
+}
+
+static int lualua_insert(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptablestackindex(L, 2, S);
+  lua_insert(S->state, index);
+  return 0;
+}
+
+static int lualua_isboolean(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isboolean(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_iscfunction(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_iscfunction(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isfunction(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isfunction(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_islightuserdata(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_islightuserdata(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isnil(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isnil(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isnone(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isnone(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isnoneornil(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isnoneornil(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isnumber(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isnumber(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isstring(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isstring(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_istable(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_istable(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isthread(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isthread(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_isuserdata(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int result = lua_isuserdata(S->state, index);
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+static int lualua_dolessthan(lua_State *SS) {
+  lua_pushboolean(SS, lua_lessthan(SS, -2, -1));
+  return 1;
+}
+
+static int lualua_lessthan(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index1 = lualua_checkacceptableindex(L, 2, S);
+  int index2 = lualua_checkacceptableindex(L, 3, S);
+  lualua_checkoverflow(L, S, 3);
+  int result;
+  if (!lualua_fastlessthan(S->state, index1, index2, &result)) {
+    lua_pushcfunction(S->state, lualua_dolessthan);
+    lua_pushvalue(S->state, index1);
+    lua_pushvalue(S->state, index2);
+    lualua_safecall(L, S, 2, 1);
+    result = lua_toboolean(S->state, -1);
+    lua_pop(S->state, 1);
+  }
+  lua_pushboolean(L, result);
+  return 1;
+}
+
+/*
+ * Chunk cache. When enabled, loadstring keeps the bytecode of each source it
+ * compiles in a process-wide table keyed by a hash of the source and chunk
+ * name, so that loading the same source into another sandbox skips the
+ * parser. The source is kept too, to rule out hash collisions. Sandboxes may
+ * load chunks on worker threads, so the cache is only accessed under its
+ * mutex; parsing and dumping happen outside it.
+ */
+
+#define LUALUA_CACHEBUCKETS 256
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} lualua_Chunkbuf;
+
+typedef struct lualua_CachedChunk {
+  struct lualua_CachedChunk *next;
+  unsigned long long hash;
+  size_t sourcelen;
+  size_t namelen;
+  size_t codelen;
+  char data[1]; /* source, chunk name, then bytecode */
+} lualua_CachedChunk;
+
+static struct {
+  pthread_mutex_t mutex;
+  size_t maxbytes; /* 0 when disabled */
+  size_t bytes;
+  double hits;
+  double misses;
+  lualua_CachedChunk *buckets[LUALUA_CACHEBUCKETS];
+} lualua_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, {NULL}};
+
+static unsigned long long lualua_hashbytes(unsigned long long h,
+                                           const char *s, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+static int lualua_chunkwriter(lua_State *SS, const void *p, size_t sz,
+                              void *ud) {
+  lualua_Chunkbuf *b = ud;
+  if (b->len + sz > b->cap) {
+    size_t cap = (b->len + sz) * 2;
+    char *data = realloc(b->data, cap);
+    if (data == NULL) {
+      return 1;
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, p, sz);
+  b->len += sz;
+  return 0;
+}
+
+static lualua_CachedChunk **lualua_findchunk(unsigned long long hash,
+                                             const char *source, size_t sz,
+                                             const char *name) {
+  size_t namelen = strlen(name);
+  lualua_CachedChunk **c = &lualua_cache.buckets[hash % LUALUA_CACHEBUCKETS];
+  for (; *c != NULL; c = &(*c)->next) {
+    if ((*c)->hash == hash && (*c)->sourcelen == sz &&
+        (*c)->namelen == namelen && memcmp((*c)->data, source, sz) == 0 &&
+        memcmp((*c)->data + sz, name, namelen) == 0) {
+      break;
+    }
+  }
+  return c;
+}
+
+/* Caches the bytecode of the function on top of the stack, if it fits. */
+static void lualua_cachechunk(lua_State *SS, unsigned long long hash,
+                              const char *source, size_t sz,
+                              const char *name) {
+  lualua_Chunkbuf b = {NULL, 0, 0};
+  if (lua_dump(SS, lualua_chunkwriter, &b) != 0) {
+    free(b.data);
+    return;
+  }
+  size_t namelen = strlen(name);
+  size_t size = sizeof(lualua_CachedChunk) + sz + namelen + b.len;
+  pthread_mutex_lock(&lualua_cache.mutex);
+  lualua_CachedChunk **slot = lualua_findchunk(hash, source, sz, name);
+  lualua_CachedChunk *c = NULL;
+  if (*slot == NULL && lualua_cache.bytes + size <= lualua_cache.maxbytes) {
+    c = malloc(size);
+  }
+  if (c != NULL) {
+    c->next = NULL;
+    c->hash = hash;
+    c->sourcelen = sz;
+    c->namelen = namelen;
+    c->codelen = b.len;
+    memcpy(c->data, source, sz);
+    memcpy(c->data + sz, name, namelen);
+    memcpy(c->data + sz + namelen, b.data, b.len);
+    *slot = c;
+    lualua_cache.bytes += size;
+  }
+  pthread_mutex_unlock(&lualua_cache.mutex);
+  free(b.data);
+}
+
+static void lualua_clearcache(void) {
+  for (int i = 0; i < LUALUA_CACHEBUCKETS; ++i) {
+    while (lualua_cache.buckets[i] != NULL) {
+      lualua_CachedChunk *c = lualua_cache.buckets[i];
+      lualua_cache.buckets[i] = c->next;
+      free(c);
+    }
+  }
+  lualua_cache.bytes = 0;
+}
+
+/*
+ * Compare to luaL_loadbuffer, going through the chunk cache. Cached bytecode
+ * is copied out under the mutex, since setchunkcache may free it, and loaded
+ * outside it, since finalizers run during the load may load chunks too.
+ */
+static int lualua_loadbuffer(lua_State *SS, const char *buff, size_t sz,
+                             const char *name) {
+  if (sz > 0 && buff[0] == LUA_SIGNATURE[0]) {
+    return luaL_loadbuffer(SS, buff, sz, name);
+  }
+  pthread_mutex_lock(&lualua_cache.mutex);
+  if (lualua_cache.maxbytes == 0) {
+    pthread_mutex_unlock(&lualua_cache.mutex);
+    return luaL_loadbuffer(SS, buff, sz, name);
+  }
+  unsigned long long hash = lualua_hashbytes(14695981039346656037ull, buff, sz);
+  hash = lualua_hashbytes(hash, name, strlen(name) + 1);
+  lualua_CachedChunk *c = *lualua_findchunk(hash, buff, sz, name);
+  char *code = c != NULL ? malloc(c->codelen) : NULL;
+  if (code != NULL) {
+    size_t codelen = c->codelen;
+    memcpy(code, c->data + sz + c->namelen, codelen);
+    lualua_cache.hits++;
+    pthread_mutex_unlock(&lualua_cache.mutex);
+    int value = luaL_loadbuffer(SS, code, codelen, name);
+    free(code);
+    return value;
+  }
+  lualua_cache.misses++;
+  pthread_mutex_unlock(&lualua_cache.mutex);
+  int value = luaL_loadbuffer(SS, buff, sz, name);
+  if (value == 0) {
+    lualua_cachechunk(SS, hash, buff, sz, name);
+  }
+  return value;
+}
+
+static int lualua_setchunkcache(lua_State *L) {
+  lua_Number maxbytes = luaL_optnumber(L, 1, 0);
+  luaL_argcheck(L, maxbytes >= 0, 1, "negative size");
+  pthread_mutex_lock(&lualua_cache.mutex);
+  lualua_clearcache();
+  lualua_cache.maxbytes = (size_t)maxbytes;
+  lualua_cache.hits = 0;
+  lualua_cache.misses = 0;
+  pthread_mutex_unlock(&lualua_cache.mutex);
+  return 0;
+}
+
+static int lualua_allrefstats(lua_State *L) {
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, __sync_add_and_fetch(&lualua_refs.states, 0));
+  lua_setfield(L, -2, "states");
+  lua_pushnumber(L, __sync_add_and_fetch(&lualua_refs.callbacks, 0));
+  lua_setfield(L, -2, "callbacks");
+  lua_pushnumber(L, __sync_add_and_fetch(&lualua_refs.userdata, 0));
+  lua_setfield(L, -2, "userdata");
+  lua_pushnumber(L, __sync_add_and_fetch(&lualua_refs.orphaned, 0));
+  lua_setfield(L, -2, "orphaned");
+  return 1;
+}
+
+static int lualua_chunkcachestats(lua_State *L) {
+  size_t entries = 0;
+  pthread_mutex_lock(&lualua_cache.mutex);
+  for (int i = 0; i < LUALUA_CACHEBUCKETS; ++i) {
+    for (lualua_CachedChunk *c = lualua_cache.buckets[i]; c; c = c->next) {
+      entries++;
+    }
+  }
+  lua_Number maxbytes = lualua_cache.maxbytes;
+  lua_Number bytes = lualua_cache.bytes;
+  lua_Number hits = lualua_cache.hits;
+  lua_Number misses = lualua_cache.misses;
+  pthread_mutex_unlock(&lualua_cache.mutex);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, maxbytes);
+  lua_setfield(L, -2, "maxbytes");
+  lua_pushnumber(L, bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, misses);
+  lua_setfield(L, -2, "misses");
+  return 1;
+}
+
+static int lualua_loadstring(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t sz;
+  const char *buff = luaL_checklstring(L, 2, &sz);
+  const char *chunkname = luaL_optstring(L, 3, buff);
+  lualua_checkoverflow(L, S, 1);
+  int value = lualua_loadbuffer(S->state, buff, sz, chunkname);
+  lua_pushinteger(L, value);
+  return 1;
+}
+
+static int lualua_memstats(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_Alloc *a = S->sandbox->alloc;
+  lua_createtable(L, 0, 5);
+  if (a == NULL) {
+    lua_State *SS = S->state;
+    lua_pushnumber(L, lua_gc(SS, LUA_GCCOUNT, 0) * 1024.0 +
+                          lua_gc(SS, LUA_GCCOUNTB, 0));
+    lua_setfield(L, -2, "bytes");
+    return 1;
+  }
+  lua_pushnumber(L, a->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, a->peak);
+  lua_setfield(L, -2, "peak");
+  lua_pushnumber(L, a->allocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushnumber(L, a->frees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, a->lastfreed);
+  lua_setfield(L, -2, "lastfreed");
+  return 1;
+}
+
+/*
+ * Buffers are sandbox userdata holding raw bytes, told apart from
+ * host-backed userdata by their environment. Bounds always come from the
+ * userdata's own size, so a forged environment cannot cause an overrun.
+ */
+
+static const char *const lualua_bufferkinds[] = {"f64", "string", "u32", "u8",
+                                                 NULL};
+
+enum { LUALUA_F64, LUALUA_STRING, LUALUA_U32, LUALUA_U8 };
+
+/* Returns the bytes of the buffer at index, or NULL; needs one slot. */
+static unsigned char *lualua_getbuffer(lua_State *SS, lualua_Sandbox *sb,
+                                       int index, size_t *len) {
+  unsigned char *p = lualua_touserdatain(SS, index, sb->buffers, 0);
+  if (p != NULL) {
+    *len = lua_objlen(SS, index);
+  }
+  return p;
+}
+
+static unsigned char *lualua_checkbuffer(lua_State *L, lualua_State *S,
+                                         int narg, size_t *len) {
+  int index = lualua_checkacceptableindex(L, narg, S);
+  lualua_checktemporaries(L, S, 1);
+  unsigned char *p = lualua_getbuffer(S->state, S->sandbox, index, len);
+  lualua_assert(L, S, p != NULL, "not a buffer");
+  return p;
+}
+
+/* Checks that width bytes at the offset at narg fit in len bytes. */
+static size_t lualua_checkoffset(lua_State *L, int narg, size_t len,
+                                 size_t width) {
+  lua_Number n = luaL_checknumber(L, narg);
+  luaL_argcheck(L, n >= 0 && width <= len && n <= len - width && n == (size_t)n,
+                narg, "out of bounds");
+  return n;
+}
+
+static int lualua_newbuffer(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_Number size = luaL_checknumber(L, 2);
+  luaL_argcheck(L, size >= 0 && size <= INT_MAX && size == (int)size, 2,
+                "invalid size");
+  lualua_checkoverflow(L, S, 1);
+  lualua_checktemporaries(L, S, 2);
+  lua_State *SS = S->state;
+  void *p = lua_newuserdata(SS, size);
+  memset(p, 0, size);
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "buffers");
+  lua_setfenv(SS, -3);
+  lua_pop(SS, 1);
+  return 0;
+}
+
+static int lualua_newtable(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkoverflow(L, S, 1);
+  lua_newtable(S->state);
+  return 0;
+}
+
+/* Pushes a userdata that releases ref when collected. */
+static void lualua_pushgctoken(lua_State *SS, int ref, int kind) {
+  lualua_Gctoken *t = lua_newuserdata(SS, sizeof(*t));
+  t->ref = ref;
+  t->kind = kind;
+  t->handedoff = 0;
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "gctokenmt");
+  lua_setmetatable(SS, -3);
+  lua_pop(SS, 1);
+}
+
+static void lualua_gctokenize(lua_State *SS, int ref, int kind) {
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "gctokens");
+  lua_pushvalue(SS, -3);
+  lualua_Gctoken *t = lua_newuserdata(SS, sizeof(*t));
+  t->ref = ref;
+  t->kind = kind;
+  t->handedoff = 0;
+  lua_getfield(SS, -4, "gctokenmt");
+  lua_setmetatable(SS, -2);
+  lua_settable(SS, -3);
+  lua_pop(SS, 2);
+}
+
+/* Wraps the thread at index, keeping its sandbox alive. */
+static void lualua_wrapthread(lua_State *L, lualua_State *S, int index) {
+  lua_State *SS = S->state;
+  lualua_checktemporaries(L, S, 1);
+  lualua_pushanchor(L, S);
+  lua_pushvalue(SS, index);
+  lua_State *thread = lua_tothread(SS, -1);
+  int ref = luaL_ref(SS, LUA_REGISTRYINDEX);
+  lualua_State *p = lualua_newwrapper(L, thread, S->sandbox);
+  p->threadref = ref;
+  lualua_setanchor(L);
+}
+
+static int lualua_newthread(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkoverflow(L, S, 1);
+  lua_newthread(S->state);
+  lualua_wrapthread(L, S, -1);
+  return 1;
+}
+
+static int lualua_newuserdata(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkoverflow(L, S, 6);
+  lua_newtable(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, S->sandbox->hostrefs);
+  lua_pushvalue(L, -2);
+  int ref = luaL_ref(L, -2);
+  lua_pop(L, 1);
+  lualua_countref(S->sandbox, LUALUA_USERDATA, 1);
+  LUALUA_COUNT(S->sandbox, newuserdata, 1);
+  lua_State *SS = S->state;
+  lualua_Hostdata *u = lua_newuserdata(SS, sizeof(*u));
+  u->ref = ref;
+  u->tokenized = 0;
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "userdata");
+  lua_setfenv(SS, -3);
+  lua_getfield(SS, -1, "userdatamt");
+  lua_setmetatable(SS, -3);
+  lua_pop(SS, 1);
+  return 1;
+}
+
+static int lualua_next(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checkoverflow(L, S, 1);
+  int value = lua_next(S->state, index);
+  lua_pushboolean(L, value);
+  return 1;
+}
+
+static int lualua_objlen(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int value = lua_objlen(S->state, index);
+  lua_pushinteger(L, value);
+  return 1;
+}
+
+/*
+ * Readies the host-backed userdata u at index for the metatable on top of
+ * the stack, which is nil or a table. nil becomes the default metatable.
+ * Tables are never modified, so that sandbox code cannot reach the lualua
+ * __gc through them. If copy is set, a table without a __gc is replaced by
+ * a cached copy with the lualua __gc, which sandbox code sees as the
+ * original through __metatable. Otherwise, unless the table already holds
+ * the lualua __gc, a gctoken takes over releasing the host ref. Needs eight
+ * slots.
+ */
+static void lualua_prepmetatable(lua_State *SS, lualua_Hostdata *u,
+                                 int index, int copy) {
+  int mt = lua_gettop(SS);
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, -1, "userdatamt");
+  if (lua_isnil(SS, mt)) {
+    lua_replace(SS, mt);
+    lua_settop(SS, mt);
+    return;
+  }
+  lua_getfield(SS, -1, "__gc");
+  lua_replace(SS, -2);
+  lua_pushstring(SS, "__gc");
+  lua_rawget(SS, mt);
+  if (lua_rawequal(SS, -1, -2)) {
+    lua_settop(SS, mt);
+    return;
+  }
+  if (!copy || !lua_isnil(SS, -1)) {
+    lua_settop(SS, mt);
+    if (!u->tokenized) {
+      lua_pushvalue(SS, index);
+      lualua_gctokenize(SS, u->ref, LUALUA_USERDATA);
+      lua_pop(SS, 1);
+      u->tokenized = 1;
+    }
+    return;
+  }
+  lua_pop(SS, 1);
+  lua_getfield(SS, mt + 1, "mtcopies");
+  lua_pushvalue(SS, mt);
+  lua_rawget(SS, -2);
+  if (lua_isnil(SS, -1)) {
+    lua_pop(SS, 1);
+    lua_newtable(SS);
+    lua_pushnil(SS);
+    while (lua_next(SS, mt)) {
+      lua_pushvalue(SS, -2);
+      lua_insert(SS, -2);
+      lua_rawset(SS, -4);
+    }
+    lua_pushstring(SS, "__gc");
+    lua_pushvalue(SS, mt + 2);
+    lua_rawset(SS, -3);
+    lua_pushstring(SS, "__metatable");
+    lua_rawget(SS, -2);
+    if (lua_isnil(SS, -1)) {
+      lua_pushstring(SS, "__metatable");
+      lua_pushvalue(SS, mt);
+      lua_rawset(SS, -4);
+    }
+    lua_pop(SS, 1);
+    lua_pushvalue(SS, mt);
+    lua_pushvalue(SS, -2);
+    lua_rawset(SS, mt + 3);
+    lua_getfield(SS, mt + 1, "mtoriginals");
+    lua_pushvalue(SS, -2);
+    lua_pushvalue(SS, mt);
+    lua_rawset(SS, -3);
+    lua_pop(SS, 1);
+  }
+  lua_replace(SS, mt);
+  lua_settop(SS, mt);
+}
+
+/* debug.setmetatable for sandboxes, which keeps host-backed userdata safe. */
+static int lualua_debugsetmetatable(lua_State *SS) {
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(1));
+  lualua_Hostdata *u = lualua_tohostdata(SS, 1, sb);
+  int type = lua_type(SS, 2);
+  if (u != NULL && (type == LUA_TNIL || type == LUA_TTABLE)) {
+    lua_settop(SS, 2);
+    lualua_prepmetatable(SS, u, 1, 0);
+  }
+  lua_pushvalue(SS, lua_upvalueindex(2));
+  lua_insert(SS, 1);
+  lua_call(SS, lua_gettop(SS) - 1, LUA_MULTRET);
+  return lua_gettop(SS);
+}
+
+/*
+ * getmetatable and debug.getmetatable for sandboxes, which see no metatable
+ * on host-backed userdata the host gave none, as if lualua had not given
+ * them the default one.
+ */
+static int lualua_sandboxgetmetatable(lua_State *SS) {
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(1));
+  if (lua_getmetatable(SS, 1)) {
+    if (lua_topointer(SS, -1) == sb->userdatamt) {
+      lua_pushnil(SS);
+      return 1;
+    }
+    lua_pop(SS, 1);
+  }
+  lua_pushvalue(SS, lua_upvalueindex(2));
+  lua_insert(SS, 1);
+  lua_call(SS, lua_gettop(SS) - 1, LUA_MULTRET);
+  return lua_gettop(SS);
+}
+
+/* debug.setfenv for sandboxes, which cannot forge lualua userdata. */
+static int lualua_debugsetfenv(lua_State *SS) {
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(1));
+  lua_settop(SS, 2);
+  if (!lualua_canchangeenv(SS, sb, 1)) {
+    return luaL_error(SS,
+                      "'setfenv' cannot change environment of given object");
+  }
+  lua_pushvalue(SS, lua_upvalueindex(2));
+  lua_insert(SS, 1);
+  lua_call(SS, 2, 1);
+  return 1;
+}
+
+/* Replaces the field of the table at index by f, with upvalues sb and it. */
+static void lualua_wrapfield(lua_State *SS, lualua_Sandbox *sb, int index,
+                             const char *name, lua_CFunction f) {
+  lua_getfield(SS, index, name);
+  lua_pushlightuserdata(SS, sb);
+  lua_insert(SS, -2);
+  lua_pushcclosure(SS, f, 2);
+  lua_setfield(SS, index, name);
+}
+
+static int lualua_openlibs(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checktemporaries(L, S, 3);
+  lua_State *SS = S->state;
+  lualua_Sandbox *sb = S->sandbox;
+  luaL_openlibs(SS);
+  lualua_wrapfield(SS, sb, LUA_GLOBALSINDEX, "getmetatable",
+                   lualua_sandboxgetmetatable);
+  lua_getfield(SS, LUA_GLOBALSINDEX, "debug");
+  int debug = lua_gettop(SS);
+  lualua_wrapfield(SS, sb, debug, "getmetatable", lualua_sandboxgetmetatable);
+  lualua_wrapfield(SS, sb, debug, "setmetatable", lualua_debugsetmetatable);
+  lualua_wrapfield(SS, sb, debug, "setfenv", lualua_debugsetfenv);
+  lua_pop(SS, 1);
+  return 0;
+}
+
+int luaopen_lualua(lua_State *L);
+
+/* The chunk cache is process-wide, so sandboxes may not reconfigure it. */
+static int lualua_opennested(lua_State *SS) {
+  luaopen_lualua(SS);
+  lua_pushnil(SS);
+  lua_setfield(SS, -2, "setchunkcache");
+  return 1;
+}
+
+/*
+ * Loads this module into the sandbox itself, so that nested sandboxes are
+ * driven by the same C code rather than through lualualua.lua. Child
+ * states are allocated outside the sandbox and do not count toward its
+ * memlimit.
+ */
+static int lualua_openlualua(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkoverflow(L, S, 1);
+  lualua_checktemporaries(L, S, 1);
+  lua_pushcfunction(S->state, lualua_opennested);
+  lualua_safecall(L, S, 0, 1);
+  return 0;
+}
+
+/*
+ * Iterators returned by pairs keep their table and the last key of each
+ * batch in the sandbox registry, so that the loop body may use the stack.
+ */
+typedef struct {
+  lualua_Batch b;
+  int tableref; /* sandbox registry refs, LUA_NOREF once done */
+  int keyref;
+  int pos; /* entries of the current batch returned so far */
+  int n;   /* entries in the current batch */
+} lualua_Pairs;
+
+static const char lualua_pairs_metatable[] = "lualua pairs";
+
+static void lualua_endpairs(lualua_State *S, lualua_Pairs *p) {
+  luaL_unref(S->state, LUA_REGISTRYINDEX, p->tableref);
+  luaL_unref(S->state, LUA_REGISTRYINDEX, p->keyref);
+  p->tableref = LUA_NOREF;
+  p->keyref = LUA_NOREF;
+}
+
+/* Releases the refs of loops that were left early. */
+static int lualua_pairs_gc(lua_State *L) {
+  lualua_Pairs *p = lua_touserdata(L, 1);
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, 1);
+  lualua_State *S = lua_touserdata(L, -1);
+  /* The callback wrapper may outlive its sandbox, so leave it alone. */
+  if (p->tableref != LUA_NOREF && S->sandbox->future == NULL &&
+      (S->stateowner || S->threadref != LUA_NOREF)) {
+    lualua_endpairs(S, p);
+  }
+  return 0;
+}
+
+static int lualua_pairsnext(lua_State *L) {
+  lualua_Pairs *p = lua_touserdata(L, lua_upvalueindex(1));
+  if (p->pos == p->n) {
+    if (p->tableref == LUA_NOREF) {
+      return 0;
+    }
+    lua_getfenv(L, lua_upvalueindex(1));
+    lua_rawgeti(L, -1, 1);
+    lualua_State *S = lualua_checkstate(L, -1);
+    lua_State *SS = S->state;
+    lualua_checktemporaries(L, S, 5);
+    lua_rawgeti(SS, LUA_REGISTRYINDEX, p->tableref);
+    if (p->keyref == LUA_NOREF) {
+      lua_pushnil(SS);
+    } else {
+      lua_rawgeti(SS, LUA_REGISTRYINDEX, p->keyref);
+    }
+    p->n = lualua_nextbatch(L, S, lua_gettop(SS) - 1, &p->b,
+                            lua_upvalueindex(2), lua_upvalueindex(3));
+    p->pos = 0;
+    if (p->n < p->b.max) {
+      lua_pop(SS, 1);
+      lualua_endpairs(S, p);
+    } else if (p->keyref == LUA_NOREF) {
+      p->keyref = luaL_ref(SS, LUA_REGISTRYINDEX);
+      lua_pop(SS, 1);
+    } else {
+      lua_rawseti(SS, LUA_REGISTRYINDEX, p->keyref);
+      lua_pop(SS, 1);
+    }
+    if (p->n == 0) {
+      return 0;
+    }
+  }
+  ++p->pos;
+  lua_rawgeti(L, lua_upvalueindex(2), p->pos);
+  lua_rawgeti(L, lua_upvalueindex(3), p->pos);
+  return 2;
+}
+
+static int lualua_pairs(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_Batch b;
+  lualua_optbatch(L, 3, &b);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checktemporaries(L, S, 1);
+  lualua_pushanchor(L, S);
+  lualua_Pairs *p = lua_newuserdata(L, sizeof(*p));
+  p->b = b;
+  p->tableref = LUA_NOREF;
+  p->keyref = LUA_NOREF;
+  p->pos = 0;
+  p->n = 0;
+  luaL_getmetatable(L, lualua_pairs_metatable);
+  lua_setmetatable(L, -2);
+  lualua_setanchor(L);
+  lua_pushvalue(S->state, index);
+  p->tableref = luaL_ref(S->state, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushcclosure(L, lualua_pairsnext, 3);
+  return 1;
+}
+
+static int lualua_pcall(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int nargs = luaL_checkint(L, 2);
+  int nresults = luaL_checkint(L, 3);
+  int errfunc = luaL_checkint(L, 4);
+  if (errfunc != 0) {
+    lualua_assert(L, S, lualua_isacceptableindex(S, errfunc), "invalid index");
+  }
+  if (!lua_isnoneornil(L, 5)) {
+    luaL_checktype(L, 5, LUA_TTABLE);
+    lua_getfield(L, 5, "budget");
+    lua_getfield(L, 5, "granularity");
+    lualua_dosetbudget(L, S->sandbox, 5, -2, -1);
+    lua_pop(L, 2);
+  }
+  lualua_checkunderflow(L, S, nargs + 1);
+  lualua_checkoverflow(L, S, 1);
+  int result = lualua_protectedcall(S, nargs, nresults, errfunc);
+  lua_pushinteger(L, result);
+  return 1;
+}
+
+/*
+ * Prepared calls run the sandbox function in a registry ref with the host
+ * arguments and return its results as host values, leaving the stack as it
+ * found it.
+ */
+typedef struct {
+  int ref;      /* sandbox registry ref of the function */
+  int nresults; /* or LUA_MULTRET */
+  int handler;  /* sandbox registry ref of the error handler, or LUA_NOREF */
+} lualua_Prepared;
+
+static const char lualua_prepared_metatable[] = "lualua prepared";
+
+static int lualua_prepared_call(lua_State *L) {
+  lualua_Prepared *p = luaL_checkudata(L, 1, lualua_prepared_metatable);
+  int nargs = lua_gettop(L) - 1;
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, 1);
+  lualua_State *S = lualua_checkstate(L, -1);
+  lua_State *SS = S->state;
+  lua_pop(L, 2);
+  lualua_checktemporaries(L, S, nargs + 2);
+  int top = lua_gettop(SS);
+  int errfunc = 0;
+  if (p->handler != LUA_NOREF) {
+    lua_rawgeti(SS, LUA_REGISTRYINDEX, p->handler);
+    errfunc = top + 1;
+  }
+  lua_rawgeti(SS, LUA_REGISTRYINDEX, p->ref);
+  for (int i = 2; i <= nargs + 1; ++i) {
+    /* Unlike lualua_pusharg, keep the caller's stack intact. */
+    if (!lualua_pushhostscalar(L, S, i)) {
+      lua_settop(SS, top);
+      return luaL_typerror(L, i, "scalar");
+    }
+  }
+  LUALUA_COUNT(S->sandbox, safecalls, 1);
+  if (lualua_protectedcall(S, nargs, p->nresults, errfunc) != 0) {
+    lualua_copystring(S->sandbox, L, SS, -1);
+    lua_settop(SS, top);
+    return lua_error(L);
+  }
+  int first = top + 1 + (errfunc != 0);
+  int n = lua_gettop(SS) - first + 1;
+  if (!lua_checkstack(SS, 1) || !lua_checkstack(L, n)) {
+    lua_settop(SS, top);
+    return luaL_error(L, "stack overflow");
+  }
+  for (int i = first; i < first + n; ++i) {
+    lualua_pushentry(L, S, i, 1);
+  }
+  lua_settop(SS, top);
+  return n;
+}
+
+static int lualua_prepare(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int ref = luaL_checkint(L, 2);
+  int nresults = luaL_optint(L, 3, LUA_MULTRET);
+  luaL_argcheck(L, nresults >= 0 || nresults == LUA_MULTRET, 3,
+                "invalid nresults");
+  int handler = LUA_NOREF;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_getfield(L, 4, "handler");
+    handler = luaL_optint(L, -1, LUA_NOREF);
+    lua_pop(L, 1);
+  }
+  lualua_pushanchor(L, S);
+  lualua_Prepared *p = lua_newuserdata(L, sizeof(*p));
+  p->ref = ref;
+  p->nresults = nresults;
+  p->handler = handler;
+  luaL_getmetatable(L, lualua_prepared_metatable);
+  lua_setmetatable(L, -2);
+  /* Keep the state alive for as long as the handle. */
+  lualua_setanchor(L);
+  return 1;
+}
+
+static int lualua_profile_start(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int interval = LUALUA_GRANULARITY;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "interval");
+    interval = luaL_optint(L, -1, LUALUA_GRANULARITY);
+    luaL_argcheck(L, interval > 0, 2, "invalid interval");
+    lua_pop(L, 1);
+  }
+  lualua_Sandbox *sb = S->sandbox;
+  if (sb->profile != NULL) {
+    return luaL_error(L, "profiler already running");
+  }
+  sb->profile = calloc(1, sizeof(*sb->profile));
+  if (sb->profile == NULL) {
+    return luaL_error(L, "not enough memory");
+  }
+  sb->profile->interval = interval;
+  return 0;
+}
+
+static int lualua_profile_stop(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_Profile *p = S->sandbox->profile;
+  if (p == NULL) {
+    return luaL_error(L, "profiler not running");
+  }
+  S->sandbox->profile = NULL;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (int i = 0; i < LUALUA_PROFILEBUCKETS; ++i) {
+    for (lualua_Sample *s = p->samples[i]; s != NULL; s = s->next) {
+      for (int j = 0; j < s->nframes; ++j) {
+        if (j > 0) {
+          luaL_addchar(&b, ';');
+        }
+        luaL_addstring(&b, lualua_framelabel(p, s->frames[j]));
+      }
+      char count[32];
+      snprintf(count, sizeof(count), " %.0f\n", s->count);
+      luaL_addstring(&b, count);
+    }
+  }
+  lualua_freeprofile(p);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int lualua_pop(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int n = luaL_checkint(L, 2);
+  /* Analogous to lualua_settop, since pop is defined in terms of settop. */
+  lualua_assert(L, S, n == -1 || n == 0 || lualua_isacceptableindex(S, -n),
+                "stack underflow");
+  lua_pop(S->state, n);
+  return 0;
+}
+
+static int lualua_pushboolean(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int b = lua_toboolean(L, 2);
+  lualua_checkoverflow(L, S, 1);
+  lua_pushboolean(S->state, b);
+  return 0;
+}
+
+static int lualua_invokefromhostregistry(lua_State *SS) {
+  int hostfunref =
+      ((lualua_Gctoken *)lua_touserdata(SS, lua_upvalueindex(1)))->ref;
+  lualua_Sandbox *sb = lua_touserdata(SS, lua_upvalueindex(2));
+  if (sb->future != NULL) {
+    return luaL_error(SS, "host callbacks are not available in async calls");
+  }
+  if (sb->ffi != 0) {
+    return luaL_error(SS, "host callbacks are not available in ffi calls");
+  }
+  LUALUA_COUNT(sb, callbacks, 1);
+  lua_State *L = sb->host;
+  if (!lua_checkstack(L, 3)) {
+    return luaL_error(SS, "host stack overflow");
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sb->hostrefs);
+  lua_rawgeti(L, -1, hostfunref);
+  lua_rawgeti(L, -2, sb->wrapperref);
+  lua_remove(L, -3);
+  /* The wrapper is shared, so restore it for any callback we are nested in. */
+  lualua_State *p = sb->wrapper;
+  lua_State *state = p->state;
+  int stackmax = p->stackmax;
+  p->state = SS;
+  p->stackmax = LUA_MINSTACK;
+  /* The host drives the sandbox unprotected, so lift the memory limit. */
+  int enforce = sb->alloc != NULL && sb->alloc->enforce;
+  if (sb->alloc != NULL) {
+    sb->alloc->enforce = 0;
+  }
+  int trying = sb->trying;
+  sb->trying = 0;
+  int value = lua_pcall(L, 1, 1, 0);
+  sb->trying = trying;
+  if (sb->alloc != NULL) {
+    sb->alloc->enforce = enforce;
+  }
+  p->state = state;
+  p->stackmax = stackmax;
+  if (value != 0) {
+    lualua_copystring(sb, SS, L, -1);
+    lua_pop(L, 1);
+    return lua_error(SS);
+  } else {
+    int nreturn = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return nreturn;
+  }
+}
+
+static void lualua_dopushcfunction(lua_State *L, lualua_State *S) {
+  lualua_checkoverflow(L, S, 2);
+  lualua_checktemporaries(L, S, 6);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, S->sandbox->hostrefs);
+  lua_insert(L, -2);
+  int hostfunref = luaL_ref(L, -2);
+  lualua_countref(S->sandbox, LUALUA_CALLBACK, 1);
+  /* C closures cannot have finalizers, so a gctoken upvalue owns the ref. */
+  lualua_pushgctoken(S->state, hostfunref, LUALUA_CALLBACK);
+  lua_pushlightuserdata(S->state, S->sandbox);
+  lua_pushcclosure(S->state, lualua_invokefromhostregistry, 2);
+}
+
+static int lualua_pushcfunction(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  luaL_argcheck(L, lua_isfunction(L, 2), 2, "function expected");
+  lua_settop(L, 2);
+  lualua_dopushcfunction(L, S);
+  return 0;
+}
+
+static int lualua_pushnil(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_checkoverflow(L, S, 1);
+  lua_pushnil(S->state);
+  return 0;
+}
+
+static int lualua_pushnumber(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_Number n = luaL_checknumber(L, 2);
+  lualua_checkoverflow(L, S, 1);
+  lua_pushnumber(S->state, n);
+  return 0;
+}
+
+static int lualua_pushlstring(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  lua_Number n = luaL_checknumber(L, 3);
+  luaL_argcheck(L, n >= 0 && n <= len, 3, "length out of range");
+  lualua_checkoverflow(L, S, 1);
+  lualua_pushhoststring(S->sandbox, S->state, s, (size_t)n);
+  return 0;
+}
+
+static int lualua_pushstring(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  lualua_checkoverflow(L, S, 1);
+  lualua_pushhoststring(S->sandbox, S->state, s, len);
+  return 0;
+}
+
+/*
+ * Deep copies between the host and a sandbox. The same code runs in both
+ * directions: tables already seen in the source map to an id, and the id
+ * maps to the copy in the destination, which preserves cycles and shared
+ * references.
+ */
+
+#define LUALUA_MAXDEPTH 100
+
+typedef struct {
+  lua_State *from;
+  lua_State *to;
+  int seen;   /* in from: table -> id */
+  int copies; /* in to: id -> copy */
+  int ncopies;
+  int maxdepth;
+  int presize;
+} lualua_Copy;
+
+static void lualua_optcopy(lua_State *L, int narg, lualua_Copy *c) {
+  c->maxdepth = LUALUA_MAXDEPTH;
+  c->presize = 1;
+  if (lua_isnoneornil(L, narg)) {
+    return;
+  }
+  luaL_checktype(L, narg, LUA_TTABLE);
+  lua_getfield(L, narg, "depth");
+  c->maxdepth = luaL_optint(L, -1, LUALUA_MAXDEPTH);
+  lua_getfield(L, narg, "presize");
+  c->presize = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_pop(L, 2);
+}
+
+static void lualua_copyvalue(lua_State *L, lualua_State *S, lualua_Copy *c,
+                             int index, int depth);
+
+static void lualua_copytable(lua_State *L, lualua_State *S, lualua_Copy *c,
+                             int index, int depth) {
+  lua_State *from = c->from;
+  lua_State *to = c->to;
+  lua_pushvalue(from, index);
+  lua_rawget(from, c->seen);
+  if (!lua_isnil(from, -1)) {
+    lua_rawgeti(to, c->copies, lua_tointeger(from, -1));
+    lua_pop(from, 1);
+    return;
+  }
+  lua_pop(from, 1);
+  lualua_assert(L, S, depth <= c->maxdepth, "table too deep");
+  if (!lua_checkstack(from, 3) || !lua_checkstack(to, 3)) {
+    lualua_assert(L, S, 0, "stack overflow");
+  }
+  int narr = 0;
+  int nrec = 0;
+  if (c->presize) {
+    narr = lua_objlen(from, index);
+    lua_pushnil(from);
+    while (lua_next(from, index)) {
+      ++nrec;
+      lua_pop(from, 1);
+    }
+    nrec = nrec > narr ? nrec - narr : 0;
+  }
+  lua_createtable(to, narr, nrec);
+  lua_pushvalue(to, -1);
+  lua_rawseti(to, c->copies, ++c->ncopies);
+  lua_pushvalue(from, index);
+  lua_pushinteger(from, c->ncopies);
+  lua_rawset(from, c->seen);
+  lua_pushnil(from);
+  while (lua_next(from, index)) {
+    int top = lua_gettop(from);
+    lualua_copyvalue(L, S, c, top - 1, depth + 1);
+    lualua_copyvalue(L, S, c, top, depth + 1);
+    lua_rawset(to, -3);
+    lua_pop(from, 1);
+  }
+}
+
+static void lualua_copyvalue(lua_State *L, lualua_State *S, lualua_Copy *c,
+                             int index, int depth) {
+  lua_State *from = c->from;
+  lua_State *to = c->to;
+  switch (lua_type(from, index)) {
+    case LUA_TNIL:
+      lua_pushnil(to);
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(to, lua_toboolean(from, index));
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(to, lua_tonumber(from, index));
+      break;
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(from, index, &len);
+      LUALUA_COUNT(S->sandbox, bytescopied, len);
+      lua_pushlstring(to, s, len);
+      break;
+    }
+    case LUA_TTABLE:
+      lualua_copytable(L, S, c, index, depth);
+      break;
+    default: {
+      const char *tname = luaL_typename(from, index);
+      lualua_clearstack(S);
+      luaL_error(L, "cannot copy a %s value", tname);
+    }
   }
-  lua_pushnumber(L, value);
-  return 1;
 }
 
-static int lualua_checkstack(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = luaL_checkint(L, 2);
-  int value = lua_checkstack(S->state, index);
-  if (value && index > 0) {
-    S->stackmax += index;
+/* Copies the table at index in from onto to, leaving the stacks balanced. */
+static void lualua_copy(lua_State *L, lualua_State *S, lualua_Copy *c,
+                        int index) {
+  if (!lua_checkstack(c->from, 1) || !lua_checkstack(c->to, 2)) {
+    lualua_assert(L, S, 0, "stack overflow");
   }
-  lua_pushboolean(L, value);
-  return 1;
+  lua_newtable(c->from);
+  c->seen = lua_gettop(c->from);
+  lua_newtable(c->to);
+  c->copies = lua_gettop(c->to);
+  c->ncopies = 0;
+  lualua_copytable(L, S, c, index, 1);
+  lua_remove(c->to, c->copies);
+  lua_remove(c->from, c->seen);
 }
 
-static int lualua_checkstring(lua_State *L) {
+static int lualua_pushtable(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  const char *value = lua_tostring(S->state, index);
-  if (!value) {
-    return lualua_tagerror(L, S, index, LUA_TSTRING);
-  }
-  lua_pushstring(L, value);
-  return 1;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lualua_Copy c;
+  lualua_optcopy(L, 3, &c);
+  lua_settop(L, 2);
+  lualua_checkoverflow(L, S, 1);
+  c.from = L;
+  c.to = S->state;
+  lualua_copy(L, S, &c, 2);
+  return 0;
 }
 
-static int lualua_doconcat(lua_State *SS) {
-  lua_concat(SS, lua_gettop(SS));
+/*
+ * Marshalled callbacks. The host function is wrapped in a closure that the
+ * usual callback path calls with the wrapper state, which converts the
+ * sandbox arguments to host values, calls the function with them and pushes
+ * its results back. Other values fail unless the mode deep copies tables
+ * or passes them, and anything else, as handles like those of entries.
+ */
+
+enum { LUALUA_MARSHALSCALARS, LUALUA_MARSHALCOPY, LUALUA_MARSHALREF };
+
+static const char *const lualua_marshalmodes[] = {"scalars", "copy", "ref",
+                                                  NULL};
+
+static int lualua_marshal(lua_State *L) {
+  lualua_State *S = lua_touserdata(L, 1);
+  lua_State *SS = S->state;
+  int mode = lua_tointeger(L, lua_upvalueindex(2));
+  int nargs = lua_gettop(SS);
+  luaL_checkstack(L, nargs + 3, "too many arguments");
+  lualua_checktemporaries(L, S, 3);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  for (int i = 1; i <= nargs; ++i) {
+    int type = lua_type(SS, i);
+    if (type == LUA_TTABLE && mode == LUALUA_MARSHALCOPY) {
+      lualua_Copy c;
+      c.from = SS;
+      c.to = L;
+      c.maxdepth = LUALUA_MAXDEPTH;
+      c.presize = 1;
+      lualua_copy(L, S, &c, i);
+    } else if (type == LUA_TNIL || type == LUA_TBOOLEAN ||
+               type == LUA_TNUMBER || type == LUA_TSTRING ||
+               mode == LUALUA_MARSHALREF) {
+      lualua_pushentry(L, S, i, 1);
+    } else {
+      lualua_typerror(L, S, i, "scalar");
+    }
+  }
+  int base = lua_gettop(L) - nargs - 1;
+  lua_call(L, nargs, LUA_MULTRET);
+  int nresults = lua_gettop(L) - base;
+  lualua_checktemporaries(L, S, nresults + 3);
+  for (int i = base + 1; i <= base + nresults; ++i) {
+    if (lualua_pushhostscalar(L, S, i)) {
+      continue;
+    }
+    if (lua_istable(L, i) && mode == LUALUA_MARSHALCOPY) {
+      lualua_Copy c;
+      c.from = L;
+      c.to = SS;
+      c.maxdepth = LUALUA_MAXDEPTH;
+      c.presize = 1;
+      lualua_copy(L, S, &c, i);
+      continue;
+    }
+    if (lua_istable(L, i) && mode == LUALUA_MARSHALREF) {
+      lua_getfield(L, i, "ref");
+      if (lua_isnumber(L, -1)) {
+        lua_rawgeti(SS, LUA_REGISTRYINDEX, lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        continue;
+      }
+    }
+    return luaL_error(L, "bad result #%d (scalar expected, got %s)",
+                      i - base, luaL_typename(L, i));
+  }
+  lua_pushinteger(L, nresults);
   return 1;
 }
 
-static int lualua_concat(lua_State *L) {
+static int lualua_pushhostfunction(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int n = luaL_checkint(L, 2);
-  if (n >= 0) {
-    lualua_checkunderflow(L, S, n);
-    lualua_checkoverflow(L, S, 1);
-    lua_pushcfunction(S->state, lualua_doconcat);
-    lua_insert(S->state, -n - 1);
-    lualua_safecall(L, S, n, 1);
+  luaL_argcheck(L, lua_isfunction(L, 2), 2, "function expected");
+  int mode = LUALUA_MARSHALSCALARS;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "tables");
+    if (!lua_isnil(L, -1)) {
+      const char *name = lua_tostring(L, -1);
+      mode = 0;
+      while (name != NULL && lualua_marshalmodes[mode] != NULL &&
+             strcmp(name, lualua_marshalmodes[mode]) != 0) {
+        ++mode;
+      }
+      luaL_argcheck(L, name != NULL && lualua_marshalmodes[mode] != NULL, 3,
+                    "invalid tables");
+    }
   }
+  lua_settop(L, 2);
+  lua_pushinteger(L, mode);
+  lua_pushcclosure(L, lualua_marshal, 2);
+  lualua_dopushcfunction(L, S);
   return 0;
 }
 
-static int lualua_createtable(lua_State *L) {
+static int lualua_pushvalue(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int narr = luaL_checkint(L, 2);
-  int nrec = luaL_checkint(L, 3);
+  int index = lualua_checkacceptableindex(L, 2, S);
   lualua_checkoverflow(L, S, 1);
-  lua_createtable(S->state, narr, nrec);
+  lua_pushvalue(S->state, index);
   return 0;
 }
 
-static int lualua_equal(lua_State *L) {
+static int lualua_rawequal(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index1 = lualua_checkacceptableindex(L, 2, S);
   int index2 = lualua_checkacceptableindex(L, 3, S);
-  int value = lua_equal(S->state, index1, index2);
+  int value = lua_rawequal(S->state, index1, index2);
   lua_pushboolean(L, value);
   return 1;
 }
 
-static int lualua_error(lua_State *L) {
+static int lualua_rawget(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  lualua_checkunderflow(L, S, 1);
-  lua_pushstring(L, lua_tostring(S->state, -1));
-  lua_settop(S->state, 0);
-  return lua_error(L);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lua_rawget(S->state, index);
+  return 0;
 }
 
-static int lualua_getfenv(lua_State *L) {
+static int lualua_rawgeti(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
+  int n = luaL_checkint(L, 3);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
   lualua_checkoverflow(L, S, 1);
-  lua_getfenv(S->state, index);
+  lua_rawgeti(S->state, index, n);
   return 0;
 }
 
-static int lualua_dogetfield(lua_State *SS) {
-  const char *k = luaL_checkstring(SS, 2);
-  lua_getfield(SS, 1, k);
+/*
+ * Copies t[i..j] of the sandbox table at index into a new host sequence,
+ * converting values as entries does. Holes become nil.
+ */
+static int lualua_rawgetrange(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_State *SS = S->state;
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int i = luaL_optint(L, 3, 1);
+  lualua_assert(L, S, lua_type(SS, index) == LUA_TTABLE, "type error");
+  int j = luaL_optint(L, 4, (int)lua_objlen(SS, index));
+  long long n = j < i ? 0 : (long long)j - i + 1;
+  luaL_argcheck(L, n < INT_MAX, 4, "range too large");
+  lualua_checktemporaries(L, S, 2);
+  lua_createtable(L, (int)n, 0);
+  for (int k = 1; k <= n; ++k) {
+    lua_rawgeti(SS, index, i + k - 1);
+    if (lua_type(SS, -1) == LUA_TNUMBER) {
+      lua_pushnumber(L, lua_tonumber(SS, -1));
+    } else {
+      lualua_pushentry(L, S, -1, 1);
+    }
+    lua_rawseti(L, -2, k);
+    lua_pop(SS, 1);
+  }
   return 1;
 }
 
-static int lualua_getfield(lua_State *L) {
+static int lualua_rawset(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  const char *k = luaL_checkstring(L, 3);
-  lualua_checkoverflow(L, S, 3);
-  lua_pushvalue(S->state, index);
-  lua_pushcfunction(S->state, lualua_dogetfield);
-  lua_insert(S->state, -2);
-  lua_pushstring(S->state, k);
-  lualua_safecall(L, S, 2, 1);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checkunderflow(L, S, 2);
+  lua_rawset(S->state, index);
   return 0;
 }
 
-static int lualua_getglobal(lua_State *L) {
+static int lualua_rawseti(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  const char *k = luaL_checkstring(L, 2);
-  lualua_checkoverflow(L, S, 1);
-  lua_getglobal(S->state, k);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int n = luaL_checkint(L, 3);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checkunderflow(L, S, 1);
+  lua_rawseti(S->state, index, n);
   return 0;
 }
 
-static int lualua_getmetatable(lua_State *L) {
+/* Sets t[i + k - 1] = hosttable[k] for each k up to #hosttable. */
+static int lualua_rawsetrange(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
+  lua_State *SS = S->state;
   int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_checkoverflow(L, S, 1);
-  int result = lua_getmetatable(S->state, index);
-  lua_pushboolean(L, result);
-  return 1;
+  int i = luaL_checkint(L, 3);
+  luaL_checktype(L, 4, LUA_TTABLE);
+  lualua_assert(L, S, lua_type(SS, index) == LUA_TTABLE, "type error");
+  int n = lua_objlen(L, 4);
+  luaL_argcheck(L, n == 0 || i <= INT_MAX - (n - 1), 3, "range too large");
+  lualua_checktemporaries(L, S, 1);
+  for (int k = 1; k <= n; ++k) {
+    lua_rawgeti(L, 4, k);
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      lua_pushnumber(SS, lua_tonumber(L, -1));
+    } else if (!lualua_pushhostscalar(L, S, -1)) {
+      lualua_clearstack(S);
+      luaL_argerror(L, 4, lua_pushfstring(L, "scalar expected at %d", k));
+    }
+    lua_rawseti(SS, index, i + k - 1);
+    lua_pop(L, 1);
+  }
+  return 0;
 }
 
-static int lualua_dogettable(lua_State *SS) {
-  lua_gettable(SS, -2);
+static int lualua_readbuffer(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t len;
+  unsigned char *p = lualua_checkbuffer(L, S, 2, &len);
+  int kind = luaL_checkoption(L, 3, NULL, lualua_bufferkinds);
+  switch (kind) {
+    case LUALUA_F64: {
+      double v;
+      memcpy(&v, p + lualua_checkoffset(L, 4, len, sizeof(v)), sizeof(v));
+      lua_pushnumber(L, v);
+      break;
+    }
+    case LUALUA_STRING: {
+      lua_Number n = luaL_checknumber(L, 5);
+      luaL_argcheck(L, n >= 0 && n <= len && n == (size_t)n, 5,
+                    "invalid length");
+      size_t offset = lualua_checkoffset(L, 4, len, n);
+      LUALUA_COUNT(S->sandbox, bytescopied, n);
+      lua_pushlstring(L, (const char *)p + offset, n);
+      break;
+    }
+    case LUALUA_U32: {
+      uint32_t v;
+      memcpy(&v, p + lualua_checkoffset(L, 4, len, sizeof(v)), sizeof(v));
+      lua_pushnumber(L, v);
+      break;
+    }
+    case LUALUA_U8:
+      lua_pushnumber(L, p[lualua_checkoffset(L, 4, len, 1)]);
+      break;
+  }
   return 1;
 }
 
-static int lualua_gettable(lua_State *L) {
+static int lualua_ref(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_checkoverflow(L, S, 2);
-  lua_pushvalue(S->state, index);
-  lua_pushcfunction(S->state, lualua_dogettable);
-  lua_insert(S->state, -3);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checkunderflow(L, S, 1);
+  int ref = luaL_ref(S->state, index);
+  lua_pushnumber(L, ref);
+  return 1;
+}
+
+static int lualua_refstats(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_State *SS = S->state;
+  lualua_checktemporaries(L, S, 2);
+  /*
+   * Refs in use are the positive integer keys that are not on the free list.
+   * The last free ref holds nil, so neither count includes it, and the border
+   * of the registry cannot be trusted around it.
+   */
+  int nregistry = 0;
+  lua_pushnil(SS);
+  while (lua_next(SS, LUA_REGISTRYINDEX)) {
+    lua_pop(SS, 1);
+    if (lua_type(SS, -1) == LUA_TNUMBER && lua_tonumber(SS, -1) > 0) {
+      ++nregistry;
+    }
+  }
+  lua_rawgeti(SS, LUA_REGISTRYINDEX, 0);
+  while (lua_tointeger(SS, -1) > 0) {
+    lua_rawgeti(SS, LUA_REGISTRYINDEX, lua_tointeger(SS, -1));
+    if (!lua_isnil(SS, -1)) {
+      --nregistry;
+    }
+    lua_replace(SS, -2);
+  }
+  lua_pop(SS, 1);
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, S->sandbox->ncallbacks);
+  lua_setfield(L, -2, "callbacks");
+  lua_pushnumber(L, S->sandbox->nuserdata);
+  lua_setfield(L, -2, "userdata");
+  lua_pushnumber(L, nregistry);
+  lua_setfield(L, -2, "registry");
+  return 1;
+}
+
+static int lualua_register(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  luaL_argcheck(L, lua_isfunction(L, 3), 3, "function expected");
+  lua_settop(L, 3);
+  lualua_dopushcfunction(L, S);
+  lualua_checktemporaries(L, S, 1);
+  lualua_pushhoststring(S->sandbox, S->state, name, len);
   lua_insert(S->state, -2);
-  lualua_safecall(L, S, 2, 1);
+  lua_settable(S->state, LUA_GLOBALSINDEX);
   return 0;
 }
 
-static int lualua_gettop(lua_State *L) {
+static int lualua_remove(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  lua_pushnumber(L, lua_gettop(S->state));
-  return 1;
+  int index = lualua_checkacceptablestackindex(L, 2, S);
+  lua_remove(S->state, index);
+  return 0;
 }
 
-static int lualua_insert(lua_State *L) {
+static int lualua_replace(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptablestackindex(L, 2, S);
-  lua_insert(S->state, index);
+  lua_replace(S->state, index);
   return 0;
 }
 
-static int lualua_isboolean(lua_State *L) {
+/*
+ * Threads that returned are remembered in the sandbox registry: their
+ * results stay on their stacks, where resuming would call the topmost one.
+ * These work on the stack of the thread itself, which needs three slots.
+ */
+static void lualua_pushfinished(lua_State *T) {
+  lua_getfield(T, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(T, -1, "finished");
+  lua_replace(T, -2);
+  lua_pushthread(T);
+}
+
+static int lualua_isfinished(lua_State *T) {
+  lualua_pushfinished(T);
+  lua_rawget(T, -2);
+  int finished = lua_toboolean(T, -1);
+  lua_pop(T, 2);
+  return finished;
+}
+
+static void lualua_setfinished(lua_State *T, int finished) {
+  lualua_pushfinished(T);
+  if (finished) {
+    lua_pushboolean(T, 1);
+  } else {
+    lua_pushnil(T);
+  }
+  lua_rawset(T, -3);
+  lua_pop(T, 1);
+}
+
+static int lualua_resume(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isboolean(S->state, index);
-  lua_pushboolean(L, result);
+  int narg = luaL_checkint(L, 2);
+  lualua_assert(L, S, S->threadref != LUA_NOREF, "not a thread");
+  lualua_checkunderflow(L, S, narg);
+  lualua_checktemporaries(L, S, 3);
+  lua_State *T = S->state;
+  /* Whatever sits below the arguments runs anew. */
+  if (lua_status(T) == 0) {
+    lualua_setfinished(T, 0);
+  }
+  int result = lualua_run(S, narg, 0, 0, 1);
+  if (result == 0 && lua_checkstack(T, 3)) {
+    lualua_setfinished(T, 1);
+  }
+  lua_pushinteger(L, result);
   return 1;
 }
 
-static int lualua_iscfunction(lua_State *L) {
+/* Whether resumeall may resume T: suspended, or not yet started. */
+static int lualua_isresumable(lua_State *T) {
+  lua_Debug ar;
+  int status = lua_status(T);
+  return status == LUA_YIELD ||
+         (status == 0 && !lua_getstack(T, 0, &ar) && lua_gettop(T) > 0 &&
+          !lualua_isfinished(T));
+}
+
+/*
+ * Resumes each thread in a host list once, without arguments, discarding
+ * any values it last yielded. Each resume gets its own budget. Threads that
+ * returned, failed or are running are left alone and get LUALUA_ERRDEAD.
+ */
+static int lualua_resumeall(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_iscfunction(S->state, index);
-  lua_pushboolean(L, result);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lualua_Sandbox *sb = S->sandbox;
+  int n = lua_objlen(L, 2);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 2, i);
+    lualua_State *T = lualua_tostate(L, -1);
+    if (T == NULL || T->sandbox != sb || T->threadref == LUA_NOREF) {
+      return luaL_error(L, "bad thread #%d", i);
+    }
+    lualua_checktemporaries(L, T, 3);
+    lua_pop(L, 1);
+  }
+  double budget = sb->budget;
+  int granularity = sb->granularity;
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "budget");
+    lua_getfield(L, 3, "granularity");
+  } else {
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+  lualua_dosetbudget(L, sb, 3, 4, 5);
+  double threadbudget = sb->budget;
+  lua_createtable(L, n, 0);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 2, i);
+    lualua_State *T = lua_touserdata(L, -1);
+    int result = LUALUA_ERRDEAD;
+    if (lualua_isresumable(T->state)) {
+      if (lua_status(T->state) == LUA_YIELD) {
+        lua_settop(T->state, 0);
+      }
+      sb->budget = threadbudget;
+      result = lualua_run(T, 0, 0, 0, 1);
+      if (result == 0 && lua_checkstack(T->state, 3)) {
+        lualua_setfinished(T->state, 1);
+      }
+    }
+    lua_pushinteger(L, result);
+    lua_rawseti(L, -3, i);
+    lua_pop(L, 1);
+  }
+  sb->budget = budget;
+  sb->granularity = granularity;
   return 1;
 }
 
-static int lualua_isfunction(lua_State *L) {
+static int lualua_setbudget(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lua_settop(L, 3);
+  lualua_dosetbudget(L, S->sandbox, 2, 2, 3);
+  return 0;
+}
+
+static int lualua_setfenv(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isfunction(S->state, index);
-  lua_pushboolean(L, result);
+  lualua_checkunderflow(L, S, 1);
+  lualua_assert(L, S, lua_type(S->state, -1) == LUA_TTABLE, "type error");
+  lualua_checktemporaries(L, S, 1);
+  if (!lualua_canchangeenv(S->state, S->sandbox, index)) {
+    lua_pop(S->state, 1);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  int value = lua_setfenv(S->state, index);
+  lua_pushboolean(L, value);
   return 1;
 }
 
-static int lualua_islightuserdata(lua_State *L) {
+static int lualua_dosetfield(lua_State *SS) {
+  lua_settable(SS, 1);
+  return 0;
+}
+
+static void lualua_setfieldop(lua_State *L, lualua_State *S, int index,
+                              const char *k, size_t klen) {
+  lualua_checktemporaries(L, S, 7);
+  lua_pushvalue(S->state, index);
+  lualua_pushhoststring(S->sandbox, S->state, k, klen);
+  lua_pushvalue(S->state, -3);
+  if (lualua_fastset(S->state, -3)) {
+    lua_pop(S->state, 2);
+    return;
+  }
+  lua_remove(S->state, -4);
+  lua_pushcfunction(S->state, lualua_dosetfield);
+  lua_insert(S->state, -4);
+  lualua_safecall(L, S, 3, 0);
+}
+
+static int lualua_setfield(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_islightuserdata(S->state, index);
-  lua_pushboolean(L, result);
-  return 1;
+  size_t klen;
+  const char *k = luaL_checklstring(L, 3, &klen);
+  lualua_checkunderflow(L, S, 1);
+  lualua_setfieldop(L, S, index, k, klen);
+  return 0;
 }
 
-static int lualua_isnil(lua_State *L) {
+static int lualua_setglobal(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  size_t klen;
+  const char *k = luaL_checklstring(L, 2, &klen);
+  lualua_checkunderflow(L, S, 1);
+  lualua_checktemporaries(L, S, 1);
+  lualua_pushhoststring(S->sandbox, S->state, k, klen);
+  lua_insert(S->state, -2);
+  lua_settable(S->state, LUA_GLOBALSINDEX);
+  return 0;
+}
+
+static int lualua_setmetatable(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isnil(S->state, index);
+  int type = lua_type(S->state, -1);
+  lualua_assert(L, S, type == LUA_TTABLE || type == LUA_TNIL, "type error");
+  lualua_checktemporaries(L, S, 10);
+  lua_State *SS = S->state;
+  lualua_Hostdata *u = lualua_tohostdata(SS, index, S->sandbox);
+  if (u != NULL) {
+    lualua_prepmetatable(SS, u, index, 1);
+  }
+  int result = lua_setmetatable(SS, index);
   lua_pushboolean(L, result);
   return 1;
 }
 
-static int lualua_isnone(lua_State *L) {
+static int lualua_dosettable(lua_State *SS) {
+  lua_settable(SS, 1);
+  return 0;
+}
+
+static void lualua_settableop(lua_State *L, lualua_State *S, int index) {
+  lualua_checktemporaries(L, S, 4);
+  if (lualua_fastset(S->state, index)) {
+    return;
+  }
+  lua_pushvalue(S->state, index);
+  lua_insert(S->state, -3);
+  lua_pushcfunction(S->state, lualua_dosettable);
+  lua_insert(S->state, -4);
+  lualua_safecall(L, S, 3, 0);
+}
+
+static int lualua_settable(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isnone(S->state, index);
-  lua_pushboolean(L, result);
-  return 1;
+  lualua_checkunderflow(L, S, 2);
+  lualua_checkoverflow(L, S, 2);
+  lualua_settableop(L, S, index);
+  return 0;
+}
+
+static int lualua_setstringcache(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int size = luaL_checkint(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "negative size");
+  lualua_Sandbox *sb = S->sandbox;
+  lualua_CachedString *strings = NULL;
+  if (size > 0) {
+    strings = malloc(size * sizeof(*strings));
+    if (strings == NULL) {
+      return luaL_error(L, "not enough memory");
+    }
+  }
+  lualua_clearstrings(sb, S->state, 1);
+  free(sb->strings);
+  sb->strings = strings;
+  sb->nstrings = size;
+  lualua_clearstrings(sb, S->state, 0);
+  return 0;
+}
+
+static int lualua_settop(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  int index = luaL_checkint(L, 2);
+  lualua_assert(L, S,
+                index == -1 || index == 0 || lualua_isacceptableindex(S, index),
+                "invalid settop index");
+  lua_settop(S->state, index);
+  return 0;
 }
 
-static int lualua_isnoneornil(lua_State *L) {
+static int lualua_status(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isnoneornil(S->state, index);
-  lua_pushboolean(L, result);
+  lua_pushinteger(L, lua_status(S->state));
   return 1;
 }
 
-static int lualua_isnumber(lua_State *L) {
+static int lualua_stringcachestats(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isnumber(S->state, index);
-  lua_pushboolean(L, result);
+  lualua_Sandbox *sb = S->sandbox;
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, sb->nstrings);
+  lua_setfield(L, -2, "size");
+  lua_pushnumber(L, sb->stringhits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, sb->stringmisses);
+  lua_setfield(L, -2, "misses");
   return 1;
 }
 
-static int lualua_isstring(lua_State *L) {
+static int lualua_toboolean(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isstring(S->state, index);
-  lua_pushboolean(L, result);
+  int b = lua_toboolean(S->state, index);
+  lua_pushboolean(L, b);
   return 1;
 }
 
-static int lualua_istable(lua_State *L) {
+static int lualua_tonumber(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_istable(S->state, index);
-  lua_pushboolean(L, result);
+  lua_Number number = lua_tonumber(S->state, index);
+  lua_pushnumber(L, number);
   return 1;
 }
 
-static int lualua_isthread(lua_State *L) {
+static int lualua_tolstring(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isthread(S->state, index);
-  lua_pushboolean(L, result);
-  return 1;
+  size_t len;
+  const char *s = lua_tolstring(S->state, index, &len);
+  if (s == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  LUALUA_COUNT(S->sandbox, bytescopied, len);
+  lua_pushlstring(L, s, len);
+  lua_pushnumber(L, len);
+  return 2;
 }
 
-static int lualua_isuserdata(lua_State *L) {
+static int lualua_tostring(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int result = lua_isuserdata(S->state, index);
-  lua_pushboolean(L, result);
+  lualua_copystring(S->sandbox, L, S->state, index);
   return 1;
 }
 
-static int lualua_dolessthan(lua_State *SS) {
-  lua_pushboolean(SS, lua_lessthan(SS, -2, -1));
-  return 1;
-}
-
-static int lualua_lessthan(lua_State *L) {
+static int lualua_totable(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index1 = lualua_checkacceptableindex(L, 2, S);
-  int index2 = lualua_checkacceptableindex(L, 3, S);
-  lualua_checkoverflow(L, S, 3);
-  lua_pushcfunction(S->state, lualua_dolessthan);
-  lua_pushvalue(S->state, index1);
-  lua_pushvalue(S->state, index2);
-  lualua_safecall(L, S, 2, 1);
-  lua_pushboolean(L, lua_toboolean(S->state, -1));
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_Copy c;
+  lualua_optcopy(L, 3, &c);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  c.from = S->state;
+  c.to = L;
+  lualua_copy(L, S, &c, index);
   return 1;
 }
 
-static int lualua_loadstring(lua_State *L) {
+static int lualua_tothread(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  size_t sz;
-  const char *buff = luaL_checklstring(L, 2, &sz);
-  const char *chunkname = luaL_optstring(L, 3, buff);
-  lualua_checkoverflow(L, S, 1);
-  int value = luaL_loadbuffer(S->state, buff, sz, chunkname);
-  lua_pushinteger(L, value);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  if (!lua_isthread(S->state, index)) {
+    lua_pushnil(L);
+  } else {
+    lualua_wrapthread(L, S, index);
+  }
   return 1;
 }
 
-static int lualua_newtable(lua_State *L) {
+static int lualua_tobuffer(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  lualua_checkoverflow(L, S, 1);
-  lua_newtable(S->state);
-  return 0;
-}
-
-static void lualua_gctokenize(lua_State *SS, int ref) {
-  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
-  lua_getfield(SS, -1, "gctokens");
-  lua_pushvalue(SS, -3);
-  int *token = lua_newuserdata(SS, sizeof(int));
-  *token = ref;
-  lua_getfield(SS, -4, "gctokenmt");
-  lua_setmetatable(SS, -2);
-  lua_settable(SS, -3);
-  lua_pop(SS, 2);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checktemporaries(L, S, 1);
+  size_t len;
+  unsigned char *p = lualua_getbuffer(S->state, S->sandbox, index, &len);
+  if (p == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushlightuserdata(L, p);
+  lua_pushnumber(L, len);
+  return 2;
 }
 
-static int lualua_newuserdata(lua_State *L) {
+static int lualua_touserdata(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  lualua_checkoverflow(L, S, 6);
-  lua_newtable(L);
-  lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
-  lua_pushvalue(L, -2);
-  int ref = luaL_ref(L, -2);
-  lua_pop(L, 1);
-  *(int *)lua_newuserdata(S->state, sizeof(int)) = ref;
-  lualua_gctokenize(S->state, ref);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  lualua_checktemporaries(L, S, 1);
+  lualua_Hostdata *u = lualua_tohostdata(S->state, index, S->sandbox);
+  if (u == NULL) {
+    lua_pushnil(L);
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, S->sandbox->hostrefs);
+    lua_rawgeti(L, -1, u->ref);
+  }
   return 1;
 }
 
-static int lualua_next(lua_State *L) {
+/*
+ * Calls the named method in protected mode, returning true and its results
+ * or false and the error. A failed method leaves the stack below its
+ * operands as it was, rather than emptying it.
+ */
+static int lualua_try(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lualua_checkoverflow(L, S, 1);
-  int value = lua_next(S->state, index);
-  lua_pushboolean(L, value);
-  return 1;
+  luaL_checktype(L, 2, LUA_TSTRING);
+  lua_getmetatable(L, 1);
+  lua_pushliteral(L, "__index");
+  lua_rawget(L, -2);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  luaL_argcheck(L, lua_iscfunction(L, -1), 2, "unknown method");
+  lua_replace(L, 2);
+  lua_pop(L, 2);
+  /* Keep the state at 1, so that it outlives the call. */
+  lua_pushvalue(L, 1);
+  lua_insert(L, 3);
+  lualua_Sandbox *sb = S->sandbox;
+  int top = lua_gettop(S->state);
+  int trying = sb->trying;
+  sb->trying = 1;
+  int status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+  sb->trying = trying;
+  if (status != 0 && lua_gettop(S->state) > top) {
+    /* Drop whatever the method left behind, such as partial copies. */
+    lua_settop(S->state, top);
+  }
+  lua_pushboolean(L, status == 0);
+  lua_replace(L, 1);
+  return lua_gettop(L);
 }
 
-static int lualua_objlen(lua_State *L) {
+static int lualua_typename(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
   int index = lualua_checkacceptableindex(L, 2, S);
-  int value = lua_objlen(S->state, index);
-  lua_pushinteger(L, value);
+  const char *s = luaL_typename(S->state, index);
+  lua_pushstring(L, s);
   return 1;
 }
 
-static int lualua_openlibs(lua_State *L) {
+static int lualua_unref(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  luaL_openlibs(S->state);
+  int index = lualua_checkacceptableindex(L, 2, S);
+  int ref = luaL_checkint(L, 3);
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
+  lualua_checktemporaries(L, S, 1);
+  luaL_unref(S->state, index, ref);
   return 0;
 }
 
-static int lualua_pcall(lua_State *L) {
+static int lualua_writebuffer(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int nargs = luaL_checkint(L, 2);
-  int nresults = luaL_checkint(L, 3);
-  int errfunc = luaL_checkint(L, 4);
-  if (errfunc != 0) {
-    lualua_assert(L, S, lualua_isacceptableindex(S, errfunc), "invalid index");
+  size_t len;
+  unsigned char *p = lualua_checkbuffer(L, S, 2, &len);
+  int kind = luaL_checkoption(L, 3, NULL, lualua_bufferkinds);
+  switch (kind) {
+    case LUALUA_F64: {
+      double v = luaL_checknumber(L, 5);
+      memcpy(p + lualua_checkoffset(L, 4, len, sizeof(v)), &v, sizeof(v));
+      break;
+    }
+    case LUALUA_STRING: {
+      size_t n;
+      const char *v = luaL_checklstring(L, 5, &n);
+      memcpy(p + lualua_checkoffset(L, 4, len, n), v, n);
+      LUALUA_COUNT(S->sandbox, bytescopied, n);
+      break;
+    }
+    case LUALUA_U32: {
+      lua_Number n = luaL_checknumber(L, 5);
+      luaL_argcheck(L, n >= 0 && n <= UINT32_MAX && n == (uint32_t)n, 5,
+                    "value out of range");
+      uint32_t v = n;
+      memcpy(p + lualua_checkoffset(L, 4, len, sizeof(v)), &v, sizeof(v));
+      break;
+    }
+    case LUALUA_U8: {
+      lua_Number n = luaL_checknumber(L, 5);
+      luaL_argcheck(L, n >= 0 && n <= UCHAR_MAX && n == (unsigned char)n, 5,
+                    "value out of range");
+      p[lualua_checkoffset(L, 4, len, 1)] = n;
+      break;
+    }
   }
-  lualua_checkunderflow(L, S, nargs + 1);
-  lualua_checkoverflow(L, S, 1);
-  int result = lua_pcall(S->state, nargs, nresults, errfunc);
-  lua_pushinteger(L, result);
-  return 1;
+  return 0;
 }
 
-static int lualua_pop(lua_State *L) {
+static int lualua_xmove(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  int n = luaL_checkint(L, 2);
-  /* Analogous to lualua_settop, since pop is defined in terms of settop. */
-  lualua_assert(L, S, n == -1 || n == 0 || lualua_isacceptableindex(S, -n),
-                "stack underflow");
-  lua_pop(S->state, n);
+  lualua_State *T = lualua_checkstate(L, 2);
+  int n = luaL_checkint(L, 3);
+  lualua_assert(L, S, S->sandbox == T->sandbox,
+                "states are not in the same sandbox");
+  lualua_checkunderflow(L, S, n);
+  lualua_checkoverflow(L, T, n);
+  lua_xmove(S->state, T->state, n);
   return 0;
 }
 
-static int lualua_pushboolean(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int b = lua_toboolean(L, 2);
-  lualua_checkoverflow(L, S, 1);
-  lua_pushboolean(S->state, b);
-  return 0;
+/*
+ * Stack programs: a sequence of stack operations validated once by
+ * lualua.compile and then run by s:exec in a single host call.
+ */
+
+enum {
+  LUALUA_OP_CALL,
+  LUALUA_OP_CREATETABLE,
+  LUALUA_OP_GETFIELD,
+  LUALUA_OP_GETGLOBAL,
+  LUALUA_OP_GETTABLE,
+  LUALUA_OP_INSERT,
+  LUALUA_OP_NEWTABLE,
+  LUALUA_OP_POP,
+  LUALUA_OP_PUSHARG,
+  LUALUA_OP_PUSHBOOLEAN,
+  LUALUA_OP_PUSHNIL,
+  LUALUA_OP_PUSHNUMBER,
+  LUALUA_OP_PUSHSTRING,
+  LUALUA_OP_PUSHVALUE,
+  LUALUA_OP_RAWGET,
+  LUALUA_OP_RAWGETI,
+  LUALUA_OP_RAWSET,
+  LUALUA_OP_RAWSETI,
+  LUALUA_OP_REMOVE,
+  LUALUA_OP_REPLACE,
+  LUALUA_OP_SETFIELD,
+  LUALUA_OP_SETGLOBAL,
+  LUALUA_OP_SETTABLE,
+  LUALUA_OP_SETTOP,
+  LUALUA_OP_TOBOOLEAN,
+  LUALUA_OP_TONUMBER,
+  LUALUA_OP_TOSTRING,
+};
+
+/*
+ * Operand kinds: 'i' acceptable index, 't' stack index, 'n' nonnegative
+ * count, 'k' integer, 'd' number, 'b' boolean, 's' string. The stack
+ * effect is the number of values consumed and then pushed.
+ */
+typedef struct {
+  const char *name;
+  int op;
+  const char *operands;
+  int consumed;
+  int pushed;
+} lualua_OpInfo;
+
+static const lualua_OpInfo lualua_opinfos[] = {
+    {"call", LUALUA_OP_CALL, "nn", 0, 0},
+    {"createtable", LUALUA_OP_CREATETABLE, "nn", 0, 1},
+    {"getfield", LUALUA_OP_GETFIELD, "is", 0, 1},
+    {"getglobal", LUALUA_OP_GETGLOBAL, "s", 0, 1},
+    {"gettable", LUALUA_OP_GETTABLE, "i", 1, 1},
+    {"insert", LUALUA_OP_INSERT, "t", 1, 1},
+    {"newtable", LUALUA_OP_NEWTABLE, "", 0, 1},
+    {"pop", LUALUA_OP_POP, "n", 0, 0},
+    {"pusharg", LUALUA_OP_PUSHARG, "n", 0, 1},
+    {"pushboolean", LUALUA_OP_PUSHBOOLEAN, "b", 0, 1},
+    {"pushnil", LUALUA_OP_PUSHNIL, "", 0, 1},
+    {"pushnumber", LUALUA_OP_PUSHNUMBER, "d", 0, 1},
+    {"pushstring", LUALUA_OP_PUSHSTRING, "s", 0, 1},
+    {"pushvalue", LUALUA_OP_PUSHVALUE, "i", 0, 1},
+    {"rawget", LUALUA_OP_RAWGET, "i", 1, 1},
+    {"rawgeti", LUALUA_OP_RAWGETI, "ik", 0, 1},
+    {"rawset", LUALUA_OP_RAWSET, "i", 2, 0},
+    {"rawseti", LUALUA_OP_RAWSETI, "ik", 1, 0},
+    {"remove", LUALUA_OP_REMOVE, "t", 1, 0},
+    {"replace", LUALUA_OP_REPLACE, "t", 1, 0},
+    {"setfield", LUALUA_OP_SETFIELD, "is", 1, 0},
+    {"setglobal", LUALUA_OP_SETGLOBAL, "s", 1, 0},
+    {"settable", LUALUA_OP_SETTABLE, "i", 2, 0},
+    {"settop", LUALUA_OP_SETTOP, "k", 0, 0},
+    {"toboolean", LUALUA_OP_TOBOOLEAN, "i", 0, 0},
+    {"tonumber", LUALUA_OP_TONUMBER, "i", 0, 0},
+    {"tostring", LUALUA_OP_TOSTRING, "i", 0, 0},
+    {NULL, 0, NULL, 0, 0},
+};
+
+typedef struct {
+  int op;
+  int a;
+  int b;
+  lua_Number n;
+  const char *k;
+  size_t klen;
+} lualua_Op;
+
+typedef struct {
+  int nops;
+  int nresults; /* number of host values produced by to* ops */
+  int need;     /* stack values the program expects to already exist */
+  int grow;     /* maximum stack growth above the starting top */
+  int maxpos;   /* largest positive index used */
+  lualua_Op ops[1];
+} lualua_Program;
+
+static const char lualua_program_metatable[] = "lualua program";
+
+static int lualua_compileerror(lua_State *L, int pc, const char *msg) {
+  return luaL_error(L, "bad op #%d (%s)", pc, msg);
 }
 
-static int lualua_invokefromhostregistry(lua_State *SS) {
-  int hostfunref = lua_tonumber(SS, lua_upvalueindex(1));
-  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
-  lua_getfield(SS, -1, "host");
-  lua_State *L = lua_touserdata(SS, -1);
-  lua_pop(SS, 2);
-  if (!lua_checkstack(L, 3)) {
-    return luaL_error(SS, "host stack overflow");
+/* Tracks the stack effects of one index operand at relative depth d. */
+static void lualua_compileindex(lua_State *L, lualua_Program *p, int pc,
+                                int stackonly, int index, int d) {
+  if (index > 0) {
+    p->maxpos = index > p->maxpos ? index : p->maxpos;
+  } else if (index < 0 && !lualua_ispseudoindex(index)) {
+    p->need = -index - d > p->need ? -index - d : p->need;
+  } else if (index == 0 || stackonly) {
+    lualua_compileerror(L, pc, "invalid index");
   }
-  lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
-  lua_rawgeti(L, -1, hostfunref);
-  lua_remove(L, -2);
-  lualua_State *p = lua_newuserdata(L, sizeof(*p));
-  luaL_getmetatable(L, lualua_state_metatable);
+}
+
+static int lualua_compile(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int nops = lua_objlen(L, 1);
+  lualua_Program *p = lua_newuserdata(
+      L, sizeof(*p) + (nops > 0 ? nops - 1 : 0) * sizeof(lualua_Op));
+  luaL_getmetatable(L, lualua_program_metatable);
   lua_setmetatable(L, -2);
-  p->state = SS;
-  p->stackmax = LUA_MINSTACK;
-  p->stateowner = 0;
-  int value = lua_pcall(L, 1, 1, 0);
-  if (value != 0) {
-    lua_pushstring(SS, lua_tostring(L, -1));
+  lua_newtable(L); /* keeps string operands alive */
+  p->nops = nops;
+  p->nresults = 0;
+  p->need = 0;
+  p->grow = 0;
+  p->maxpos = 0;
+  int d = 0;
+  for (int pc = 1; pc <= nops; ++pc) {
+    lualua_Op *o = &p->ops[pc - 1];
+    lua_rawgeti(L, 1, pc);
+    if (!lua_istable(L, -1)) {
+      lualua_compileerror(L, pc, "table expected");
+    }
+    lua_rawgeti(L, -1, 1);
+    const char *name = lua_tostring(L, -1);
+    const lualua_OpInfo *info = lualua_opinfos;
+    while (info->name != NULL && (name == NULL || strcmp(info->name, name))) {
+      ++info;
+    }
+    if (info->name == NULL) {
+      lualua_compileerror(L, pc, "unknown op");
+    }
     lua_pop(L, 1);
-    return lua_error(SS);
-  } else {
-    int nreturn = lua_tonumber(L, -1);
+    o->op = info->op;
+    o->a = 0;
+    o->b = 0;
+    o->n = 0;
+    o->k = NULL;
+    o->klen = 0;
+    int consumed = info->consumed;
+    int pushed = info->pushed;
+    int ints = 0;
+    for (int i = 0; info->operands[i] != '\0'; ++i) {
+      lua_rawgeti(L, -1, i + 2);
+      switch (info->operands[i]) {
+        case 'b':
+          o->a = lua_toboolean(L, -1);
+          break;
+        case 'd':
+          if (!lua_isnumber(L, -1)) {
+            lualua_compileerror(L, pc, "number expected");
+          }
+          o->n = lua_tonumber(L, -1);
+          break;
+        case 's':
+          if (!lua_isstring(L, -1)) {
+            lualua_compileerror(L, pc, "string expected");
+          }
+          o->k = lua_tolstring(L, -1, &o->klen);
+          lua_pushvalue(L, -1);
+          lua_rawseti(L, -4, lua_objlen(L, -4) + 1);
+          break;
+        default: {
+          if (!lua_isnumber(L, -1)) {
+            lualua_compileerror(L, pc, "number expected");
+          }
+          int v = lua_tointeger(L, -1);
+          if (info->operands[i] == 'n' && v < 0) {
+            lualua_compileerror(L, pc, "negative count");
+          } else if (info->operands[i] == 'i' || info->operands[i] == 't') {
+            lualua_compileindex(L, p, pc, info->operands[i] == 't', v, d);
+          }
+          *(ints++ == 0 ? &o->a : &o->b) = v;
+          break;
+        }
+      }
+      lua_pop(L, 1);
+    }
     lua_pop(L, 1);
-    return nreturn;
+    switch (o->op) {
+      case LUALUA_OP_CALL:
+        consumed = o->a + 1;
+        pushed = o->b;
+        break;
+      case LUALUA_OP_POP:
+        consumed = o->a;
+        break;
+      case LUALUA_OP_PUSHARG:
+        if (o->a == 0) {
+          lualua_compileerror(L, pc, "invalid argument");
+        }
+        break;
+      case LUALUA_OP_SETTOP:
+        if (o->a >= 0) {
+          lualua_compileerror(L, pc, "settop requires a negative index");
+        }
+        consumed = -o->a - 1;
+        break;
+      case LUALUA_OP_TOBOOLEAN:
+      case LUALUA_OP_TONUMBER:
+      case LUALUA_OP_TOSTRING:
+        ++p->nresults;
+        break;
+    }
+    p->need = consumed - d > p->need ? consumed - d : p->need;
+    d += pushed - consumed;
+    p->grow = d > p->grow ? d : p->grow;
   }
+  lua_setfenv(L, -2);
+  return 1;
 }
 
-static void lualua_dopushcfunction(lua_State *L, lualua_State *S) {
-  lualua_checkoverflow(L, S, 2);
-  lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
-  lua_insert(L, -2);
-  int hostfunref = luaL_ref(L, -2);
-  lua_pushnumber(S->state, hostfunref);
-  lua_pushcclosure(S->state, lualua_invokefromhostregistry, 1);
-  lualua_gctokenize(S->state, hostfunref);
+static void lualua_checktable(lua_State *L, lualua_State *S, int index) {
+  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
 }
 
-static int lualua_pushcfunction(lua_State *L) {
+static int lualua_exec(lua_State *L) {
   lualua_State *S = lualua_checkstate(L, 1);
-  luaL_argcheck(L, lua_isfunction(L, 2), 2, "function expected");
-  lua_settop(L, 2);
-  lualua_dopushcfunction(L, S);
-  return 0;
+  lualua_Program *p = luaL_checkudata(L, 2, lualua_program_metatable);
+  int top = lua_gettop(S->state);
+  lualua_assert(L, S, top >= p->need, "stack underflow");
+  lualua_assert(L, S, S->stackmax - top >= p->grow, "stack overflow");
+  lualua_assert(L, S, p->maxpos <= S->stackmax, "invalid index");
+  if (!lua_checkstack(S->state, p->grow + 4)) {
+    luaL_error(L, "stack overflow");
+  }
+  luaL_checkstack(L, p->nresults, "too many results");
+  int nresults = 0;
+  for (const lualua_Op *o = p->ops, *e = p->ops + p->nops; o != e; ++o) {
+    lua_State *SS = S->state;
+    int a = lualua_absoluteindex(S, o->a);
+    switch (o->op) {
+      case LUALUA_OP_CALL:
+        lualua_safecall(L, S, o->a, o->b);
+        break;
+      case LUALUA_OP_CREATETABLE:
+        lua_createtable(SS, o->a, o->b);
+        break;
+      case LUALUA_OP_GETFIELD:
+        lualua_getfieldop(L, S, a, o->k, o->klen);
+        break;
+      case LUALUA_OP_GETGLOBAL:
+        lualua_pushhoststring(S->sandbox, SS, o->k, o->klen);
+        lua_gettable(SS, LUA_GLOBALSINDEX);
+        break;
+      case LUALUA_OP_GETTABLE:
+        lualua_gettableop(L, S, a);
+        break;
+      case LUALUA_OP_INSERT:
+        lua_insert(SS, a);
+        break;
+      case LUALUA_OP_NEWTABLE:
+        lua_newtable(SS);
+        break;
+      case LUALUA_OP_POP:
+        lua_pop(SS, o->a);
+        break;
+      case LUALUA_OP_PUSHARG:
+        lualua_pusharg(L, S, o->a + 2);
+        break;
+      case LUALUA_OP_PUSHBOOLEAN:
+        lua_pushboolean(SS, o->a);
+        break;
+      case LUALUA_OP_PUSHNIL:
+        lua_pushnil(SS);
+        break;
+      case LUALUA_OP_PUSHNUMBER:
+        lua_pushnumber(SS, o->n);
+        break;
+      case LUALUA_OP_PUSHSTRING:
+        lualua_pushhoststring(S->sandbox, SS, o->k, o->klen);
+        break;
+      case LUALUA_OP_PUSHVALUE:
+        lua_pushvalue(SS, a);
+        break;
+      case LUALUA_OP_RAWGET:
+        lualua_checktable(L, S, a);
+        lua_rawget(SS, a);
+        break;
+      case LUALUA_OP_RAWGETI:
+        lualua_checktable(L, S, a);
+        lua_rawgeti(SS, a, o->b);
+        break;
+      case LUALUA_OP_RAWSET:
+        lualua_checktable(L, S, a);
+        lua_rawset(SS, a);
+        break;
+      case LUALUA_OP_RAWSETI:
+        lualua_checktable(L, S, a);
+        lua_rawseti(SS, a, o->b);
+        break;
+      case LUALUA_OP_REMOVE:
+        lua_remove(SS, a);
+        break;
+      case LUALUA_OP_REPLACE:
+        lua_replace(SS, a);
+        break;
+      case LUALUA_OP_SETFIELD:
+        lualua_setfieldop(L, S, a, o->k, o->klen);
+        break;
+      case LUALUA_OP_SETGLOBAL:
+        lualua_pushhoststring(S->sandbox, SS, o->k, o->klen);
+        lua_insert(SS, -2);
+        lua_settable(SS, LUA_GLOBALSINDEX);
+        break;
+      case LUALUA_OP_SETTABLE:
+        lualua_settableop(L, S, a);
+        break;
+      case LUALUA_OP_SETTOP:
+        lua_settop(SS, o->a);
+        break;
+      case LUALUA_OP_TOBOOLEAN:
+        lua_pushboolean(L, lua_toboolean(SS, a));
+        ++nresults;
+        break;
+      case LUALUA_OP_TONUMBER:
+        lua_pushnumber(L, lua_tonumber(SS, a));
+        ++nresults;
+        break;
+      case LUALUA_OP_TOSTRING:
+        lualua_copystring(S->sandbox, L, SS, a);
+        ++nresults;
+        break;
+    }
+  }
+  return nresults;
 }
 
-static int lualua_pushnil(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  lualua_checkoverflow(L, S, 1);
-  lua_pushnil(S->state);
-  return 0;
+/*
+ * State pools. Each pooled state is initialized once, after which the
+ * globals, the registry, the string metatable and every table directly
+ * inside the globals or registry are snapshotted. Releasing a state back
+ * to the pool restores those tables in place rather than building a new
+ * state; anything nested more deeply is not restored.
+ */
+
+typedef struct {
+  int size;
+  int nidle;
+  double hits;
+  double misses;
+  double resets;
+  double resettime;
+} lualua_Pool;
+
+static const char lualua_pool_metatable[] = "lualua pool";
+
+static double lualua_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static int lualua_pushnumber(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  lua_Number n = luaL_checknumber(L, 2);
-  lualua_checkoverflow(L, S, 1);
-  lua_pushnumber(S->state, n);
-  return 0;
+/* Records the table on top of the stack in the snapshot at index. */
+static void lualua_snapshottable(lua_State *SS, int snapshot) {
+  lua_getfield(SS, snapshot, "tables");
+  lua_pushvalue(SS, -2);
+  lua_rawget(SS, -2);
+  if (!lua_isnil(SS, -1)) {
+    lua_pop(SS, 2);
+    return;
+  }
+  lua_pop(SS, 1);
+  lua_pushvalue(SS, -2);
+  lua_newtable(SS);
+  lua_pushnil(SS);
+  while (lua_next(SS, -5)) {
+    lua_pushvalue(SS, -2);
+    lua_insert(SS, -2);
+    lua_rawset(SS, -4);
+  }
+  lua_rawset(SS, -3);
+  lua_pop(SS, 1);
+  lua_getfield(SS, snapshot, "metatables");
+  lua_pushvalue(SS, -2);
+  if (!lua_getmetatable(SS, -1)) {
+    lua_pushboolean(SS, 0);
+  }
+  lua_rawset(SS, -3);
+  lua_pop(SS, 1);
 }
 
-static int lualua_pushstring(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  const char *s = luaL_checkstring(L, 2);
-  lualua_checkoverflow(L, S, 1);
-  lua_pushstring(S->state, s);
-  return 0;
+/* Snapshots the table at index and each table directly inside it. */
+static void lualua_snapshottables(lua_State *SS, int snapshot, int index) {
+  lua_pushvalue(SS, index);
+  lualua_snapshottable(SS, snapshot);
+  lua_pushnil(SS);
+  while (lua_next(SS, -2)) {
+    if (lua_istable(SS, -1) &&
+        !(lua_type(SS, -2) == LUA_TSTRING &&
+          strcmp(lua_tostring(SS, -2), lualua_sandbox_refname) == 0)) {
+      lualua_snapshottable(SS, snapshot);
+    }
+    lua_pop(SS, 1);
+  }
+  lua_pop(SS, 1);
 }
 
-static int lualua_pushvalue(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_checkoverflow(L, S, 1);
-  lua_pushvalue(S->state, index);
-  return 0;
+static void lualua_snapshot(lua_State *SS) {
+  lua_checkstack(SS, 10);
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_newtable(SS);
+  int snapshot = lua_gettop(SS);
+  lua_pushvalue(SS, LUA_GLOBALSINDEX);
+  lua_setfield(SS, snapshot, "globals");
+  lua_newtable(SS);
+  lua_setfield(SS, snapshot, "tables");
+  lua_newtable(SS);
+  lua_setfield(SS, snapshot, "metatables");
+  lualua_snapshottables(SS, snapshot, LUA_GLOBALSINDEX);
+  lualua_snapshottables(SS, snapshot, LUA_REGISTRYINDEX);
+  lua_pushstring(SS, "");
+  if (lua_getmetatable(SS, -1)) {
+    lualua_snapshottable(SS, snapshot);
+    lua_pop(SS, 1);
+  }
+  lua_pop(SS, 1);
+  lua_setfield(SS, -2, "snapshot");
+  lua_pop(SS, 1);
 }
 
-static int lualua_rawequal(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index1 = lualua_checkacceptableindex(L, 2, S);
-  int index2 = lualua_checkacceptableindex(L, 3, S);
-  int value = lua_rawequal(S->state, index1, index2);
-  lua_pushboolean(L, value);
+static int lualua_reset(lua_State *SS) {
+  lua_settop(SS, 0);
+  lua_checkstack(SS, 10);
+  lua_getfield(SS, LUA_REGISTRYINDEX, lualua_sandbox_refname);
+  lua_getfield(SS, 1, "snapshot");
+  if (lua_isnil(SS, 2)) {
+    lua_settop(SS, 0);
+    return 0;
+  }
+  lua_getfield(SS, 2, "globals");
+  lua_replace(SS, LUA_GLOBALSINDEX);
+  lua_getfield(SS, 2, "metatables");
+  lua_getfield(SS, 2, "tables");
+  lua_pushnil(SS);
+  while (lua_next(SS, 4)) {
+    /* Clearing fields during traversal is allowed; adding them is not. */
+    lua_pushnil(SS);
+    while (lua_next(SS, 5)) {
+      lua_pop(SS, 1);
+      lua_pushvalue(SS, -1);
+      lua_rawget(SS, 6);
+      if (lua_isnil(SS, -1)) {
+        lua_pushvalue(SS, -2);
+        lua_insert(SS, -2);
+        lua_rawset(SS, 5);
+      } else {
+        lua_pop(SS, 1);
+      }
+    }
+    lua_pushnil(SS);
+    while (lua_next(SS, 6)) {
+      lua_pushvalue(SS, -2);
+      lua_insert(SS, -2);
+      lua_rawset(SS, 5);
+    }
+    lua_pushvalue(SS, 5);
+    lua_rawget(SS, 3);
+    if (!lua_toboolean(SS, -1)) {
+      lua_pop(SS, 1);
+      lua_pushnil(SS);
+    }
+    lua_setmetatable(SS, 5);
+    lua_pop(SS, 1);
+  }
+  lua_settop(SS, 0);
+  /* Restoring the registry dropped any refs the string cache held. */
+  lualua_clearstrings(lualua_getsandbox(SS), SS, 0);
+  lua_gc(SS, LUA_GCRESTART, 0);
   return 1;
 }
 
-static int lualua_rawget(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lua_rawget(S->state, index);
+static int lualua_newpoolstate(lua_State *L, int pool) {
+  lua_pushcfunction(L, lualua_newstate);
+  lua_call(L, 0, 1);
+  lua_getfenv(L, pool);
+  lua_getfield(L, -1, "init");
+  lua_remove(L, -2);
+  if (!lua_isnil(L, -1)) {
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 0);
+  } else {
+    lua_pop(L, 1);
+  }
+  lualua_State *S = lua_touserdata(L, -1);
+  lua_settop(S->state, 0);
+  lualua_snapshot(S->state);
+  S->sandbox->pool = lua_touserdata(L, pool);
+  return 1;
+}
+
+static lualua_Pool *lualua_checkpool(lua_State *L, int index) {
+  return luaL_checkudata(L, index, lualua_pool_metatable);
+}
+
+static int lualua_newpool(lua_State *L) {
+  int size = luaL_checkint(L, 1);
+  luaL_argcheck(L, size >= 0, 1, "negative size");
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  }
+  lua_settop(L, 2);
+  lualua_Pool *p = lua_newuserdata(L, sizeof(*p));
+  luaL_getmetatable(L, lualua_pool_metatable);
+  lua_setmetatable(L, -2);
+  p->size = size;
+  p->nidle = 0;
+  p->hits = 0;
+  p->misses = 0;
+  p->resets = 0;
+  p->resettime = 0;
+  lua_createtable(L, size, 1);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "init");
+  lua_setfenv(L, 3);
+  lua_getfenv(L, 3);
+  for (int i = 1; i <= size; ++i) {
+    lualua_newpoolstate(L, 3);
+    ((lualua_State *)lua_touserdata(L, -1))->sandbox->idle = 1;
+    lua_rawseti(L, 4, i);
+    p->nidle = i;
+  }
+  lua_settop(L, 3);
+  return 1;
+}
+
+static int lualua_pool_acquire(lua_State *L) {
+  lualua_Pool *p = lualua_checkpool(L, 1);
+  if (p->nidle == 0) {
+    p->misses++;
+    return lualua_newpoolstate(L, 1);
+  }
+  p->hits++;
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, p->nidle);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, p->nidle--);
+  ((lualua_State *)lua_touserdata(L, -1))->sandbox->idle = 0;
+  return 1;
+}
+
+static int lualua_pool_release(lua_State *L) {
+  lualua_Pool *p = lualua_checkpool(L, 1);
+  lualua_State *S = lualua_checkstate(L, 2);
+  lualua_Sandbox *sb = S->sandbox;
+  luaL_argcheck(L, S->stateowner && sb->pool != NULL, 2, "not a pooled state");
+  luaL_argcheck(L, sb->pool == p, 2, "state of another pool");
+  luaL_argcheck(L, !sb->idle, 2, "state already released");
+  luaL_argcheck(L, sb->depth == 0, 2, "state is running");
+  if (p->nidle < p->size) {
+    double start = lualua_now();
+    luaL_argcheck(L, lualua_reset(S->state), 2, "not a pooled state");
+    S->stackmax = LUA_MINSTACK;
+    sb->budget = -1;
+    sb->granularity = LUALUA_GRANULARITY;
+    /* The next user of the state should not inherit its samples. */
+    if (sb->profile != NULL) {
+      lualua_freeprofile(sb->profile);
+      sb->profile = NULL;
+    }
+    sb->idle = 1;
+    p->resettime += lualua_now() - start;
+    p->resets++;
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, ++p->nidle);
+  }
   return 0;
 }
 
-static int lualua_rawgeti(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int n = luaL_checkint(L, 3);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lualua_checkoverflow(L, S, 1);
-  lua_rawgeti(S->state, index, n);
-  return 0;
+static int lualua_pool_stats(lua_State *L) {
+  lualua_Pool *p = lualua_checkpool(L, 1);
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, p->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, p->nidle);
+  lua_setfield(L, -2, "idle");
+  lua_pushnumber(L, p->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, p->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, p->resets);
+  lua_setfield(L, -2, "resets");
+  lua_pushnumber(L, p->resettime);
+  lua_setfield(L, -2, "resettime");
+  return 1;
 }
 
-static int lualua_rawset(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lualua_checkunderflow(L, S, 2);
-  lua_rawset(S->state, index);
-  return 0;
+static lualua_Future *lualua_checkfuture(lua_State *L, int index) {
+  return luaL_checkudata(L, index, lualua_future_metatable);
 }
 
-static int lualua_rawseti(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int n = luaL_checkint(L, 3);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lualua_checkunderflow(L, S, 1);
-  lua_rawseti(S->state, index, n);
+static int lualua_future_gc(lua_State *L) {
+  lualua_finish(lualua_checkfuture(L, 1));
   return 0;
 }
 
-static int lualua_ref(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_assert(L, S, lua_type(S->state, index) == LUA_TTABLE, "type error");
-  lualua_checkunderflow(L, S, 1);
-  int ref = luaL_ref(S->state, index);
-  lua_pushnumber(L, ref);
+static int lualua_future_join(lua_State *L) {
+  lualua_Future *f = lualua_checkfuture(L, 1);
+  lualua_finish(f);
+  lua_pushinteger(L, f->status);
   return 1;
 }
 
-static int lualua_register(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  const char *name = luaL_checkstring(L, 2);
-  luaL_argcheck(L, lua_isfunction(L, 3), 3, "function expected");
-  lua_settop(L, 3);
-  lualua_dopushcfunction(L, S);
-  lua_setglobal(S->state, name);
-  return 0;
+static int lualua_future_poll(lua_State *L) {
+  lualua_Future *f = lualua_checkfuture(L, 1);
+  if (!f->finished && !lualua_isdone(f)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lualua_finish(f);
+  lua_pushboolean(L, 1);
+  lua_pushinteger(L, f->status);
+  return 2;
 }
 
-static int lualua_remove(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptablestackindex(L, 2, S);
-  lua_remove(S->state, index);
-  return 0;
+/*
+ * Entry points for lualua/ffi.lua, which LuaJIT calls directly on the payload
+ * of a state userdata so that host loops driving a sandbox can be compiled.
+ * FFI calls may neither raise errors nor reenter the host, so these make the
+ * same checks as the corresponding methods but return a status in place of
+ * raising, and while any of them runs host callbacks fail and host refs are
+ * released later.
+ */
+
+enum {
+  LUALUA_FFI_OK,
+  LUALUA_FFI_BUSY,
+  LUALUA_FFI_INVALIDINDEX,
+  LUALUA_FFI_INVALIDSETTOP,
+  LUALUA_FFI_OVERFLOW,
+  LUALUA_FFI_UNDERFLOW,
+  LUALUA_FFI_TYPEERROR,
+};
+
+#define LUALUA_FFI_VERSION 1
+
+/* Must match the cdef in lualua/ffi.lua. */
+typedef struct {
+  int version;
+  int (*gettop)(lualua_State *S, int *top);
+  int (*settop)(lualua_State *S, int index);
+  int (*pushnil)(lualua_State *S);
+  int (*pushboolean)(lualua_State *S, int b);
+  int (*pushnumber)(lualua_State *S, lua_Number n);
+  int (*pushlstring)(lualua_State *S, const char *s, size_t len);
+  int (*toboolean)(lualua_State *S, int index, int *b);
+  int (*tonumber)(lualua_State *S, int index, lua_Number *n);
+  int (*tolstring)(lualua_State *S, int index, const char **s, size_t *len);
+  int (*rawgeti)(lualua_State *S, int index, int n);
+  int (*rawseti)(lualua_State *S, int index, int n);
+  int (*pcall)(lualua_State *S, int nargs, int nresults, int errfunc,
+               int *status);
+} lualua_Ffi;
+
+/* Compare to lualua_assert. */
+static int lualua_ffi_fail(lualua_State *S, int status) {
+  LUALUA_COUNT(S->sandbox, errors, 1);
+  lualua_clearstack(S);
+  return status;
 }
 
-static int lualua_replace(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptablestackindex(L, 2, S);
-  lua_replace(S->state, index);
-  return 0;
+/*
+ * Defines the entry point lualua_ffi_NAME around lualua_ffi_doNAME. Unless
+ * the state is busy on a worker (compare to lualua_checkstate), it keeps
+ * sb->ffi raised throughout, so that host refs released by finalizers run
+ * from sandbox GC steps, which pushing or converting strings may take as
+ * well as pcall, are deferred rather than touching the host.
+ */
+#define LUALUA_FFI_ENTRY(name, params, args) \
+  static int lualua_ffi_##name params {      \
+    if (S->sandbox->future != NULL) {        \
+      return LUALUA_FFI_BUSY;                \
+    }                                        \
+    S->sandbox->ffi++;                       \
+    int result = lualua_ffi_do##name args;   \
+    S->sandbox->ffi--;                       \
+    return result;                           \
+  }
+
+static int lualua_ffi_dogettop(lualua_State *S, int *top) {
+  *top = lua_gettop(S->state);
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_setfenv(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_checkunderflow(L, S, 1);
-  lualua_assert(L, S, lua_type(S->state, -1) == LUA_TTABLE, "type error");
-  int value = lua_setfenv(S->state, index);
-  lua_pushboolean(L, value);
-  return 1;
+static int lualua_ffi_dosettop(lualua_State *S, int index) {
+  if (index != -1 && index != 0 && !lualua_isacceptableindex(S, index)) {
+    return lualua_ffi_fail(S, LUALUA_FFI_INVALIDSETTOP);
+  }
+  lua_settop(S->state, index);
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_dosetfield(lua_State *SS) {
-  const char *k = luaL_checkstring(SS, 2);
-  lua_setfield(SS, 1, k);
-  return 0;
+static int lualua_ffi_checkpush(lualua_State *S) {
+  if (S->stackmax - lua_gettop(S->state) < 1) {
+    return lualua_ffi_fail(S, LUALUA_FFI_OVERFLOW);
+  }
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_setfield(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  const char *k = luaL_checkstring(L, 3);
-  lualua_checkunderflow(L, S, 1);
-  /* TODO do this in more places */
-  if (!lua_checkstack(S->state, 4)) {
-    luaL_error(L, "stack overflow");
+static int lualua_ffi_dopushnil(lualua_State *S) {
+  int status = lualua_ffi_checkpush(S);
+  if (status == LUALUA_FFI_OK) {
+    lua_pushnil(S->state);
   }
-  lua_pushcfunction(S->state, lualua_dosetfield);
-  lua_pushvalue(S->state, index);
-  lua_pushstring(S->state, k);
-  lua_pushvalue(S->state, -4);
-  lualua_safecall(L, S, 3, 0);
-  lua_pop(S->state, 1);
-  return 0;
+  return status;
 }
 
-static int lualua_setglobal(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  const char *k = luaL_checkstring(L, 2);
-  lualua_checkunderflow(L, S, 1);
-  lua_setglobal(S->state, k);
-  return 0;
+static int lualua_ffi_dopushboolean(lualua_State *S, int b) {
+  int status = lualua_ffi_checkpush(S);
+  if (status == LUALUA_FFI_OK) {
+    lua_pushboolean(S->state, b);
+  }
+  return status;
 }
 
-static int lualua_setmetatable(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int type = lua_type(S->state, -1);
-  lualua_assert(L, S, type == LUA_TTABLE || type == LUA_TNIL, "type error");
-  int result = lua_setmetatable(S->state, index);
-  lua_pushboolean(L, result);
-  return 1;
+static int lualua_ffi_dopushnumber(lualua_State *S, lua_Number n) {
+  int status = lualua_ffi_checkpush(S);
+  if (status == LUALUA_FFI_OK) {
+    lua_pushnumber(S->state, n);
+  }
+  return status;
 }
 
-static int lualua_dosettable(lua_State *SS) {
-  lua_settable(SS, 1);
-  return 0;
+static int lualua_ffi_dopushlstring(lualua_State *S, const char *s,
+                                    size_t len) {
+  int status = lualua_ffi_checkpush(S);
+  if (status == LUALUA_FFI_OK) {
+    lualua_pushhoststring(S->sandbox, S->state, s, len);
+  }
+  return status;
 }
 
-static int lualua_settable(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lualua_checkunderflow(L, S, 2);
-  lualua_checkoverflow(L, S, 2);
-  lua_pushvalue(S->state, index);
-  lua_insert(S->state, -3);
-  lua_pushcfunction(S->state, lualua_dosettable);
-  lua_insert(S->state, -4);
-  lualua_safecall(L, S, 3, 0);
-  return 0;
+static int lualua_ffi_checkindex(lualua_State *S, int *index) {
+  if (!lualua_isacceptableindex(S, *index)) {
+    return lualua_ffi_fail(S, LUALUA_FFI_INVALIDINDEX);
+  }
+  *index = lualua_absoluteindex(S, *index);
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_settop(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = luaL_checkint(L, 2);
-  lualua_assert(L, S,
-                index == -1 || index == 0 || lualua_isacceptableindex(S, index),
-                "invalid settop index");
-  lua_settop(S->state, index);
-  return 0;
+static int lualua_ffi_dotoboolean(lualua_State *S, int index, int *b) {
+  int status = lualua_ffi_checkindex(S, &index);
+  if (status == LUALUA_FFI_OK) {
+    *b = lua_toboolean(S->state, index);
+  }
+  return status;
 }
 
-static int lualua_toboolean(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int b = lua_toboolean(S->state, index);
-  lua_pushboolean(L, b);
-  return 1;
+static int lualua_ffi_dotonumber(lualua_State *S, int index, lua_Number *n) {
+  int status = lualua_ffi_checkindex(S, &index);
+  if (status == LUALUA_FFI_OK) {
+    *n = lua_tonumber(S->state, index);
+  }
+  return status;
 }
 
-static int lualua_tonumber(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  lua_Number number = lua_tonumber(S->state, index);
-  lua_pushnumber(L, number);
-  return 1;
+/* Leaves s NULL for values that are neither strings nor numbers. */
+static int lualua_ffi_dotolstring(lualua_State *S, int index, const char **s,
+                                  size_t *len) {
+  int status = lualua_ffi_checkindex(S, &index);
+  if (status == LUALUA_FFI_OK) {
+    *s = lua_tolstring(S->state, index, len);
+    if (*s != NULL) {
+      LUALUA_COUNT(S->sandbox, bytescopied, *len);
+    }
+  }
+  return status;
 }
 
-static int lualua_tostring(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  const char *s = lua_tostring(S->state, index);
-  lua_pushstring(L, s);
-  return 1;
+static int lualua_ffi_dorawgeti(lualua_State *S, int index, int n) {
+  int status = lualua_ffi_checkindex(S, &index);
+  if (status != LUALUA_FFI_OK) {
+    return status;
+  }
+  if (lua_type(S->state, index) != LUA_TTABLE) {
+    return lualua_ffi_fail(S, LUALUA_FFI_TYPEERROR);
+  }
+  if (S->stackmax - lua_gettop(S->state) < 1) {
+    return lualua_ffi_fail(S, LUALUA_FFI_OVERFLOW);
+  }
+  lua_rawgeti(S->state, index, n);
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_touserdata(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  int *ref = lua_touserdata(S->state, index);
-  if (ref == NULL) {
-    lua_pushnil(L);
-  } else {
-    lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
-    lua_rawgeti(L, -1, *ref);
+static int lualua_ffi_dorawseti(lualua_State *S, int index, int n) {
+  int status = lualua_ffi_checkindex(S, &index);
+  if (status != LUALUA_FFI_OK) {
+    return status;
   }
-  return 1;
+  if (lua_type(S->state, index) != LUA_TTABLE) {
+    return lualua_ffi_fail(S, LUALUA_FFI_TYPEERROR);
+  }
+  if (lua_gettop(S->state) < 1) {
+    return lualua_ffi_fail(S, LUALUA_FFI_UNDERFLOW);
+  }
+  lua_rawseti(S->state, index, n);
+  return LUALUA_FFI_OK;
 }
 
-static int lualua_typename(lua_State *L) {
-  lualua_State *S = lualua_checkstate(L, 1);
-  int index = lualua_checkacceptableindex(L, 2, S);
-  const char *s = luaL_typename(S->state, index);
-  lua_pushstring(L, s);
-  return 1;
+static int lualua_ffi_dopcall(lualua_State *S, int nargs, int nresults,
+                              int errfunc, int *status) {
+  if (errfunc != 0 && !lualua_isacceptableindex(S, errfunc)) {
+    return lualua_ffi_fail(S, LUALUA_FFI_INVALIDINDEX);
+  }
+  if (lua_gettop(S->state) < nargs + 1) {
+    return lualua_ffi_fail(S, LUALUA_FFI_UNDERFLOW);
+  }
+  if (S->stackmax - lua_gettop(S->state) < 1) {
+    return lualua_ffi_fail(S, LUALUA_FFI_OVERFLOW);
+  }
+  *status = lualua_protectedcall(S, nargs, nresults, errfunc);
+  return LUALUA_FFI_OK;
 }
 
+LUALUA_FFI_ENTRY(gettop, (lualua_State * S, int *top), (S, top))
+LUALUA_FFI_ENTRY(settop, (lualua_State * S, int index), (S, index))
+LUALUA_FFI_ENTRY(pushnil, (lualua_State * S), (S))
+LUALUA_FFI_ENTRY(pushboolean, (lualua_State * S, int b), (S, b))
+LUALUA_FFI_ENTRY(pushnumber, (lualua_State * S, lua_Number n), (S, n))
+LUALUA_FFI_ENTRY(pushlstring, (lualua_State * S, const char *s, size_t len),
+                 (S, s, len))
+LUALUA_FFI_ENTRY(toboolean, (lualua_State * S, int index, int *b),
+                 (S, index, b))
+LUALUA_FFI_ENTRY(tonumber, (lualua_State * S, int index, lua_Number *n),
+                 (S, index, n))
+LUALUA_FFI_ENTRY(tolstring,
+                 (lualua_State * S, int index, const char **s, size_t *len),
+                 (S, index, s, len))
+LUALUA_FFI_ENTRY(rawgeti, (lualua_State * S, int index, int n), (S, index, n))
+LUALUA_FFI_ENTRY(rawseti, (lualua_State * S, int index, int n), (S, index, n))
+LUALUA_FFI_ENTRY(pcall,
+                 (lualua_State * S, int nargs, int nresults, int errfunc,
+                  int *status),
+                 (S, nargs, nresults, errfunc, status))
+
+static const lualua_Ffi lualua_ffi = {
+    LUALUA_FFI_VERSION,
+    lualua_ffi_gettop,
+    lualua_ffi_settop,
+    lualua_ffi_pushnil,
+    lualua_ffi_pushboolean,
+    lualua_ffi_pushnumber,
+    lualua_ffi_pushlstring,
+    lualua_ffi_toboolean,
+    lualua_ffi_tonumber,
+    lualua_ffi_tolstring,
+    lualua_ffi_rawgeti,
+    lualua_ffi_rawseti,
+    lualua_ffi_pcall,
+};
+
+static const struct luaL_Reg lualua_future_index[] = {
+    {"join", lualua_future_join},
+    {"poll", lualua_future_poll},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg lualua_pool_index[] = {
+    {"acquire", lualua_pool_acquire},
+    {"release", lualua_pool_release},
+    {"stats", lualua_pool_stats},
+    {NULL, NULL},
+};
+
+#ifndef LUALUA_NOSTATS
+static int lualua_resetstats(lua_State *L);
+static int lualua_stats(lua_State *L);
+#endif
+
 static const struct luaL_Reg lualua_state_index[] = {
     {"call", lualua_call},
+    {"callasync", lualua_callasync},
     {"checknumber", lualua_checknumber},
     {"checkstack", lualua_checkstack},
     {"checkstring", lualua_checkstring},
     {"concat", lualua_concat},
     {"createtable", lualua_createtable},
+    {"dump", lualua_dump},
+    {"entries", lualua_entries},
     {"equal", lualua_equal},
     {"error", lualua_error},
+    {"exec", lualua_exec},
+    {"gc", lualua_gc},
+    {"getbudget", lualua_getbudget},
     {"getfenv", lualua_getfenv},
     {"getfield", lualua_getfield},
     {"getglobal", lualua_getglobal},
@@ -853,44 +4822,198 @@ static const struct luaL_Reg lualua_state_index[] = {
     {"isuserdata", lualua_isuserdata},
     {"lessthan", lualua_lessthan},
     {"loadstring", lualua_loadstring},
+    {"memstats", lualua_memstats},
+    {"newbuffer", lualua_newbuffer},
     {"newtable", lualua_newtable},
+    {"newthread", lualua_newthread},
     {"newuserdata", lualua_newuserdata},
     {"next", lualua_next},
     {"objlen", lualua_objlen},
     {"openlibs", lualua_openlibs},
+    {"openlualua", lualua_openlualua},
+    {"pairs", lualua_pairs},
     {"pcall", lualua_pcall},
     {"pop", lualua_pop},
+    {"prepare", lualua_prepare},
+    {"profile_start", lualua_profile_start},
+    {"profile_stop", lualua_profile_stop},
     {"pushboolean", lualua_pushboolean},
     {"pushcfunction", lualua_pushcfunction},
+    {"pushhostfunction", lualua_pushhostfunction},
+    {"pushlstring", lualua_pushlstring},
     {"pushnil", lualua_pushnil},
     {"pushnumber", lualua_pushnumber},
     {"pushstring", lualua_pushstring},
+    {"pushtable", lualua_pushtable},
     {"pushvalue", lualua_pushvalue},
     {"rawequal", lualua_rawequal},
     {"rawget", lualua_rawget},
     {"rawgeti", lualua_rawgeti},
+    {"rawgetrange", lualua_rawgetrange},
     {"rawset", lualua_rawset},
     {"rawseti", lualua_rawseti},
+    {"rawsetrange", lualua_rawsetrange},
+    {"readbuffer", lualua_readbuffer},
     {"ref", lualua_ref},
+    {"refstats", lualua_refstats},
     {"register", lualua_register},
     {"remove", lualua_remove},
     {"replace", lualua_replace},
+#ifndef LUALUA_NOSTATS
+    {"resetstats", lualua_resetstats},
+#endif
+    {"resume", lualua_resume},
+    {"resumeall", lualua_resumeall},
+    {"setbudget", lualua_setbudget},
     {"setfenv", lualua_setfenv},
     {"setfield", lualua_setfield},
     {"setglobal", lualua_setglobal},
     {"setmetatable", lualua_setmetatable},
+    {"setstringcache", lualua_setstringcache},
     {"settable", lualua_settable},
     {"settop", lualua_settop},
+#ifndef LUALUA_NOSTATS
+    {"stats", lualua_stats},
+#endif
+    {"status", lualua_status},
+    {"stringcachestats", lualua_stringcachestats},
     {"toboolean", lualua_toboolean},
+    {"tobuffer", lualua_tobuffer},
+    {"tolstring", lualua_tolstring},
     {"tonumber", lualua_tonumber},
     {"tostring", lualua_tostring},
+    {"totable", lualua_totable},
+    {"tothread", lualua_tothread},
     {"touserdata", lualua_touserdata},
+    {"try", lualua_try},
     {"typename", lualua_typename},
+    {"unref", lualua_unref},
+    {"writebuffer", lualua_writebuffer},
+    {"xmove", lualua_xmove},
     {NULL, NULL},
 };
 
+#ifndef LUALUA_NOSTATS
+/*
+ * While timing is on, state methods are wrapped in closures that time them.
+ * A method that returns has checked that the state at 1 is valid.
+ */
+static int lualua_timecall(lua_State *L) {
+  intptr_t method = (intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+  lualua_State *S = lua_touserdata(L, 1);
+  double start = lualua_now();
+  int n = lualua_state_index[method - 1].func(L);
+  double time = lualua_now() - start;
+  S->sandbox->stats.methods[method - 1].time += time;
+  S->sandbox->hoststats->methods[method - 1].time += time;
+  return n;
+}
+
+/* Fills the table on top of the stack with the state methods. */
+static void lualua_registermethods(lua_State *L, int timing) {
+  for (const luaL_Reg *r = lualua_state_index; r->name != NULL; ++r) {
+    lua_pushlightuserdata(L, (void *)(r - lualua_state_index + 1));
+    lua_pushcclosure(L, timing ? lualua_timecall : r->func, 1);
+    lua_setfield(L, -2, r->name);
+  }
+}
+
+static lualua_Stats *lualua_gethoststats(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_stats_refname);
+  lualua_Stats *st = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return st;
+}
+
+static void lualua_clearstats(lualua_Stats *st) {
+  st->safecalls = 0;
+  st->errors = 0;
+  st->callbacks = 0;
+  st->newuserdata = 0;
+  st->gcuserdata = 0;
+  st->bytescopied = 0;
+  memset(st->methods, 0, st->nmethods * sizeof(*st->methods));
+}
+
+static void lualua_pushstats(lua_State *L, const lualua_Stats *st) {
+  double calls = 0;
+  lua_createtable(L, 0, 8);
+  lua_newtable(L);
+  for (int i = 0; i < st->nmethods; ++i) {
+    const lualua_MethodStats *m = &st->methods[i];
+    if (m->calls == 0) {
+      continue;
+    }
+    calls += m->calls;
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, m->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, m->time);
+    lua_setfield(L, -2, "time");
+    lua_setfield(L, -2, lualua_state_index[i].name);
+  }
+  lua_setfield(L, -2, "methods");
+  lua_pushnumber(L, calls);
+  lua_setfield(L, -2, "calls");
+  lua_pushnumber(L, st->safecalls);
+  lua_setfield(L, -2, "safecalls");
+  lua_pushnumber(L, st->errors);
+  lua_setfield(L, -2, "errors");
+  lua_pushnumber(L, st->callbacks);
+  lua_setfield(L, -2, "callbacks");
+  lua_pushnumber(L, st->newuserdata);
+  lua_setfield(L, -2, "newuserdata");
+  lua_pushnumber(L, st->gcuserdata);
+  lua_setfield(L, -2, "gcuserdata");
+  lua_pushnumber(L, st->bytescopied);
+  lua_setfield(L, -2, "bytescopied");
+}
+
+static int lualua_resetstats(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_clearstats(&S->sandbox->stats);
+  return 0;
+}
+
+static int lualua_stats(lua_State *L) {
+  lualua_State *S = lualua_checkstate(L, 1);
+  lualua_pushstats(L, &S->sandbox->stats);
+  return 1;
+}
+
+static int lualua_allresetstats(lua_State *L) {
+  lualua_clearstats(lualua_gethoststats(L));
+  return 0;
+}
+
+static int lualua_allstats(lua_State *L) {
+  lualua_pushstats(L, lualua_gethoststats(L));
+  return 1;
+}
+
+static int lualua_settiming(lua_State *L) {
+  int timing = lua_toboolean(L, 1);
+  luaL_getmetatable(L, lualua_state_metatable);
+  lua_getfield(L, -1, "__index");
+  lualua_registermethods(L, timing);
+  return 0;
+}
+#endif
+
 static const struct luaL_Reg lualua_index[] = {
+    {"chunkcachestats", lualua_chunkcachestats},
+    {"compile", lualua_compile},
+    {"newpool", lualua_newpool},
     {"newstate", lualua_newstate},
+    {"refstats", lualua_allrefstats},
+#ifndef LUALUA_NOSTATS
+    {"resetstats", lualua_allresetstats},
+#endif
+    {"setchunkcache", lualua_setchunkcache},
+#ifndef LUALUA_NOSTATS
+    {"settiming", lualua_settiming},
+    {"stats", lualua_allstats},
+#endif
     {NULL, NULL},
 };
 
@@ -902,14 +5025,26 @@ typedef struct {
 static const lualua_Constant lualua_constants[] = {
     {"ENVIRONINDEX", LUA_ENVIRONINDEX},
     {"ERRERR", LUA_ERRERR},
+    {"ERRBUDGET", LUALUA_ERRBUDGET},
+    {"ERRDEAD", LUALUA_ERRDEAD},
     {"ERRMEM", LUA_ERRMEM},
     {"ERRRUN", LUA_ERRRUN},
     {"ERRSYNTAX", LUA_ERRSYNTAX},
+    {"GCCOLLECT", LUA_GCCOLLECT},
+    {"GCCOUNT", LUA_GCCOUNT},
+    {"GCCOUNTB", LUA_GCCOUNTB},
+    {"GCRESTART", LUA_GCRESTART},
+    {"GCSETPAUSE", LUA_GCSETPAUSE},
+    {"GCSETSTEPMUL", LUA_GCSETSTEPMUL},
+    {"GCSTEP", LUA_GCSTEP},
+    {"GCSTOP", LUA_GCSTOP},
     {"GLOBALSINDEX", LUA_GLOBALSINDEX},
     {"MAXCSTACK", LUAI_MAXCSTACK},
     {"MAXSTACK", 250}, /* LUAI_MAXSTACK, sometimes. */
     {"MINSTACK", LUA_MINSTACK},
     {"MULTRET", LUA_MULTRET},
+    {"NOREF", LUA_NOREF},
+    {"REFNIL", LUA_REFNIL},
     {"REGISTRYINDEX", LUA_REGISTRYINDEX},
     {"TBOOLEAN", LUA_TBOOLEAN},
     {"TLIGHTUSERDATA", LUA_TLIGHTUSERDATA},
@@ -920,6 +5055,7 @@ static const lualua_Constant lualua_constants[] = {
     {"TTABLE", LUA_TTABLE},
     {"TTHREAD", LUA_TTHREAD},
     {"TUSERDATA", LUA_TUSERDATA},
+    {"YIELD", LUA_YIELD},
 #ifdef LUALUA_IS_ELUNE
     {"ERRORHANDLERINDEX", LUA_ERRORHANDLERINDEX},
 #endif
@@ -927,10 +5063,37 @@ static const lualua_Constant lualua_constants[] = {
 };
 
 int luaopen_lualua(lua_State *L) {
+#ifndef LUALUA_NOSTATS
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_stats_refname);
+  if (lua_isnil(L, -1)) {
+    int n = sizeof(lualua_state_index) / sizeof(*lualua_state_index) - 1;
+    lualua_Stats *st =
+        lua_newuserdata(L, sizeof(*st) + n * sizeof(*st->methods));
+    st->nmethods = n;
+    st->methods = (lualua_MethodStats *)(st + 1);
+    lualua_clearstats(st);
+    lua_setfield(L, LUA_REGISTRYINDEX, lualua_stats_refname);
+  }
+  lua_pop(L, 1);
+#endif
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_owners_refname);
+  if (lua_isnil(L, -1)) {
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, lualua_owners_refname);
+  }
+  lua_pop(L, 1);
   if (luaL_newmetatable(L, lualua_state_metatable)) {
     lua_pushstring(L, "__index");
     lua_newtable(L);
+#ifndef LUALUA_NOSTATS
+    lualua_registermethods(L, 0);
+#else
     luaL_register(L, NULL, lualua_state_index);
+#endif
     lua_settable(L, -3);
     lua_pushstring(L, "__gc");
     lua_pushcfunction(L, lualua_state_gc);
@@ -940,10 +5103,66 @@ int luaopen_lualua(lua_State *L) {
     lua_settable(L, -3);
   }
   lua_pop(L, 1);
-  lua_getfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
+  if (luaL_newmetatable(L, lualua_program_metatable)) {
+    lua_pushstring(L, "__metatable");
+    lua_pushstring(L, lualua_program_metatable);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, lualua_prepared_metatable)) {
+    lua_pushstring(L, "__call");
+    lua_pushcfunction(L, lualua_prepared_call);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__metatable");
+    lua_pushstring(L, lualua_prepared_metatable);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, lualua_pairs_metatable)) {
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, lualua_pairs_gc);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__metatable");
+    lua_pushstring(L, lualua_pairs_metatable);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, lualua_pool_metatable)) {
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    luaL_register(L, NULL, lualua_pool_index);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__metatable");
+    lua_pushstring(L, lualua_pool_metatable);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, lualua_future_metatable)) {
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    luaL_register(L, NULL, lualua_future_index);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, lualua_future_gc);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__metatable");
+    lua_pushstring(L, lualua_future_metatable);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  /* Stops the workers once every host state that loaded us has closed. */
+  lua_getfield(L, LUA_REGISTRYINDEX, lualua_workers_refname);
   if (lua_isnil(L, -1)) {
+    lua_newuserdata(L, 0);
     lua_newtable(L);
-    lua_setfield(L, LUA_REGISTRYINDEX, lualua_host_refname);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, lualua_workers_gc);
+    lua_settable(L, -3);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, lualua_workers_refname);
+    pthread_mutex_lock(&lualua_workers.mutex);
+    lualua_workers.users++;
+    pthread_mutex_unlock(&lualua_workers.mutex);
   }
   lua_pop(L, 1);
   lua_newtable(L);
@@ -959,6 +5178,12 @@ int luaopen_lualua(lua_State *L) {
 #else
   lua_pushboolean(L, 0);
 #endif
+  lua_settable(L, -3);
+  lua_pushstring(L, "ffiapi");
+  lua_pushlightuserdata(L, (void *)&lualua_ffi);
+  lua_settable(L, -3);
+  lua_pushstring(L, "hasallocator");
+  lua_pushboolean(L, lualua_hasallocator());
   lua_settable(L, -3);
   return 1;
 }
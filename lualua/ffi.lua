@@ -0,0 +1,149 @@
+-- LuaJIT FFI bindings for the hottest state methods.
+--
+--   local lf = require('lualua.ffi')
+--   lf.pushnumber(s, 42)
+--
+-- Each function takes a state and the arguments of the method of the same
+-- name, makes the same checks and fails with the same messages, but reaches
+-- lualua.c through the FFI so that LuaJIT can compile the loops calling it.
+-- Sandbox code run by `pcall` cannot call host functions.
+
+local ffi = require('ffi')
+local lualua = require('lualua')
+
+if not lualua.ffiapi then
+  error('lualua.ffi needs the native lualua')
+end
+
+-- Must match lualua_Ffi in lualua.c. States are passed as the userdata itself,
+-- which LuaJIT converts to a pointer to its contents.
+ffi.cdef([[
+typedef struct {
+  int version;
+  int (*gettop)(void *S, int *top);
+  int (*settop)(void *S, int index);
+  int (*pushnil)(void *S);
+  int (*pushboolean)(void *S, int b);
+  int (*pushnumber)(void *S, double n);
+  int (*pushlstring)(void *S, const char *s, size_t len);
+  int (*toboolean)(void *S, int index, int *b);
+  int (*tonumber)(void *S, int index, double *n);
+  int (*tolstring)(void *S, int index, const char **s, size_t *len);
+  int (*rawgeti)(void *S, int index, int n);
+  int (*rawseti)(void *S, int index, int n);
+  int (*pcall)(void *S, int nargs, int nresults, int errfunc, int *status);
+} lualua_Ffi;
+]])
+
+local api = ffi.cast('const lualua_Ffi *', lualua.ffiapi)
+if api.version ~= 1 then
+  error('lualua.ffi does not match the native lualua')
+end
+
+-- Indexed by the LUALUA_FFI_* statuses.
+local messages = {
+  'state is busy',
+  'invalid index',
+  'invalid settop index',
+  'stack overflow',
+  'stack underflow',
+  'type error',
+}
+
+local intbox = ffi.new('int[1]')
+local numberbox = ffi.new('double[1]')
+local stringbox = ffi.new('const char *[1]')
+local lenbox = ffi.new('size_t[1]')
+
+local function check(status)
+  if status ~= 0 then
+    error(messages[status], 0)
+  end
+end
+
+-- Compare to lualua_checkstate. The payload of any other userdata would be
+-- taken for a state, so this check must come first.
+local function checkstate(s)
+  if getmetatable(s) ~= 'lualua state' then
+    error(('bad argument #1 (lualua state expected, got %s)'):format(type(s)), 0)
+  end
+  return s
+end
+
+local function checknumber(n, narg)
+  local k = tonumber(n)
+  if not k then
+    error(('bad argument #%d (number expected, got %s)'):format(narg, type(n)), 0)
+  end
+  return k
+end
+
+local M = {}
+
+function M.gettop(s)
+  check(api.gettop(checkstate(s), intbox))
+  return intbox[0]
+end
+
+function M.settop(s, index)
+  check(api.settop(checkstate(s), checknumber(index, 2)))
+end
+
+function M.pushnil(s)
+  check(api.pushnil(checkstate(s)))
+end
+
+function M.pushboolean(s, b)
+  check(api.pushboolean(checkstate(s), b and 1 or 0))
+end
+
+function M.pushnumber(s, n)
+  check(api.pushnumber(checkstate(s), checknumber(n, 2)))
+end
+
+function M.pushstring(s, str)
+  checkstate(s)
+  if type(str) == 'number' then
+    str = tostring(str)
+  elseif type(str) ~= 'string' then
+    error(('bad argument #2 (string expected, got %s)'):format(type(str)), 0)
+  end
+  check(api.pushlstring(s, str, #str))
+end
+
+function M.toboolean(s, index)
+  check(api.toboolean(checkstate(s), checknumber(index, 2), intbox))
+  return intbox[0] ~= 0
+end
+
+function M.tonumber(s, index)
+  check(api.tonumber(checkstate(s), checknumber(index, 2), numberbox))
+  return numberbox[0]
+end
+
+function M.tostring(s, index)
+  check(api.tolstring(checkstate(s), checknumber(index, 2), stringbox, lenbox))
+  if stringbox[0] == nil then
+    return nil
+  end
+  return ffi.string(stringbox[0], lenbox[0])
+end
+
+function M.rawgeti(s, index, n)
+  check(api.rawgeti(checkstate(s), checknumber(index, 2), checknumber(n, 3)))
+end
+
+function M.rawseti(s, index, n)
+  check(api.rawseti(checkstate(s), checknumber(index, 2), checknumber(n, 3)))
+end
+
+function M.pcall(s, nargs, nresults, errfunc)
+  checkstate(s)
+  nargs = checknumber(nargs, 2)
+  nresults = checknumber(nresults, 3)
+  errfunc = checknumber(errfunc or 0, 4)
+  check(api.pcall(s, nargs, nresults, errfunc, intbox))
+  return intbox[0]
+end
+
+return M
@@ -13,14 +13,108 @@ local function newmetatable(s, tname)
   return true
 end
 
+-- Compare to luaL_typerror.
+local function typeerror(s, index, tname)
+  s:pushstring(('bad argument #%d to \'?\' (%s expected, got %s)'):format(index, tname, s:typename(index)))
+  s:error()
+end
+
+-- Compare to luaL_checkudata.
+local function checkudata(s, index, tname)
+  if s:isuserdata(index) and s:getmetatable(index) then
+    s:getfield(lualua.REGISTRYINDEX, tname)
+    local same = s:equal(-1, -2)
+    s:pop(2)
+    if same then
+      return s:touserdata(index)
+    end
+  end
+  typeerror(s, index, tname)
+end
+
 -- Compare to lualua_checkstate.
 local function checkstate(s, index)
-  assert(s:isuserdata(index))
-  assert(s:getmetatable(index))
+  return checkudata(s, index, 'lualua state').state
+end
+
+-- Compare to luaL_checktype.
+local function checktable(s, index)
+  if not s:istable(index) then
+    typeerror(s, index, 'table')
+  end
+end
+
+local function checkprogram(s, index)
+  return checkudata(s, index, 'lualua program').program
+end
+
+local function pushstate(s, state)
+  local t = s:newuserdata()
+  t.state = state
   s:getfield(lualua.REGISTRYINDEX, 'lualua state')
-  assert(s:equal(-1, -2))
-  s:pop(2)
-  return s:touserdata(index).state
+  s:setmetatable(-2)
+end
+
+local function pack(...)
+  return { n = select('#', ...), ... }
+end
+
+-- Calls a lualua function through pcall, as lualua_spec.lua calls the C
+-- implementation, so that its argument errors read the same.
+local function forward(f, ...)
+  local results = pack(pcall(f, ...))
+  if not results[1] then
+    error(results[2], 0)
+  end
+  return unpack(results, 2, results.n)
+end
+
+-- Compare to lualua_pusharg.
+local function toscalar(s, index)
+  local ty = s:typename(index)
+  if ty == 'boolean' then
+    return s:toboolean(index)
+  elseif ty == 'number' then
+    return s:tonumber(index)
+  elseif ty == 'string' then
+    return s:tostring(index)
+  elseif ty ~= 'nil' and ty ~= 'no value' then
+    s:pushstring(('bad argument #%d (scalar expected, got %s)'):format(index, ty))
+    s:error()
+  end
+end
+
+local function pushscalar(s, v)
+  local ty = type(v)
+  if ty == 'boolean' then
+    s:pushboolean(v)
+  elseif ty == 'number' then
+    s:pushnumber(v)
+  elseif ty == 'string' then
+    s:pushstring(v)
+  else
+    s:pushnil()
+  end
+end
+
+-- Compare to lualua_pushentry, whose refs come back as tables.
+local function pushentry(s, v)
+  if type(v) == 'table' then
+    s:pushtable(v)
+  else
+    pushscalar(s, v)
+  end
+end
+
+local function totable(s, index)
+  local t = {}
+  s:pushnil()
+  while s:next(index) do
+    local k = toscalar(s, -2)
+    t[k] = s:istable(-1) and totable(s, s:gettop()) or toscalar(s, -1)
+    s:pop(1)
+  end
+  return t
 end
 
 local function isacceptableindex(s, index)
@@ -49,15 +143,47 @@ local function register(s, t)
   end
 end
 
-local function dopushcfunction(s, ss)
-  local ref = s:ref(lualua.REGISTRYINDEX) -- TODO unref
-  ss:pushcfunction(function(sss)
+-- Compare to lualua_invokefromhostregistry, which reuses one state per sandbox.
+local wrapperrefs = setmetatable({}, { __mode = 'k' })
+
+local function pushwrapper(s, ss, sss)
+  local ref = wrapperrefs[ss]
+  if ref then
     s:rawgeti(lualua.REGISTRYINDEX, ref)
-    local t = s:newuserdata()
-    t.state = sss
+  else
+    s:newuserdata()
     s:getfield(lualua.REGISTRYINDEX, 'lualua state')
     s:setmetatable(-2)
-    if s:pcall(1, 1, 0) ~= 0 then
+    s:pushvalue(-1)
+    wrapperrefs[ss] = s:ref(lualua.REGISTRYINDEX)
+  end
+  local t = s:touserdata(-1)
+  local state = t.state
+  t.state = sss
+  return function()
+    t.state = state
+  end
+end
+
+-- Returns a value that releases ref in the registry of s when collected.
+local function unrefongc(s, ref)
+  local proxy = newproxy(true)
+  getmetatable(proxy).__gc = function()
+    pcall(s.unref, s, lualua.REGISTRYINDEX, ref)
+  end
+  return proxy
+end
+
+local function dopushcfunction(s, ss)
+  local ref = s:ref(lualua.REGISTRYINDEX)
+  local anchor = unrefongc(s, ref)
+  ss:pushcfunction(function(sss)
+    local _ = anchor
+    s:rawgeti(lualua.REGISTRYINDEX, ref)
+    local restore = pushwrapper(s, ss, sss)
+    local status = s:pcall(1, 1, 0)
+    restore()
+    if status ~= 0 then
       sss:pushstring(s:tostring(-1))
       s:pop(1)
       sss:error()
@@ -69,7 +195,34 @@ local function dopushcfunction(s, ss)
   end)
 end
 
-local stateindex = {
+local function raise(ok, ...)
+  if not ok then
+    error((...), 0)
+  end
+  return ...
+end
+
+-- Compare to lualua_try. Mirrored methods run against a proxy whose methods
+-- go through try, so that errors leave the stack of ss alone.
+local proxies = setmetatable({}, { __mode = 'k' })
+
+local function trying(ss)
+  local proxy = proxies[ss]
+  if not proxy then
+    proxy = setmetatable({}, {
+      __index = function(_, k)
+        return function(_, ...)
+          return raise(ss:try(k, ...))
+        end
+      end,
+    })
+    proxies[ss] = proxy
+  end
+  return proxy
+end
+
+local stateindex
+stateindex = {
   call = function(s)
     local ss = checkstate(s, 1)
     local nargs = s:checknumber(2)
@@ -77,12 +230,34 @@ local stateindex = {
     ss:call(nargs, nresults)
     return 0
   end,
+  callasync = function(s)
+    local ss = checkstate(s, 1)
+    local nargs = s:checknumber(2)
+    local nresults = s:checknumber(3)
+    local t = s:newuserdata()
+    t.future = ss:callasync(nargs, nresults)
+    s:getfield(lualua.REGISTRYINDEX, 'lualua future')
+    s:setmetatable(-2)
+    return 1
+  end,
+  checknumber = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushnumber(forward(ss.checknumber, ss, index))
+    return 1
+  end,
   checkstack = function(s)
     local ss = checkstate(s, 1)
     local n = s:checknumber(2)
     s:pushboolean(ss:checkstack(n))
     return 1
   end,
+  checkstring = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushstring(forward(ss.checkstring, ss, index))
+    return 1
+  end,
   concat = function(s)
     local ss = checkstate(s, 1)
     local n = s:checknumber(2)
@@ -96,6 +271,22 @@ local stateindex = {
     ss:createtable(narr, nrec)
     return 0
   end,
+  dump = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushstring(ss:dump(index))
+    return 1
+  end,
+  entries = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local opts = s:istable(3) and s:totable(3) or nil
+    local keys, values, more = forward(ss.entries, ss, index, opts)
+    s:pushtable(keys)
+    s:pushtable(values)
+    s:pushboolean(more)
+    return 3
+  end,
   equal = function(s)
     local ss = checkstate(s, 1)
     local index1 = checkacceptableindex(s, 2, ss)
@@ -107,6 +298,36 @@ local stateindex = {
     local ss = checkstate(s, 1)
     ss:error()
   end,
+  exec = function(s)
+    local ss = checkstate(s, 1)
+    local program = checkprogram(s, 2)
+    local args = {}
+    for i = 3, s:gettop() do
+      args[i - 2] = toscalar(s, i)
+    end
+    local results = pack(ss:exec(program, unpack(args, 1, s:gettop() - 2)))
+    for i = 1, results.n do
+      pushscalar(s, results[i])
+    end
+    return results.n
+  end,
+  gc = function(s)
+    local ss = checkstate(s, 1)
+    local what = s:checknumber(2)
+    local data = s:isnumber(3) and s:tonumber(3) or 0
+    s:pushnumber(forward(ss.gc, ss, what, data))
+    if what == lualua.GCCOLLECT then
+      -- Host refs released by the collection only let go of values in s once
+      -- the host collects their anchors, too.
+      collectgarbage()
+    end
+    return 1
+  end,
+  getbudget = function(s)
+    local ss = checkstate(s, 1)
+    pushscalar(s, ss:getbudget())
+    return 1
+  end,
   getfenv = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -149,6 +370,12 @@ local stateindex = {
     ss:insert(index)
     return 0
   end,
+  isboolean = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushboolean(ss:isboolean(index))
+    return 1
+  end,
   iscfunction = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -161,12 +388,30 @@ local stateindex = {
     s:pushboolean(ss:isfunction(index))
     return 1
   end,
+  islightuserdata = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushboolean(ss:islightuserdata(index))
+    return 1
+  end,
   isnil = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
     s:pushboolean(ss:isnil(index))
     return 1
   end,
+  isnone = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushboolean(ss:isnone(index))
+    return 1
+  end,
+  isnoneornil = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushboolean(ss:isnoneornil(index))
+    return 1
+  end,
   isnumber = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -185,6 +430,12 @@ local stateindex = {
     s:pushboolean(ss:istable(index))
     return 1
   end,
+  isthread = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    s:pushboolean(ss:isthread(index))
+    return 1
+  end,
   isuserdata = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -201,21 +452,38 @@ local stateindex = {
   loadstring = function(s)
     local ss = checkstate(s, 1)
     local str = s:checkstring(2)
-    s:pushnumber(ss:loadstring(str))
+    local chunkname = s:isstring(3) and s:tostring(3) or nil
+    s:pushnumber(ss:loadstring(str, chunkname))
+    return 1
+  end,
+  memstats = function(s)
+    local ss = checkstate(s, 1)
+    s:pushtable(ss:memstats())
     return 1
   end,
+  newbuffer = function(s)
+    local ss = checkstate(s, 1)
+    forward(ss.newbuffer, ss, s:checknumber(2))
+    return 0
+  end,
   newtable = function(s)
     local ss = checkstate(s, 1)
     ss:newtable()
     return 0
   end,
+  newthread = function(s)
+    local ss = checkstate(s, 1)
+    pushstate(s, ss:newthread())
+    return 1
+  end,
   newuserdata = function(s)
     local ss = checkstate(s, 1)
     s:newtable()
     s:pushvalue(-1)
-    local ref = s:ref(lualua.REGISTRYINDEX) -- TODO unref
+    local ref = s:ref(lualua.REGISTRYINDEX)
     local t = ss:newuserdata()
     t.ref = ref
+    t.anchor = unrefongc(s, ref)
     return 1
   end,
   next = function(s)
@@ -235,6 +503,27 @@ local stateindex = {
     ss:openlibs()
     return 0
   end,
+  openlualua = function(s)
+    local ss = checkstate(s, 1)
+    ss:openlualua()
+    return 0
+  end,
+  pairs = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local opts = s:istable(3) and s:totable(3) or nil
+    local iter = forward(ss.pairs, ss, index, opts)
+    s:pushcfunction(function(s)
+      local k, v = iter()
+      if k == nil then
+        return 0
+      end
+      pushentry(s, k)
+      pushentry(s, v)
+      return 2
+    end)
+    return 1
+  end,
   pcall = function(s)
     local ss = checkstate(s, 1)
     local nargs = s:checknumber(2)
@@ -244,7 +533,8 @@ local stateindex = {
       ss:pushstring('invalid index')
       ss:error()
     end
-    s:pushnumber(ss:pcall(nargs, nresults, errfunc))
+    local opts = s:istable(5) and totable(s, 5) or nil
+    s:pushnumber(ss:pcall(nargs, nresults, errfunc, opts))
     return 1
   end,
   pop = function(s)
@@ -253,6 +543,35 @@ local stateindex = {
     ss:pop(n)
     return 0
   end,
+  prepare = function(s)
+    local ss = checkstate(s, 1)
+    local ref = s:checknumber(2)
+    local nresults = s:isnoneornil(3) and lualua.MULTRET or s:checknumber(3)
+    local opts = s:istable(4) and s:totable(4) or nil
+    local f = forward(ss.prepare, ss, ref, nresults, opts)
+    s:pushcfunction(function(s)
+      local args = {}
+      for i = 1, s:gettop() do
+        args[i] = toscalar(s, i)
+      end
+      local results = pack(f(unpack(args, 1, s:gettop())))
+      for i = 1, results.n do
+        pushentry(s, results[i])
+      end
+      return results.n
+    end)
+    return 1
+  end,
+  profile_start = function(s)
+    local ss = checkstate(s, 1)
+    forward(ss.profile_start, ss, s:istable(2) and totable(s, 2) or nil)
+    return 0
+  end,
+  profile_stop = function(s)
+    local ss = checkstate(s, 1)
+    s:pushstring(ss:profile_stop())
+    return 1
+  end,
   pushboolean = function(s)
     local ss = checkstate(s, 1)
     local b = s:toboolean(2)
@@ -266,6 +585,45 @@ local stateindex = {
     dopushcfunction(s, ss)
     return 0
   end,
+  pushhostfunction = function(s)
+    local ss = checkstate(s, 1)
+    assert(s:isfunction(2))
+    local opts = s:istable(3) and s:totable(3) or nil
+    s:settop(2)
+    local ref = s:ref(lualua.REGISTRYINDEX)
+    local anchor = unrefongc(s, ref)
+    -- The host function runs in place of the one in s, which works on the
+    -- stack of s just like the marshalling of lualua_marshal does.
+    forward(ss.pushhostfunction, ss, function(...)
+      local _ = anchor
+      local args = pack(...)
+      local top = s:gettop()
+      s:rawgeti(lualua.REGISTRYINDEX, ref)
+      for i = 1, args.n do
+        pushentry(s, args[i])
+      end
+      if s:pcall(args.n, lualua.MULTRET, 0) ~= 0 then
+        local msg = s:tostring(-1)
+        s:settop(top)
+        error(msg, 0)
+      end
+      local results = {}
+      for i = top + 1, s:gettop() do
+        results[i - top] = s:istable(i) and s:totable(i) or toscalar(s, i)
+      end
+      local n = s:gettop() - top
+      s:settop(top)
+      return unpack(results, 1, n)
+    end, opts)
+    return 0
+  end,
+  pushlstring = function(s)
+    local ss = checkstate(s, 1)
+    local str = s:checkstring(2)
+    local len = s:checknumber(3)
+    forward(ss.pushlstring, ss, str, len)
+    return 0
+  end,
   pushnil = function(s)
     local ss = checkstate(s, 1)
     ss:pushnil()
@@ -283,6 +641,13 @@ local stateindex = {
     ss:pushstring(str)
     return 0
   end,
+  pushtable = function(s)
+    local ss = checkstate(s, 1)
+    checktable(s, 2)
+    local opts = s:istable(3) and s:totable(3) or nil
+    ss:pushtable(s:totable(2), opts)
+    return 0
+  end,
   pushvalue = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -309,6 +674,14 @@ local stateindex = {
     ss:rawgeti(index, n)
     return 0
   end,
+  rawgetrange = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local i = s:isnoneornil(3) and 1 or s:checknumber(3)
+    local j = not s:isnoneornil(4) and s:checknumber(4) or nil
+    s:pushtable(forward(ss.rawgetrange, ss, index, i, j))
+    return 1
+  end,
   rawset = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -322,12 +695,39 @@ local stateindex = {
     ss:rawseti(index, n)
     return 0
   end,
+  rawsetrange = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local i = s:checknumber(3)
+    checktable(s, 4)
+    forward(ss.rawsetrange, ss, index, i, s:totable(4))
+    return 0
+  end,
+  readbuffer = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local kind = s:checkstring(3)
+    local offset = s:checknumber(4)
+    local len = s:isnumber(5) and s:tonumber(5) or nil
+    local v = forward(ss.readbuffer, ss, index, kind, offset, len)
+    if type(v) == 'string' then
+      s:pushstring(v)
+    else
+      s:pushnumber(v)
+    end
+    return 1
+  end,
   ref = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
     s:pushnumber(ss:ref(index))
     return 1
   end,
+  refstats = function(s)
+    local ss = checkstate(s, 1)
+    s:pushtable(ss:refstats())
+    return 1
+  end,
   register = function(s)
     local ss = checkstate(s, 1)
     local name = s:checkstring(2)
@@ -348,6 +748,35 @@ local stateindex = {
     ss:replace(index)
     return 0
   end,
+  resetstats = function(s)
+    checkstate(s, 1):resetstats()
+    return 0
+  end,
+  resume = function(s)
+    local ss = checkstate(s, 1)
+    local narg = s:checknumber(2)
+    s:pushnumber(ss:resume(narg))
+    return 1
+  end,
+  resumeall = function(s)
+    local ss = checkstate(s, 1)
+    local threads = {}
+    for i = 1, s:objlen(2) do
+      s:rawgeti(2, i)
+      threads[i] = checkstate(s, s:gettop())
+      s:pop(1)
+    end
+    local opts = s:istable(3) and totable(s, 3) or nil
+    s:pushtable(ss:resumeall(threads, opts))
+    return 1
+  end,
+  setbudget = function(s)
+    local ss = checkstate(s, 1)
+    local budget = s:isnumber(2) and s:tonumber(2) or nil
+    local granularity = s:isnumber(3) and s:tonumber(3) or nil
+    forward(ss.setbudget, ss, budget, granularity)
+    return 0
+  end,
   setfenv = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -373,6 +802,11 @@ local stateindex = {
     s:pushboolean(ss:setmetatable(index))
     return 1
   end,
+  setstringcache = function(s)
+    local ss = checkstate(s, 1)
+    forward(ss.setstringcache, ss, s:checknumber(2))
+    return 0
+  end,
   settable = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -385,12 +819,38 @@ local stateindex = {
     ss:settop(n)
     return 0
   end,
+  stats = function(s)
+    s:pushtable(checkstate(s, 1):stats())
+    return 1
+  end,
+  status = function(s)
+    local ss = checkstate(s, 1)
+    s:pushnumber(ss:status())
+    return 1
+  end,
+  stringcachestats = function(s)
+    local ss = checkstate(s, 1)
+    s:pushtable(ss:stringcachestats())
+    return 1
+  end,
   toboolean = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
     s:pushboolean(ss:toboolean(index))
     return 1
   end,
+  tolstring = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local str, len = ss:tolstring(index)
+    if str then
+      s:pushstring(str)
+      s:pushnumber(len)
+      return 2
+    end
+    s:pushnil()
+    return 1
+  end,
   tonumber = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -409,6 +869,24 @@ local stateindex = {
     end
     return 1
   end,
+  totable = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local opts = s:istable(3) and s:totable(3) or nil
+    s:pushtable(ss:totable(index, opts))
+    return 1
+  end,
+  tothread = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local thread = ss:tothread(index)
+    if thread then
+      pushstate(s, thread)
+    else
+      s:pushnil()
+    end
+    return 1
+  end,
   touserdata = function(s)
     local ss = checkstate(s, 1)
     local index = checkacceptableindex(s, 2, ss)
@@ -426,21 +904,181 @@ local stateindex = {
     s:pushstring(ss:typename(index))
     return 1
   end,
+  unref = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    ss:unref(index, s:checknumber(3))
+    return 0
+  end,
+  -- tobuffer is not mirrored, since pointers cannot be pushed into a sandbox.
+  try = function(s)
+    local t = checkudata(s, 1, 'lualua state')
+    local f = stateindex[s:checkstring(2)]
+    if not f then
+      s:pushstring('bad argument #2 to \'?\' (unknown method)')
+      s:error()
+    end
+    s:remove(2)
+    local ss = t.state
+    local top = ss:gettop()
+    t.state = trying(ss)
+    local results = pack(pcall(f, s))
+    t.state = ss
+    if not results[1] then
+      if ss:gettop() > top then
+        ss:settop(top)
+      end
+      s:pushboolean(false)
+      s:pushstring(results[2])
+      return 2
+    end
+    s:pushboolean(true)
+    s:insert(-results[2] - 1)
+    return results[2] + 1
+  end,
+  writebuffer = function(s)
+    local ss = checkstate(s, 1)
+    local index = checkacceptableindex(s, 2, ss)
+    local kind = s:checkstring(3)
+    local offset = s:checknumber(4)
+    local v = kind == 'string' and s:checkstring(5) or s:checknumber(5)
+    forward(ss.writebuffer, ss, index, kind, offset, v)
+    return 0
+  end,
+  xmove = function(s)
+    local ss = checkstate(s, 1)
+    local to = checkstate(s, 2)
+    local n = s:checknumber(3)
+    ss:xmove(to, n)
+    return 0
+  end,
 }
 
 local libindex = {
-  newstate = function(s)
+  chunkcachestats = function(s)
+    s:pushtable(lualua.chunkcachestats())
+    return 1
+  end,
+  compile = function(s)
+    checktable(s, 1)
     local t = s:newuserdata()
-    t.state = lualua.newstate()
-    s:getfield(lualua.REGISTRYINDEX, 'lualua state')
+    t.program = lualua.compile(totable(s, 1))
+    s:getfield(lualua.REGISTRYINDEX, 'lualua program')
     s:setmetatable(-2)
     return 1
   end,
+  newpool = function(s)
+    local size = s:checknumber(1)
+    local t = s:newuserdata()
+    local init
+    if s:isfunction(2) then
+      -- t.s is the state of whichever call is creating pooled states.
+      s:pushvalue(2)
+      local ref = s:ref(lualua.REGISTRYINDEX)
+      init = function(state)
+        t.s:rawgeti(lualua.REGISTRYINDEX, ref)
+        pushstate(t.s, state)
+        t.s:call(1, 0)
+      end
+    end
+    t.s = s
+    t.pool = forward(lualua.newpool, size, init)
+    -- lualua hands out the same userdata for a pooled state every time.
+    s:newtable()
+    s:newtable()
+    s:pushstring('__mode')
+    s:pushstring('v')
+    s:settable(-3)
+    s:setmetatable(-2)
+    t.states = s:ref(lualua.REGISTRYINDEX)
+    t.anchor = unrefongc(s, t.states)
+    s:getfield(lualua.REGISTRYINDEX, 'lualua pool')
+    s:setmetatable(-2)
+    return 1
+  end,
+  newstate = function(s)
+    pushstate(s, forward(lualua.newstate, s:istable(1) and totable(s, 1) or nil))
+    return 1
+  end,
+  refstats = function(s)
+    -- Let go of states and refs that s no longer uses, and leave out the refs
+    -- held by this module's own objects in s.
+    collectgarbage()
+    local t, own = lualua.refstats(), s:refstats()
+    t.callbacks = t.callbacks - own.callbacks
+    t.userdata = t.userdata - own.userdata
+    s:pushtable(t)
+    return 1
+  end,
+  resetstats = function()
+    lualua.resetstats()
+    return 0
+  end,
+  settiming = function(s)
+    lualua.settiming(s:toboolean(1))
+    return 0
+  end,
+  stats = function(s)
+    s:pushtable(lualua.stats())
+    return 1
+  end,
+}
+
+-- Builds with LUALUA_NOSTATS leave the counters out.
+if not lualua.stats then
+  stateindex.resetstats, stateindex.stats = nil, nil
+  libindex.resetstats, libindex.settiming, libindex.stats = nil, nil, nil
+end
+
+local futureindex = {
+  join = function(s)
+    s:pushnumber(checkudata(s, 1, 'lualua future').future:join())
+    return 1
+  end,
+  poll = function(s)
+    local done, status = checkudata(s, 1, 'lualua future').future:poll()
+    s:pushboolean(done)
+    if not done then
+      return 1
+    end
+    s:pushnumber(status)
+    return 2
+  end,
+}
+
+local poolindex = {
+  acquire = function(s)
+    local t = checkudata(s, 1, 'lualua pool')
+    t.s = s
+    local state = t.pool:acquire()
+    local key = tostring(state)
+    s:rawgeti(lualua.REGISTRYINDEX, t.states)
+    s:pushstring(key)
+    s:rawget(-2)
+    if s:isnil(-1) then
+      s:pop(1)
+      pushstate(s, state)
+      s:pushstring(key)
+      s:pushvalue(-2)
+      s:rawset(-4)
+    end
+    s:remove(-2)
+    return 1
+  end,
+  release = function(s)
+    local pool = checkudata(s, 1, 'lualua pool').pool
+    forward(pool.release, pool, checkstate(s, 2))
+    return 0
+  end,
+  stats = function(s)
+    s:pushtable(checkudata(s, 1, 'lualua pool').pool:stats())
+    return 1
+  end,
 }
 
 local constants = {}
 for k, v in pairs(lualua) do
-  if type(v) == 'number' then
+  if type(v) == 'number' or type(v) == 'boolean' then
     constants[k] = v
   end
 end
@@ -456,11 +1094,37 @@ local function load(s)
     s:settable(-3)
   end
   s:pop(1)
+  if newmetatable(s, 'lualua program') then
+    s:pushstring('__metatable')
+    s:pushstring('lualua program')
+    s:settable(-3)
+  end
+  s:pop(1)
+  if newmetatable(s, 'lualua future') then
+    s:pushstring('__index')
+    s:newtable()
+    register(s, futureindex)
+    s:settable(-3)
+    s:pushstring('__metatable')
+    s:pushstring('lualua future')
+    s:settable(-3)
+  end
+  s:pop(1)
+  if newmetatable(s, 'lualua pool') then
+    s:pushstring('__index')
+    s:newtable()
+    register(s, poolindex)
+    s:settable(-3)
+    s:pushstring('__metatable')
+    s:pushstring('lualua pool')
+    s:settable(-3)
+  end
+  s:pop(1)
   s:newtable()
   register(s, libindex)
   for k, v in pairs(constants) do
     s:pushstring(k)
-    s:pushnumber(v)
+    pushscalar(s, v)
     s:settable(-3)
   end
   return 1
@@ -1,46 +1,1080 @@
+-- Benchmarks for lualua.
+--
+--   lua perf.lua [options] [pattern ...]
+--   lua perf.lua --compare old.json new.json [--threshold percent]
+--
+-- Each benchmark runs `--warmup` times unmeasured, then `--repeats` times on a
+-- fresh state, and reports the median and percentiles of the time per
+-- operation in nanoseconds. Patterns select benchmarks by name. `--scale`
+-- multiplies every iteration count, and `--json` writes the results to a file
+-- that `--compare` can diff against another run. `--compare` exits with a
+-- nonzero status when a benchmark got slower by more than `--threshold`
+-- percent (default 5) beyond the spread of either run.
+
 local lib = require('lualua')
-local n = arg[1] or 1000000
-
-local checks = {
-  ['lua call'] = function()
-    local function f() end
-    for _ = 1, n do
-      f()
-    end
-  end,
-  ['lua pcall'] = function()
-    local function f() end
-    for _ = 1, n do
-      pcall(f)
-    end
-  end,
-  ['lualua call'] = function()
+
+local clock, clockname = os.clock, 'os.clock'
+do
+  local ok, socket = pcall(require, 'socket')
+  if ok and socket.gettime then
+    clock, clockname = socket.gettime, 'socket.gettime'
+  end
+end
+
+local benchmarks = {}
+
+-- Registers a benchmark. `setup` returns the context passed to `run`, which
+-- performs `n` operations.
+local function bench(name, n, setup, run)
+  table.insert(benchmarks, { name = name, n = n, setup = setup, run = run })
+end
+
+-- Registers a benchmark of a single state method. `prepare` readies a fresh
+-- state and returns an optional value passed on to `op`, which must leave the
+-- stack as it found it.
+local function method(name, n, prepare, op)
+  bench('state:' .. name, n, function()
     local s = lib.newstate()
-    s:loadstring('return')
-    for _ = 1, n do
-      s:pushvalue(-1)
-      s:call(0, 0)
+    assert(s[name:match('^[%w_]+')], 'no such method ' .. name)
+    return { s, prepare and prepare(s) }
+  end, function(ctx, k)
+    local s, x = ctx[1], ctx[2]
+    for _ = 1, k do
+      op(s, x)
     end
-  end,
-  ['lualua pcall'] = function()
+  end)
+end
+
+local N = 100000
+
+local function pushnumber(s)
+  s:pushnumber(42)
+end
+
+local function pushstring(s)
+  s:pushstring('foo')
+end
+
+local function pushtwo(s)
+  s:pushnumber(1)
+  s:pushnumber(2)
+end
+
+local function newtable(s)
+  s:newtable()
+end
+
+local function newbuffer(s)
+  s:newbuffer(64)
+end
+
+local function loadempty(s)
+  s:loadstring('return')
+end
+
+-- Returns a thread that yields forever; the state keeps it alive.
+local function yielder(s)
+  local t = s:newthread()
+  s:pop(1)
+  t:loadstring('while true do coroutine.yield() end')
+  return t
+end
+
+-- Baselines for the cost of the benchmark loop itself.
+
+bench('lua call', N * 10, function() end, function(_, k)
+  local function f() end
+  for _ = 1, k do
+    f()
+  end
+end)
+
+bench('lua pcall', N * 10, function() end, function(_, k)
+  local function f() end
+  for _ = 1, k do
+    pcall(f)
+  end
+end)
+
+-- State methods, in the order of lualua_state_index.
+
+method('call', N, loadempty, function(s)
+  s:pushvalue(-1)
+  s:call(0, 0)
+end)
+method('callasync', N / 100, loadempty, function(s)
+  s:pushvalue(-1)
+  s:callasync(0, 0):join()
+end)
+method('checknumber', N, pushnumber, function(s)
+  s:checknumber(1)
+end)
+method('checkstack', N, nil, function(s)
+  s:checkstack(10)
+end)
+method('checkstring', N, pushstring, function(s)
+  s:checkstring(1)
+end)
+method('concat', N, nil, function(s)
+  s:pushstring('foo')
+  s:pushnumber(42)
+  s:concat(2)
+  s:pop(1)
+end)
+method('createtable', N, nil, function(s)
+  s:createtable(4, 4)
+  s:pop(1)
+end)
+method('dump', N / 10, function(s)
+  s:loadstring('local a, b = ...; return a + b')
+end, function(s)
+  s:dump(1)
+end)
+method('entries', N, function(s)
+  s:pushtable({ 1, 2, 3 })
+end, function(s)
+  s:pushnil()
+  s:entries(1)
+end)
+method('equal', N, pushtwo, function(s)
+  s:equal(1, 2)
+end)
+method('error', N, nil, function(s)
+  s:pushstring('moo')
+  pcall(s.error, s)
+end)
+do
+  local program = lib.compile({ { 'pushvalue', -1 }, { 'call', 0, 0 } })
+  method('exec', N, loadempty, function(s)
+    s:exec(program)
+  end)
+end
+method('gc', N, nil, function(s)
+  s:gc(lib.GCCOUNT, 0)
+end)
+method('getbudget', N, nil, function(s)
+  s:getbudget()
+end)
+method('getfenv', N, loadempty, function(s)
+  s:getfenv(1)
+  s:pop(1)
+end)
+method('getfield', N, newtable, function(s)
+  s:getfield(1, 'foo')
+  s:pop(1)
+end)
+method('getglobal', N, nil, function(s)
+  s:getglobal('foo')
+  s:pop(1)
+end)
+method('getmetatable', N, newtable, function(s)
+  s:getmetatable(1)
+end)
+method('gettable', N, newtable, function(s)
+  s:pushstring('foo')
+  s:gettable(1)
+  s:pop(1)
+end)
+method('gettop', N, nil, function(s)
+  s:gettop()
+end)
+method('insert', N, pushtwo, function(s)
+  s:insert(1)
+end)
+for _, name in ipairs({
+  'isboolean',
+  'iscfunction',
+  'isfunction',
+  'islightuserdata',
+  'isnil',
+  'isnone',
+  'isnoneornil',
+  'isnumber',
+  'isstring',
+  'istable',
+  'isthread',
+  'isuserdata',
+}) do
+  method(name, N, pushnumber, function(s)
+    s[name](s, 1)
+  end)
+end
+method('lessthan', N, pushtwo, function(s)
+  s:lessthan(1, 2)
+end)
+method('loadstring', N / 10, nil, function(s)
+  s:loadstring('local a, b = ...; return a + b')
+  s:pop(1)
+end)
+method('memstats', N, nil, function(s)
+  s:memstats()
+end)
+method('newbuffer', N, nil, function(s)
+  s:newbuffer(64)
+  s:pop(1)
+end)
+method('newtable', N, nil, function(s)
+  s:newtable()
+  s:pop(1)
+end)
+method('newthread', N / 10, nil, function(s)
+  s:newthread()
+  s:pop(1)
+end)
+method('newuserdata', N, nil, function(s)
+  s:newuserdata()
+  s:pop(1)
+end)
+method('next', N, function(s)
+  s:pushtable({ 1, 2, 3 })
+end, function(s)
+  s:pushnil()
+  s:next(1)
+  s:pop(2)
+end)
+method('objlen', N, pushstring, function(s)
+  s:objlen(1)
+end)
+method('openlibs', N / 100, nil, function(s)
+  s:openlibs()
+end)
+method('openlualua', N / 100, nil, function(s)
+  s:openlualua()
+  s:pop(1)
+end)
+method('pcall', N, loadempty, function(s)
+  s:pushvalue(-1)
+  s:pcall(0, 0, 0)
+end)
+method('pop', N, nil, function(s)
+  s:pushnil()
+  s:pop(1)
+end)
+method('profile_start+profile_stop', N / 10, nil, function(s)
+  s:profile_start()
+  s:profile_stop()
+end)
+method('pushboolean', N, nil, function(s)
+  s:pushboolean(true)
+  s:pop(1)
+end)
+do
+  local function f()
+    return 0
+  end
+  method('pushcfunction', N, nil, function(s)
+    s:pushcfunction(f)
+    s:pop(1)
+  end)
+end
+method('pushlstring', N, nil, function(s)
+  s:pushlstring('foobar', 3)
+  s:pop(1)
+end)
+method('pushnil', N, nil, function(s)
+  s:pushnil()
+  s:pop(1)
+end)
+method('pushnumber', N, nil, function(s)
+  s:pushnumber(42)
+  s:pop(1)
+end)
+method('pushstring', N, nil, function(s)
+  s:pushstring('foo')
+  s:pop(1)
+end)
+do
+  local t = { 1, 2, 3, foo = 'bar' }
+  method('pushtable', N, nil, function(s)
+    s:pushtable(t)
+    s:pop(1)
+  end)
+end
+method('pushvalue', N, pushnumber, function(s)
+  s:pushvalue(1)
+  s:pop(1)
+end)
+method('rawequal', N, pushtwo, function(s)
+  s:rawequal(1, 2)
+end)
+method('rawget', N, newtable, function(s)
+  s:pushnumber(1)
+  s:rawget(1)
+  s:pop(1)
+end)
+method('rawgeti', N, newtable, function(s)
+  s:rawgeti(1, 1)
+  s:pop(1)
+end)
+method('rawset', N, newtable, function(s)
+  s:pushnumber(1)
+  s:pushnumber(2)
+  s:rawset(1)
+end)
+method('rawseti', N, newtable, function(s)
+  s:pushnumber(2)
+  s:rawseti(1, 1)
+end)
+method('readbuffer', N, newbuffer, function(s)
+  s:readbuffer(1, 'u32', 0)
+end)
+method('ref+unref', N, nil, function(s)
+  s:pushnumber(42)
+  s:unref(lib.REGISTRYINDEX, s:ref(lib.REGISTRYINDEX))
+end)
+method('refstats', N, nil, function(s)
+  s:refstats()
+end)
+do
+  local function f()
+    return 0
+  end
+  method('register', N, nil, function(s)
+    s:register('foo', f)
+  end)
+end
+method('remove', N, nil, function(s)
+  s:pushnil()
+  s:remove(-1)
+end)
+method('replace', N, pushnumber, function(s)
+  s:pushnil()
+  s:replace(1)
+end)
+-- Absent from builds with LUALUA_NOSTATS.
+if lib.resetstats then
+  method('resetstats', N, nil, function(s)
+    s:resetstats()
+  end)
+end
+method('resume', N, function(s)
+  s:openlibs()
+  return yielder(s)
+end, function(_, t)
+  t:resume(0)
+end)
+method('resumeall', N / 100, function(s)
+  s:openlibs()
+  local threads = {}
+  for i = 1, 100 do
+    threads[i] = yielder(s)
+  end
+  return threads
+end, function(s, threads)
+  s:resumeall(threads)
+end)
+method('setbudget', N, nil, function(s)
+  s:setbudget(1e9)
+end)
+method('setfenv', N, loadempty, function(s)
+  s:newtable()
+  s:setfenv(1)
+end)
+method('setfield', N, newtable, function(s)
+  s:pushnil()
+  s:setfield(1, 'OnEvent')
+end)
+method('setglobal', N, nil, function(s)
+  s:pushnil()
+  s:setglobal('OnEvent')
+end)
+method('setmetatable', N, newtable, function(s)
+  s:newtable()
+  s:setmetatable(1)
+end)
+method('setstringcache', N, nil, function(s)
+  s:setstringcache(16)
+end)
+method('settable', N, newtable, function(s)
+  s:pushstring('OnEvent')
+  s:pushnil()
+  s:settable(1)
+end)
+method('settop', N, nil, function(s)
+  s:settop(1)
+  s:settop(0)
+end)
+if lib.stats then
+  method('stats', N, nil, function(s)
+    s:stats()
+  end)
+end
+method('status', N, nil, function(s)
+  s:status()
+end)
+method('stringcachestats', N, nil, function(s)
+  s:stringcachestats()
+end)
+method('toboolean', N, pushnumber, function(s)
+  s:toboolean(1)
+end)
+method('tobuffer', N, newbuffer, function(s)
+  s:tobuffer(1)
+end)
+method('tolstring', N, pushstring, function(s)
+  s:tolstring(1)
+end)
+method('tonumber', N, pushnumber, function(s)
+  s:tonumber(1)
+end)
+method('tostring', N, pushstring, function(s)
+  s:tostring(1)
+end)
+method('totable', N, function(s)
+  s:pushtable({ 1, 2, 3, foo = 'bar' })
+end, function(s)
+  s:totable(1)
+end)
+method('tothread', N / 10, function(s)
+  s:newthread()
+end, function(s)
+  s:tothread(1)
+end)
+method('touserdata', N, function(s)
+  s:newuserdata({})
+end, function(s)
+  s:touserdata(1)
+end)
+method('try', N, pushnumber, function(s)
+  s:pushnumber(1)
+  s:try('gettable', 1)
+end)
+method('typename', N, pushnumber, function(s)
+  s:typename(1)
+end)
+method('writebuffer', N, newbuffer, function(s)
+  s:writebuffer(1, 'u32', 0, 42)
+end)
+method('xmove', N, function(s)
+  return s:newthread()
+end, function(s, t)
+  s:pushnil()
+  s:xmove(t, 1)
+  t:pop(1)
+end)
+
+-- String cache, for comparison with the uncached setfield and setglobal.
+
+method('setfield with string cache', N, function(s)
+  s:setstringcache(256)
+  s:newtable()
+end, function(s)
+  s:pushnil()
+  s:setfield(1, 'OnEvent')
+end)
+method('setglobal with string cache', N, function(s)
+  s:setstringcache(256)
+end, function(s)
+  s:pushnil()
+  s:setglobal('OnEvent')
+end)
+
+-- A failed probe under a host pcall, which empties the stack, for comparison
+-- with try.
+
+method('gettable failing under pcall', N, pushnumber, function(s)
+  s:pushnumber(1)
+  if not pcall(s.gettable, s, 1) then
+    s:pushnumber(42)
+  end
+end)
+
+-- Callbacks into the host, timed from a loop in the sandbox.
+
+local function callback(name, chunk, f, push)
+  bench('callback ' .. name, N, function()
     local s = lib.newstate()
-    s:loadstring('return')
-    for _ = 1, n do
-      s:pushvalue(-1)
-      s:pcall(0, 0, 0)
+    s:openlibs()
+    s[push or 'pushcfunction'](s, f)
+    s:loadstring(chunk)
+    s:insert(-2)
+    return s
+  end, function(s, k)
+    s:pushvalue(-2)
+    s:pushvalue(-2)
+    s:pushnumber(k)
+    s:call(2, 0)
+  end)
+end
+
+callback('without arguments', 'local f, n = ...; for _ = 1, n do f() end', function()
+  return 0
+end)
+callback('with arguments', 'local f, n = ...; for i = 1, n do f(i, "foo", true) end', function(ss)
+  ss:pushnumber(ss:tonumber(1) + 1)
+  return 1
+end)
+callback('with arguments, marshalled', 'local f, n = ...; for i = 1, n do f(i, "foo", true) end', function(i)
+  return i + 1
+end, 'pushhostfunction')
+callback('via pcall', 'local f, n = ...; for _ = 1, n do pcall(f) end', function()
+  return 0
+end)
+bench('callback from exec', N, function()
+  local s = lib.newstate()
+  s:pushcfunction(function()
+    return 0
+  end)
+  return { s, lib.compile({ { 'pushvalue', -1 }, { 'call', 0, 0 } }) }
+end, function(ctx, k)
+  local s, program = ctx[1], ctx[2]
+  for _ = 1, k do
+    s:exec(program)
+  end
+end)
+
+-- Event handler dispatch from the host: a sandbox function in a registry ref
+-- taking two arguments and returning one result.
+
+local function handler(s)
+  s:loadstring('local event, n = ... return n + 1')
+  return s:ref(lib.REGISTRYINDEX)
+end
+
+bench('dispatch via methods', N, function()
+  local s = lib.newstate()
+  return { s, handler(s) }
+end, function(ctx, k)
+  local s, ref = ctx[1], ctx[2]
+  for i = 1, k do
+    s:rawgeti(lib.REGISTRYINDEX, ref)
+    s:pushstring('EVENT')
+    s:pushnumber(i)
+    s:call(2, 1)
+    s:tonumber(-1)
+    s:pop(1)
+  end
+end)
+bench('dispatch via exec', N, function()
+  local s = lib.newstate()
+  local program = lib.compile({
+    { 'rawgeti', lib.REGISTRYINDEX, handler(s) },
+    { 'pusharg', 1 },
+    { 'pusharg', 2 },
+    { 'call', 2, 1 },
+    { 'tonumber', -1 },
+    { 'pop', 1 },
+  })
+  return { s, program }
+end, function(ctx, k)
+  local s, program = ctx[1], ctx[2]
+  for i = 1, k do
+    s:exec(program, 'EVENT', i)
+  end
+end)
+bench('dispatch via prepare', N, function()
+  local s = lib.newstate()
+  return s:prepare(handler(s), 1)
+end, function(f, k)
+  for i = 1, k do
+    f('EVENT', i)
+  end
+end)
+
+-- Sandbox code on its own, on worker threads and under budgets.
+
+local loop = 'local n = ...; for _ = 1, n do end'
+
+bench('sandbox loop', N * 100, function()
+  local s = lib.newstate()
+  s:loadstring(loop)
+  return s
+end, function(s, k)
+  s:pushnumber(k)
+  s:call(1, 0)
+end)
+bench('sandbox loop with budget', N * 100, function()
+  local s = lib.newstate()
+  s:setbudget(1e15)
+  s:loadstring(loop)
+  return s
+end, function(s, k)
+  s:pushnumber(k)
+  s:call(1, 0)
+end)
+bench('sandbox loops on 8 workers', N * 100, function()
+  local states = {}
+  for i = 1, 8 do
+    states[i] = lib.newstate()
+    states[i]:loadstring(loop)
+  end
+  return states
+end, function(states, k)
+  local futures = {}
+  for i, s in ipairs(states) do
+    s:pushnumber(k / 8)
+    futures[i] = s:callasync(1, 0)
+  end
+  for _, f in ipairs(futures) do
+    f:join()
+  end
+end)
+
+-- Startup.
+
+bench('newstate', N / 100, function() end, function(_, k)
+  for _ = 1, k do
+    lib.newstate()
+  end
+  collectgarbage()
+end)
+bench('newstate+openlibs', N / 100, function() end, function(_, k)
+  for _ = 1, k do
+    lib.newstate():openlibs()
+  end
+  collectgarbage()
+end)
+bench('pool acquire+release', N / 10, function()
+  return lib.newpool(1, function(s)
+    s:openlibs()
+  end)
+end, function(p, k)
+  for _ = 1, k do
+    p:release(p:acquire())
+  end
+end)
+
+-- Userdata churn.
+
+bench('userdata churn', N, function()
+  return lib.newstate()
+end, function(s, k)
+  for i = 1, k do
+    s:newuserdata()
+    s:pop(1)
+    if i % 1000 == 0 then
+      s:gc(lib.GCSTEP, 0)
     end
-  end,
-  ['lualua stack twiddle'] = function()
+  end
+  s:gc(lib.GCCOLLECT, 0)
+end)
+bench('userdata churn with metatables', N, function()
+  local s = lib.newstate()
+  s:newtable()
+  return s
+end, function(s, k)
+  for i = 1, k do
+    s:newuserdata({})
+    s:pushvalue(1)
+    s:setmetatable(-2)
+    s:pop(1)
+    if i % 1000 == 0 then
+      s:gc(lib.GCSTEP, 0)
+    end
+  end
+  s:gc(lib.GCCOLLECT, 0)
+end)
+bench('gc with 100k userdata', 10, function()
+  local s = lib.newstate()
+  s:newtable()
+  s:newtable()
+  for i = 1, 100000 do
+    s:newuserdata()
+    s:pushvalue(2)
+    s:setmetatable(-2)
+    s:rawseti(1, i)
+  end
+  return s
+end, function(s, k)
+  for _ = 1, k do
+    s:gc(lib.GCCOLLECT, 0)
+  end
+end)
+
+-- Table marshalling.
+
+local function range(n)
+  local t = {}
+  for i = 1, n do
+    t[i] = i
+  end
+  return t
+end
+
+local function marshal(name, n, t)
+  bench('pushtable ' .. name, n, lib.newstate, function(s, k)
+    for _ = 1, k do
+      s:pushtable(t)
+      s:pop(1)
+    end
+  end)
+  bench('totable ' .. name, n, function()
     local s = lib.newstate()
-    for _ = 1, n do
-      s:pushnil()
+    s:pushtable(t)
+    return s
+  end, function(s, k)
+    for _ = 1, k do
+      s:totable(1)
+    end
+  end)
+end
+
+marshal('1000 numbers', N / 100, range(1000))
+marshal('record', N, { name = 'foo', x = 1, y = 2, visible = true })
+marshal('nested records', N / 100, {
+  a = { b = { c = { 1, 2, 3 } } },
+  list = { { id = 1 }, { id = 2 }, { id = 3 } },
+  name = 'foo',
+})
+bench('rawseti 1000 numbers', N / 100, lib.newstate, function(s, k)
+  for _ = 1, k do
+    s:createtable(1000, 0)
+    for i = 1, 1000 do
+      s:pushnumber(i)
+      s:rawseti(-2, i)
+    end
+    s:pop(1)
+  end
+end)
+bench('rawgeti 1000 numbers', N / 100, function()
+  local s = lib.newstate()
+  s:pushtable(range(1000))
+  return s
+end, function(s, k)
+  for _ = 1, k do
+    local t = {}
+    for i = 1, 1000 do
+      s:rawgeti(1, i)
+      t[i] = s:tonumber(-1)
       s:pop(1)
     end
-  end,
-}
+  end
+end)
+bench('rawsetrange 1000 numbers', N / 100, function()
+  return { lib.newstate(), range(1000) }
+end, function(ctx, k)
+  local s, t = ctx[1], ctx[2]
+  for _ = 1, k do
+    s:createtable(1000, 0)
+    s:rawsetrange(-1, 1, t)
+    s:pop(1)
+  end
+end)
+bench('rawgetrange 1000 numbers', N / 100, function()
+  local s = lib.newstate()
+  s:pushtable(range(1000))
+  return s
+end, function(s, k)
+  for _ = 1, k do
+    s:rawgetrange(1)
+  end
+end)
+bench('next 1000 numbers', N / 100, function()
+  local s = lib.newstate()
+  s:pushtable(range(1000))
+  return s
+end, function(s, k)
+  for _ = 1, k do
+    local t = {}
+    s:pushnil()
+    while s:next(1) do
+      t[s:tonumber(-2)] = s:tonumber(-1)
+      s:pop(1)
+    end
+  end
+end)
+bench('pairs 1000 numbers', N / 100, function()
+  local s = lib.newstate()
+  s:pushtable(range(1000))
+  return s
+end, function(s, k)
+  for _ = 1, k do
+    local t = {}
+    for i, v in s:pairs(1) do
+      t[i] = v
+    end
+  end
+end)
+
+-- The LuaJIT FFI bindings, against the methods they stand in for.
+
+bench('pushnumber+tonumber+settop', N, lib.newstate, function(s, k)
+  for i = 1, k do
+    s:pushnumber(i)
+    s:tonumber(-1)
+    s:settop(0)
+  end
+end)
+local hasffi, lf = pcall(require, 'lualua.ffi')
+if hasffi then
+  bench('ffi pushnumber+tonumber+settop', N, lib.newstate, function(s, k)
+    for i = 1, k do
+      lf.pushnumber(s, i)
+      lf.tonumber(s, -1)
+      lf.settop(s, 0)
+    end
+  end)
+  bench('ffi rawseti 1000 numbers', N / 100, lib.newstate, function(s, k)
+    for _ = 1, k do
+      s:createtable(1000, 0)
+      for i = 1, 1000 do
+        lf.pushnumber(s, i)
+        lf.rawseti(s, -2, i)
+      end
+      s:pop(1)
+    end
+  end)
+end
+
+-- Statistics.
+
+local function percentile(sorted, p)
+  local i = p / 100 * (#sorted - 1) + 1
+  local lo = math.floor(i)
+  local hi = math.min(lo + 1, #sorted)
+  return sorted[lo] + (sorted[hi] - sorted[lo]) * (i - lo)
+end
+
+local function summarize(samples)
+  local sorted = {}
+  local sum = 0
+  for i, v in ipairs(samples) do
+    sorted[i] = v
+    sum = sum + v
+  end
+  table.sort(sorted)
+  return {
+    mean = sum / #sorted,
+    min = sorted[1],
+    p10 = percentile(sorted, 10),
+    median = percentile(sorted, 50),
+    p90 = percentile(sorted, 90),
+    max = sorted[#sorted],
+    samples = samples,
+  }
+end
+
+local function measure(b, n, warmup, repeats)
+  local samples = {}
+  for i = 1, warmup + repeats do
+    local ctx = b.setup()
+    collectgarbage()
+    local t = clock()
+    b.run(ctx, n)
+    t = clock() - t
+    if i > warmup then
+      table.insert(samples, t / n * 1e9)
+    end
+  end
+  return summarize(samples)
+end
+
+-- JSON, limited to what this file writes.
+
+local function encode(v, indent)
+  indent = indent or ''
+  local t = type(v)
+  if t == 'number' then
+    return v == math.floor(v) and ('%d'):format(v) or ('%.17g'):format(v)
+  elseif t == 'string' then
+    return ('%q'):format(v):gsub('\\\n', '\\n')
+  elseif t == 'boolean' then
+    return tostring(v)
+  end
+  local inner = indent .. '  '
+  local parts = {}
+  if #v > 0 then
+    for i, x in ipairs(v) do
+      parts[i] = encode(x, inner)
+    end
+    return '[' .. table.concat(parts, ', ') .. ']'
+  end
+  local keys = {}
+  for k in pairs(v) do
+    table.insert(keys, k)
+  end
+  table.sort(keys)
+  for i, k in ipairs(keys) do
+    parts[i] = inner .. encode(k) .. ': ' .. encode(v[k], inner)
+  end
+  return '{\n' .. table.concat(parts, ',\n') .. '\n' .. indent .. '}'
+end
+
+local function decode(str)
+  local pos = 1
+  local value
+  local function skip()
+    pos = str:find('%S', pos) or #str + 1
+  end
+  local function fail()
+    error(('invalid JSON at byte %d'):format(pos), 0)
+  end
+  local function list(close, item)
+    local t = {}
+    pos = pos + 1
+    skip()
+    if str:sub(pos, pos) == close then
+      pos = pos + 1
+      return t
+    end
+    while true do
+      item(t)
+      skip()
+      local c = str:sub(pos, pos)
+      pos = pos + 1
+      if c == close then
+        return t
+      elseif c ~= ',' then
+        fail()
+      end
+      skip()
+    end
+  end
+  function value()
+    skip()
+    local c = str:sub(pos, pos)
+    if c == '{' then
+      return list('}', function(t)
+        local k = value()
+        skip()
+        if type(k) ~= 'string' or str:sub(pos, pos) ~= ':' then
+          fail()
+        end
+        pos = pos + 1
+        t[k] = value()
+      end)
+    elseif c == '[' then
+      return list(']', function(t)
+        table.insert(t, value())
+      end)
+    elseif c == '"' then
+      local s, e = str:find('^"[^"\\]*"', pos)
+      if not s then
+        s, e = str:find('^".-[^\\]"', pos)
+      end
+      if not s then
+        fail()
+      end
+      pos = e + 1
+      return (str:sub(s + 1, e - 1):gsub('\\(.)', { n = '\n', t = '\t' }))
+    end
+    for word, v in pairs({ ['true'] = true, ['false'] = false }) do
+      if str:sub(pos, pos + #word - 1) == word then
+        pos = pos + #word
+        return v
+      end
+    end
+    local s, e = str:find('^-?[%d.]+[eE]?[-+]?%d*', pos)
+    if not s then
+      fail()
+    end
+    pos = e + 1
+    return tonumber(str:sub(s, e))
+  end
+  local v = value()
+  skip()
+  if pos <= #str then
+    fail()
+  end
+  return v
+end
 
-for k, v in require('pl.tablex').sort(checks) do
-  local t = os.clock()
-  v()
-  print(('%s: %.4f'):format(k, os.clock() - t))
+local function readfile(name)
+  local f = assert(io.open(name))
+  local s = f:read('*a')
+  f:close()
+  return s
 end
+
+-- Command line.
+
+local function runtime()
+  if jit then
+    return jit.version
+  end
+  return lib.iselune and 'Elune' or _VERSION
+end
+
+local function compare(old, new, threshold)
+  local a, b = decode(readfile(old)), decode(readfile(new))
+  print(('%s (%s) vs %s (%s), median ns per op'):format(old, a.runtime, new, b.runtime))
+  print(('%-40s %12s %12s %9s'):format('', 'old', 'new', 'change'))
+  local names, missing = {}, {}
+  for name in pairs(b.benchmarks) do
+    table.insert(a.benchmarks[name] and names or missing, name)
+  end
+  table.sort(names)
+  local regressions = 0
+  for _, name in ipairs(names) do
+    local x, y = a.benchmarks[name], b.benchmarks[name]
+    local delta = x.median > 0 and (y.median - x.median) / x.median * 100 or 0
+    local mark = ''
+    if delta > threshold and y.p10 > x.p90 then
+      mark = '  slower'
+      regressions = regressions + 1
+    elseif delta < -threshold and y.p90 < x.p10 then
+      mark = '  faster'
+    end
+    print(('%-40s %12.1f %12.1f %+8.1f%%%s'):format(name, x.median, y.median, delta, mark))
+  end
+  if #missing > 0 then
+    print(('%d benchmarks only in %s'):format(#missing, new))
+  end
+  print(('%d of %d benchmarks slower'):format(regressions, #names))
+  return regressions == 0
+end
+
+local function main(args)
+  local opts = { repeats = 10, warmup = 2, scale = 1, threshold = 5 }
+  local patterns = {}
+  local i = 1
+  while i <= #args do
+    local a = args[i]
+    local key = a:match('^%-%-(.+)')
+    if key == 'compare' then
+      opts.compare = { args[i + 1], args[i + 2] }
+      i = i + 2
+    elseif key == 'json' then
+      opts.json = args[i + 1]
+      i = i + 1
+    elseif key and opts[key] then
+      opts[key] = tonumber(args[i + 1]) or error('bad value for ' .. a, 0)
+      i = i + 1
+    elseif key then
+      error('unknown option ' .. a, 0)
+    else
+      table.insert(patterns, a)
+    end
+    i = i + 1
+  end
+
+  if opts.compare then
+    local old, new = opts.compare[1], opts.compare[2]
+    if not old or not new then
+      error('--compare takes two files', 0)
+    end
+    return compare(old, new, opts.threshold)
+  end
+
+  local results = {
+    runtime = runtime(),
+    clock = clockname,
+    repeats = opts.repeats,
+    warmup = opts.warmup,
+    scale = opts.scale,
+    benchmarks = {},
+  }
+  print(('%s, %s, %d repeats, ns per op'):format(results.runtime, clockname, opts.repeats))
+  print(('%-40s %12s %12s %12s'):format('', 'median', 'p10', 'p90'))
+  for _, b in ipairs(benchmarks) do
+    local selected = #patterns == 0
+    for _, p in ipairs(patterns) do
+      selected = selected or b.name:find(p) ~= nil
+    end
+    if selected then
+      local n = math.max(1, math.floor(b.n * opts.scale))
+      local r = measure(b, n, opts.warmup, opts.repeats)
+      r.iterations = n
+      results.benchmarks[b.name] = r
+      print(('%-40s %12.1f %12.1f %12.1f'):format(b.name, r.median, r.p10, r.p90))
+    end
+  end
+  if opts.json then
+    local f = assert(io.open(opts.json, 'w'))
+    f:write(encode(results), '\n')
+    f:close()
+  end
+  return true
+end
+
+os.exit(main(arg) and 0 or 1)
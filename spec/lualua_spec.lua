@@ -30,7 +30,21 @@ describe('lualua', function()
       assert.Not.Nil(lib.newstate)
       for k, v in pairs(lib) do
         assert.same('string', type(k))
-        assert.same(k == 'newstate' and 'function' or k == 'iselune' and 'boolean' or 'number', type(v))
+        local functions = {
+          chunkcachestats = true,
+          compile = true,
+          newpool = true,
+          newstate = true,
+          refstats = true,
+          resetstats = true,
+          setchunkcache = true,
+          settiming = true,
+          stats = true,
+        }
+        local booleans = { hasallocator = true, iselune = true }
+        local userdata = { ffiapi = true }
+        local expected = functions[k] and 'function' or booleans[k] and 'boolean' or userdata[k] and 'userdata'
+        assert.same(expected or 'number', type(v))
       end
     end)
 
@@ -66,8 +80,327 @@ describe('lualua', function()
       assert.Not.same(s1, s3)
       assert.Not.same(s2, s3)
     end)
+    it('supports each allocator', function()
+      for _, allocator in ipairs({ 'default', 'pool', 'arena' }) do
+        if lib.hasallocator or allocator == 'default' then
+          local s = nr(1, lib.newstate({ allocator = allocator }))
+          s:openlibs()
+          s:loadstring('local t = {} for i = 1, 1000 do t[i] = ("x"):rep(i) end return #table.concat(t)')
+          s:call(0, 1)
+          assert.same(500500, s:tonumber(-1))
+        end
+      end
+    end)
+    it('enforces memlimit while sandbox code runs', function()
+      if lib.hasallocator then
+        for _, allocator in ipairs({ 'default', 'pool', 'arena' }) do
+          local s = lib.newstate({ allocator = allocator, memlimit = 1048576 })
+          s:openlibs()
+          local code = 'local t = {} for i = 1, 1e6 do t[i] = ("x"):rep(100) .. i end'
+          s:loadstring(code)
+          assert.same(lib.ERRMEM, s:pcall(0, 0, 0))
+          assert.same('not enough memory', s:tostring(-1))
+          s:settop(0)
+          s:loadstring(code)
+          assertFails('not enough memory', docall(s, 0, 0))
+        end
+      else
+        assertFails('custom allocators are not supported', lib.newstate, { memlimit = 1048576 })
+      end
+    end)
+    it('rejects bad options', function()
+      assertFails('(invalid option \'moo\')', lib.newstate, { allocator = 'moo' })
+      assertFails('bad argument #1 to \'?\' (negative memlimit)', lib.newstate, { memlimit = -1 })
+    end)
+  end)
+
+  describe('compile', function()
+    it('creates program userdata', function()
+      local p = nr(1, lib.compile({ { 'pushnil' }, { 'pop', 1 } }))
+      assert.same('userdata', type(p))
+      assert.same('lualua program', getmetatable(p))
+    end)
+    it('works with an empty program', function()
+      assert.same('userdata', type(lib.compile({})))
+    end)
+    it('requires a table', function()
+      assertFails('bad argument #1 to \'?\' (table expected, got no value)', lib.compile)
+    end)
+    it('fails on unknown ops', function()
+      assertFails('bad op #2 (unknown op)', lib.compile, { { 'pushnil' }, { 'frobnicate' } })
+    end)
+    it('fails on bad operands', function()
+      assertFails('bad op #1 (number expected)', lib.compile, { { 'pushnumber', 'moo' } })
+      assertFails('bad op #1 (string expected)', lib.compile, { { 'getglobal' } })
+      assertFails('bad op #1 (negative count)', lib.compile, { { 'pop', -1 } })
+      assertFails('bad op #1 (invalid index)', lib.compile, { { 'pushvalue', 0 } })
+      assertFails('bad op #1 (invalid index)', lib.compile, { { 'insert', lib.GLOBALSINDEX } })
+      assertFails('bad op #1 (settop requires a negative index)', lib.compile, { { 'settop', 0 } })
+    end)
   end)
 
+  describe('newpool', function()
+    local function init(s)
+      s:newtable()
+      s:setglobal('t')
+      s:pushnumber(42)
+      s:setglobal('x')
+    end
+    it('creates pool userdata', function()
+      local p = nr(1, lib.newpool(2, init))
+      assert.same('userdata', type(p))
+      assert.same('lualua pool', getmetatable(p))
+    end)
+    it('pre-creates initialized states', function()
+      local p = lib.newpool(2, init)
+      assert.same({ size = 2, idle = 2, hits = 0, misses = 0, resets = 0, resettime = 0 }, p:stats())
+      local s = nr(1, p:acquire())
+      assert.same('lualua state', getmetatable(s))
+      assert.same(0, s:gettop())
+      s:getglobal('x')
+      assert.same(42, s:tonumber(-1))
+    end)
+    it('restores globals on release', function()
+      local p = lib.newpool(1, init)
+      local s = p:acquire()
+      s:getglobal('t')
+      s:pushnumber(1)
+      s:setfield(-2, 'moo')
+      s:pushnil()
+      s:setglobal('x')
+      s:pushboolean(true)
+      s:setglobal('y')
+      s:newtable()
+      s:setmetatable(lib.GLOBALSINDEX)
+      nr(0, p:release(s))
+      assert.same(s, p:acquire())
+      assert.same(0, s:gettop())
+      s:getglobal('x')
+      s:getglobal('y')
+      s:getglobal('t')
+      s:getfield(-1, 'moo')
+      assert.same(42, s:tonumber(1))
+      assert.True(s:isnil(2))
+      assert.True(s:isnil(4))
+      assert.False(s:getmetatable(lib.GLOBALSINDEX))
+    end)
+    it('counts hits, misses, and resets', function()
+      local p = lib.newpool(1)
+      local s1 = p:acquire()
+      local s2 = p:acquire()
+      p:release(s1)
+      p:release(s2)
+      local stats = p:stats()
+      assert.same(1, stats.hits)
+      assert.same(1, stats.misses)
+      assert.same(1, stats.resets)
+      assert.same(1, stats.idle)
+      assert.same('number', type(stats.resettime))
+    end)
+    it('rejects states from outside a pool', function()
+      local p = lib.newpool(1)
+      p:acquire()
+      assertFails('bad argument #2 to \'?\' (not a pooled state)', p.release, p, lib.newstate())
+      assertFails('bad argument #2 to \'?\' (state of another pool)', p.release, p, lib.newpool(1):acquire())
+    end)
+    it('rejects releasing a state twice', function()
+      local p = lib.newpool(2)
+      local s = p:acquire()
+      p:release(s)
+      assertFails('bad argument #2 to \'?\' (state already released)', p.release, p, s)
+      assert.same(2, p:stats().idle)
+      assert.same(s, p:acquire())
+      assert.Not.same(s, p:acquire())
+    end)
+    it('stops the profiler on release', function()
+      local p = lib.newpool(1)
+      local s = p:acquire()
+      s:profile_start()
+      p:release(s)
+      assert.same(s, p:acquire())
+      assertFails('profiler not running', s.profile_stop, s)
+    end)
+    it('requires a size', function()
+      assertFails('bad argument #1 to \'?\' (number expected, got no value)', lib.newpool)
+      assertFails('bad argument #1 to \'?\' (negative size)', lib.newpool, -1)
+    end)
+  end)
+
+  describe('refstats', function()
+    it('counts host refs across states', function()
+      collectgarbage()
+      collectgarbage()
+      local before = nr(1, lib.refstats())
+      local s = lib.newstate()
+      s:pushcfunction(function() end)
+      s:newuserdata()
+      s:newuserdata()
+      local during = lib.refstats()
+      assert.same(before.states + 1, during.states)
+      assert.same(before.callbacks + 1, during.callbacks)
+      assert.same(before.userdata + 2, during.userdata)
+      s:settop(0)
+      s:gc(lib.GCCOLLECT, 0)
+      assert.same(before.callbacks, lib.refstats().callbacks)
+      assert.same(before.userdata, lib.refstats().userdata)
+      s:newuserdata()
+      s = nil
+      collectgarbage()
+      collectgarbage()
+      assert.same(before, lib.refstats())
+    end)
+  end)
+
+  describe('stats', function()
+    it('counts method calls across states', function()
+      if not lib.stats then
+        return -- Built with LUALUA_NOSTATS.
+      end
+      local s1, s2 = lib.newstate(), lib.newstate()
+      lib.resetstats()
+      s1:pushnumber(1)
+      s2:pushnumber(2)
+      s2:pushstring('foo')
+      local t = nr(1, lib.stats())
+      assert.same({ calls = 2, time = 0 }, t.methods.pushnumber)
+      assert.same(1, t.methods.pushstring.calls)
+      assert.same(3, s2:stats().bytescopied)
+      nr(0, lib.resetstats())
+      assert.Nil(lib.stats().methods.pushnumber)
+      assert.same(1, s1:stats().methods.pushnumber.calls)
+    end)
+    it('times methods on request', function()
+      if not lib.stats then
+        return
+      end
+      local s = lib.newstate()
+      nr(0, lib.settiming(true))
+      s:pushnil()
+      lib.settiming(false)
+      s:pushnil()
+      local m = s:stats().methods.pushnil
+      assert.same(2, m.calls)
+      assert.True(m.time > 0)
+    end)
+  end)
+
+  -- Sandboxes share the process-wide cache, so nested lualua leaves setchunkcache out.
+  if lib.setchunkcache then
+    describe('setchunkcache', function()
+      after_each(function()
+        lib.setchunkcache()
+      end)
+      it('is disabled by default', function()
+        local s = lib.newstate()
+        s:loadstring('return 42')
+        assert.same({ maxbytes = 0, bytes = 0, entries = 0, hits = 0, misses = 0 }, nr(1, lib.chunkcachestats()))
+      end)
+      it('caches compiled chunks', function()
+        nr(0, lib.setchunkcache(1048576))
+        local s1 = lib.newstate()
+        assert.same(0, s1:loadstring('return ...'))
+        local stats = lib.chunkcachestats()
+        assert.same(1, stats.entries)
+        assert.same(0, stats.hits)
+        assert.same(1, stats.misses)
+        local s2 = lib.newstate()
+        assert.same(0, s2:loadstring('return ...'))
+        s2:pushnumber(42)
+        s2:call(1, 1)
+        assert.same(42, s2:tonumber(-1))
+        assert.same(1, lib.chunkcachestats().hits)
+        s2:loadstring('return ...', 'other')
+        assert.same(2, lib.chunkcachestats().entries)
+      end)
+      it('does not cache failures', function()
+        lib.setchunkcache(1048576)
+        local s = lib.newstate()
+        assert.same(lib.ERRSYNTAX, s:loadstring('return return'))
+        assert.same(0, lib.chunkcachestats().entries)
+      end)
+      it('respects the size limit', function()
+        lib.setchunkcache(1)
+        local s = lib.newstate()
+        s:loadstring('return 42')
+        assert.same(0, lib.chunkcachestats().entries)
+      end)
+      it('rejects negative sizes', function()
+        assertFails('bad argument #1 to \'?\' (negative size)', lib.setchunkcache, -1)
+      end)
+    end)
+  end
+
+  -- Only under LuaJIT.
+  local hasffi, lf = pcall(require, 'lualua.ffi')
+  if hasffi then
+    describe('ffi', function()
+      it('pushes and reads scalars', function()
+        local s = lib.newstate()
+        lf.pushnumber(s, 42)
+        lf.pushstring(s, 'foo')
+        lf.pushboolean(s, true)
+        lf.pushnil(s)
+        assert.same(4, lf.gettop(s))
+        assert.same(42, lf.tonumber(s, 1))
+        assert.same('foo', lf.tostring(s, 2))
+        assert.same('42', lf.tostring(s, 1))
+        assert.same(true, lf.toboolean(s, 3))
+        assert.same(nil, lf.tostring(s, 4))
+        lf.settop(s, 1)
+        assert.same(1, s:gettop())
+      end)
+      it('gets and sets table entries', function()
+        local s = lib.newstate()
+        s:newtable()
+        lf.pushstring(s, 'foo')
+        lf.rawseti(s, 1, 42)
+        lf.rawgeti(s, 1, 42)
+        assert.same('foo', s:tostring(-1))
+        assert.same(2, lf.gettop(s))
+      end)
+      it('fails like the methods', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('type error', lf.rawgeti, s, 1, 1)
+        assert.same(0, s:gettop())
+        assertFails('invalid index', lf.tonumber, s, -1)
+        assertFails('invalid settop index', lf.settop, s, -2)
+        assertFails('stack underflow', lf.pcall, s, 0, 0)
+        for _ = 1, lib.MINSTACK do
+          lf.pushnil(s)
+        end
+        assertFails('stack overflow', lf.pushnil, s)
+        assertFails('bad argument #1 (lualua state expected, got table)', lf.gettop, {})
+      end)
+      it('defers host refs released by sandbox collections', function()
+        local s = lib.newstate()
+        local weak = setmetatable({ s:newuserdata() }, { __mode = 'v' })
+        s:settop(0)
+        for i = 1, 100000 do
+          lf.pushstring(s, 'garbage' .. i)
+          lf.settop(s, 0)
+        end
+        collectgarbage()
+        assert.Not.Nil(weak[1])
+        s:gettop()
+        collectgarbage()
+        assert.Nil(weak[1])
+      end)
+      it('calls without host callbacks', function()
+        local s = lib.newstate()
+        s:loadstring('return ... * 2')
+        lf.pushnumber(s, 21)
+        assert.same(0, lf.pcall(s, 1, 1))
+        assert.same(42, s:tonumber(-1))
+        s:pushcfunction(function()
+          return 0
+        end)
+        assert.same(lib.ERRRUN, lf.pcall(s, 0, 0))
+        assert.same('host callbacks are not available in ffi calls', s:tostring(-1))
+      end)
+    end)
+  end
+
   describe('state api', function()
     describe('call', function()
       it('fails on empty stack', function()
@@ -99,6 +432,106 @@ describe('lualua', function()
       end)
     end)
 
+    describe('callasync', function()
+      it('returns a future for the call', function()
+        local s = lib.newstate()
+        s:loadstring('local a, b = ...; return a + b')
+        s:pushnumber(1)
+        s:pushnumber(2)
+        local f = nr(1, s:callasync(2, 1))
+        assert.same('lualua future', getmetatable(f))
+        assert.same(0, nr(1, f:join()))
+        assert.same(1, s:gettop())
+        assert.same(3, s:tonumber(1))
+        assert.same(0, f:join())
+      end)
+      it('can be polled', function()
+        local s = lib.newstate()
+        s:loadstring('for i = 1, 100000 do end')
+        local f = s:callasync(0, 0)
+        local done, status
+        repeat
+          done, status = f:poll()
+        until done
+        assert.same(0, status)
+        assert.same(0, s:gettop())
+      end)
+      it('locks the state until joined', function()
+        local s = lib.newstate()
+        s:loadstring('for i = 1, 100000 do end')
+        local f = s:callasync(0, 0)
+        assertFails('state is busy', s.gettop, s)
+        assertFails('state is busy', s.callasync, s, 0, 0)
+        f:join()
+        assert.same(0, s:gettop())
+      end)
+      it('reports errors like pcall', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:loadstring('error("moo")')
+        assert.same(lib.ERRRUN, s:callasync(0, 0):join())
+        assert.same('moo', s:tostring(-1):sub(-3))
+      end)
+      it('rejects host callbacks', function()
+        local s = lib.newstate()
+        s:loadstring('local f = ...; f()')
+        s:pushcfunction(function()
+          return 0
+        end)
+        assert.same(lib.ERRRUN, s:callasync(1, 0):join())
+        assert.Not.Nil(s:tostring(-1):find('host callbacks are not available in async calls', 1, true))
+      end)
+      it('honors budgets', function()
+        local s = lib.newstate()
+        s:setbudget(1000)
+        s:loadstring('while true do end')
+        assert.same(lib.ERRBUDGET, s:callasync(0, 0):join())
+      end)
+      it('runs independent sandboxes concurrently', function()
+        local states, futures = {}, {}
+        for i = 1, 8 do
+          local s = lib.newstate()
+          s:loadstring('local n = ...; local t = 0; for i = 1, n do t = t + i end; return t')
+          s:pushnumber(i * 1000)
+          states[i] = s
+          futures[i] = s:callasync(1, 1)
+        end
+        for i = 1, 8 do
+          assert.same(0, futures[i]:join())
+          assert.same(i * 1000 * (i * 1000 + 1) / 2, states[i]:tonumber(-1))
+        end
+      end)
+      it('runs queued calls on the joining thread', function()
+        -- More outer calls than workers, each waiting on a nested call queued
+        -- behind the others.
+        local states, futures = {}, {}
+        for i = 1, 100 do
+          local s = lib.newstate()
+          s:openlibs()
+          s:loadstring([[
+            local lualua, n = ...
+            local ss = lualua.newstate()
+            ss:loadstring('return 2 * ...')
+            ss:pushnumber(n)
+            assert(ss:callasync(1, 1):join() == 0)
+            return ss:tonumber(-1)
+          ]])
+          s:openlualua()
+          s:pushnumber(i)
+          states[i] = s
+          futures[i] = s:callasync(2, 1)
+        end
+        for i = 1, 100 do
+          assert.same(0, futures[i]:join())
+          assert.same(2 * i, states[i]:tonumber(-1))
+        end
+      end)
+      it('fails on empty stack', function()
+        local s = lib.newstate()
+        assertFails('stack underflow', s.callasync, s, 0, 0)
+      end)
+    end)
+
     describe('checkstack', function()
       it('works with zero', function()
         local s = lib.newstate()
@@ -160,6 +593,21 @@ describe('lualua', function()
         s:newtable()
         assertFails('attempt to concatenate a table value', s.concat, s, 2)
       end)
+      it('honors metatables', function()
+        local s = lib.newstate()
+        s:pushstring('moo')
+        s:newtable()
+        s:newtable()
+        s:pushcfunction(function(ss)
+          ss:pushstring('cow')
+          return 1
+        end)
+        s:setfield(-2, '__concat')
+        s:setmetatable(-2)
+        nr(0, s:concat(2))
+        assert.same(1, s:gettop())
+        assert.same('cow', s:tostring(1))
+      end)
       it('fails past the end', function()
         local s = lib.newstate()
         assertFails('stack underflow', s.concat, s, 42)
@@ -204,6 +652,93 @@ describe('lualua', function()
       end)
     end)
 
+    describe('dump', function()
+      it('dumps loadable bytecode', function()
+        local s = lib.newstate()
+        s:loadstring('return 42')
+        local code = nr(1, s:dump(-1))
+        assert.same('\27', code:sub(1, 1))
+        assert.same(1, s:gettop())
+        local s2 = lib.newstate()
+        assert.same(0, s2:loadstring(code, '=dumped'))
+        s2:call(0, 1)
+        assert.same(42, s2:tonumber(-1))
+      end)
+      it('fails on non-Lua functions', function()
+        local s = lib.newstate()
+        s:pushcfunction(function()
+          return 0
+        end)
+        assertFails('unable to dump given function', s.dump, s, -1)
+        assert.same(0, s:gettop())
+      end)
+      it('fails on invalid index', function()
+        local s = lib.newstate()
+        assertFails('invalid index', s.dump, s, -1)
+      end)
+    end)
+
+    describe('entries', function()
+      it('fails on invalid index', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        s:pushnil()
+        assertFails('type error', s.entries, s, 1)
+      end)
+      it('fails on invalid max', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushnil()
+        assertFails('bad argument #3 to \'?\' (invalid max)', s.entries, s, 1, { max = 0 })
+      end)
+      it('converts scalars', function()
+        local s = lib.newstate()
+        s:pushtable({ 'x', true, foo = 42 })
+        s:pushnil()
+        local keys, values, more = nr(3, s:entries(1))
+        assert.same(false, more)
+        assert.same(1, s:gettop())
+        local t = {}
+        for i, k in ipairs(keys) do
+          t[k] = values[i]
+        end
+        assert.same({ 'x', true, foo = 42 }, t)
+      end)
+      it('works in batches', function()
+        local s = lib.newstate()
+        s:pushtable({ 1, 2, 3, 4, 5 })
+        s:pushnil()
+        local t, n, more = {}, 0, true
+        while more do
+          local keys, values
+          keys, values, more = s:entries(1, { max = 2 })
+          assert.same(more and 2 or 1, s:gettop())
+          for i, k in ipairs(keys) do
+            t[k] = values[i]
+          end
+          n = n + 1
+        end
+        assert.same({ 1, 2, 3, 4, 5 }, t)
+        assert.same(3, n)
+      end)
+      it('refs other values', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:newtable()
+        s:setfield(1, 'foo')
+        s:pushnil()
+        local keys, values = s:entries(1)
+        assert.same({ 'foo' }, keys)
+        assert.same('table', values[1].type)
+        s:rawgeti(lib.REGISTRYINDEX, values[1].ref)
+        s:getfield(1, 'foo')
+        assert.same(true, s:rawequal(-1, -2))
+        s:unref(lib.REGISTRYINDEX, values[1].ref)
+        s:pushnil()
+        assert.same({ { type = 'table' } }, (select(2, s:entries(1, { refs = false }))))
+      end)
+    end)
+
     describe('equal', function()
       it('works with numbers', function()
         local s = lib.newstate()
@@ -269,6 +804,134 @@ describe('lualua', function()
       end)
     end)
 
+    describe('exec', function()
+      it('requires a program', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (lualua program expected, got no value)', s.exec, s)
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        s:loadstring('local a, b = ...; return a + b')
+        local p = lib.compile({
+          { 'pushvalue', -1 },
+          { 'pusharg', 1 },
+          { 'pusharg', 2 },
+          { 'call', 2, 1 },
+          { 'tonumber', -1 },
+          { 'pop', 1 },
+        })
+        assert.same(46, nr(1, s:exec(p, 12, 34)))
+        assert.same(3, nr(1, s:exec(p, 1, 2)))
+        assert.same(1, s:gettop())
+        assert.same(true, s:isfunction(1))
+      end)
+      it('works with tables and globals', function()
+        local s = lib.newstate()
+        local p = lib.compile({
+          { 'newtable' },
+          { 'pusharg', 1 },
+          { 'setfield', -2, 'foo' },
+          { 'pushstring', 'foo' },
+          { 'gettable', -2 },
+          { 'tostring', -1 },
+          { 'pop', 1 },
+          { 'pushboolean', true },
+          { 'rawseti', -2, 1 },
+          { 'rawgeti', -1, 1 },
+          { 'toboolean', -1 },
+          { 'settop', -2 },
+          { 'setglobal', 'bar' },
+          { 'getglobal', 'bar' },
+          { 'getfield', -1, 'foo' },
+          { 'tostring', -1 },
+          { 'pop', 2 },
+        })
+        assert.same({ 'moo', true, 'moo' }, { nr(3, s:exec(p, 'moo')) })
+        assert.same(0, s:gettop())
+      end)
+      it('pushes nil for missing arguments', function()
+        local s = lib.newstate()
+        local p = lib.compile({ { 'pusharg', 3 } })
+        nr(0, s:exec(p, 1))
+        assert.same(1, s:gettop())
+        assert.same(true, s:isnil(1))
+      end)
+      it('fails on non-scalar arguments', function()
+        local s = lib.newstate()
+        local p = lib.compile({ { 'pusharg', 1 } })
+        assertFails('(scalar expected, got table)', s.exec, s, p, {})
+        assert.same(0, s:gettop())
+      end)
+      it('fails on stack underflow before running', function()
+        local s = lib.newstate()
+        local p = lib.compile({ { 'pushnil' }, { 'getfield', -3, 'foo' } })
+        s:newtable()
+        assertFails('stack underflow', s.exec, s, p)
+        assert.same(0, s:gettop())
+      end)
+      it('fails on stack overflow before running', function()
+        local s = lib.newstate()
+        local ops = {}
+        for i = 1, lib.MINSTACK + 1 do
+          ops[i] = { 'pushnil' }
+        end
+        assertFails('stack overflow', s.exec, s, lib.compile(ops))
+        assert.same(0, s:gettop())
+      end)
+      it('fails on type errors', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('type error', s.exec, s, lib.compile({ { 'rawgeti', 1, 1 } }))
+        assert.same(0, s:gettop())
+      end)
+      it('fails on sandbox errors', function()
+        local s = lib.newstate()
+        local p = lib.compile({ { 'getglobal', 'unknown' }, { 'call', 0, 0 } })
+        assertFails('attempt to call a nil value', s.exec, s, p)
+        assert.same(0, s:gettop())
+      end)
+    end)
+
+    describe('gc', function()
+      it('reports memory in use', function()
+        local s = lib.newstate()
+        assert.True(nr(1, s:gc(lib.GCCOUNT)) > 0)
+        local b = nr(1, s:gc(lib.GCCOUNTB))
+        assert.True(b >= 0 and b < 1024)
+      end)
+      it('sets parameters', function()
+        local s = lib.newstate()
+        assert.same(200, s:gc(lib.GCSETPAUSE, 100))
+        assert.same(100, s:gc(lib.GCSETPAUSE, 200))
+        assert.same(200, s:gc(lib.GCSETSTEPMUL, 400))
+        assert.same(400, s:gc(lib.GCSETSTEPMUL, 200))
+      end)
+      it('collects garbage', function()
+        local s = lib.newstate()
+        s:gc(lib.GCSTOP)
+        s:loadstring('for i = 1, 1000 do local t = {} end')
+        s:call(0, 0)
+        local before = s:gc(lib.GCCOUNT)
+        assert.same(0, s:gc(lib.GCCOLLECT))
+        assert.True(s:gc(lib.GCCOUNT) < before)
+        s:gc(lib.GCRESTART)
+        assert.same('number', type(s:gc(lib.GCSTEP, 1)))
+        assert.same(0, s:gettop())
+      end)
+      it('runs finalizers protected', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:loadstring('getmetatable(newproxy(true)).__gc = function() error("moo") end')
+        s:call(0, 0)
+        assertFails('moo', s.gc, s, lib.GCCOLLECT)
+        assert.same(0, s:gettop())
+      end)
+      it('rejects unknown options', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (invalid option)', s.gc, s, 42)
+      end)
+    end)
+
     describe('getfenv', function()
       it('fails on invalid index', function()
         local s = lib.newstate()
@@ -324,6 +987,34 @@ describe('lualua', function()
         assert.same(true, s:istable(1))
         assert.same('bar', s:tostring(2))
       end)
+      it('honors metatables only for missing fields', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushstring('bar')
+        s:setfield(-2, 'foo')
+        s:newtable()
+        s:pushcfunction(function(ss)
+          ss:pushstring('cow')
+          return 1
+        end)
+        s:setfield(-2, '__index')
+        s:setmetatable(-2)
+        nr(0, s:getfield(1, 'foo'))
+        nr(0, s:getfield(1, 'moo'))
+        assert.same(3, s:gettop())
+        assert.same('bar', s:tostring(2))
+        assert.same('cow', s:tostring(3))
+      end)
+      it('works with embedded zeros', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushstring('bar')
+        s:setfield(1, 'foo\0moo')
+        nr(0, s:getfield(1, 'foo'))
+        nr(0, s:getfield(1, 'foo\0moo'))
+        assert.same(true, s:isnil(2))
+        assert.same('bar', s:tostring(3))
+      end)
       it('fails on full stack', function()
         local s = lib.newstate()
         s:newtable()
@@ -599,6 +1290,17 @@ describe('lualua', function()
         s:pushvalue(1)
         s:setmetatable(-2)
         assert.same(true, nr(1, s:lessthan(-1, -2)))
+        assert.same(3, s:gettop())
+      end)
+      it('leaves the stack alone', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        s:pushstring('foo')
+        assertFails('attempt to compare number with string', s.lessthan, s, 1, 2)
+        s:pushnumber(42)
+        s:pushnumber(99)
+        s:lessthan(1, 2)
+        assert.same(2, s:gettop())
       end)
     end)
 
@@ -645,6 +1347,59 @@ describe('lualua', function()
       end)
     end)
 
+    describe('memstats', function()
+      it('tracks allocations', function()
+        local s = lib.newstate()
+        local before = nr(1, s:memstats())
+        assert.same('number', type(before.bytes))
+        s:pushstring(('x'):rep(10000))
+        local after = s:memstats()
+        assert.True(after.bytes >= before.bytes + 10000)
+        if lib.hasallocator then
+          assert.True(after.peak >= after.bytes)
+          assert.True(after.allocs > before.allocs)
+          assert.True(after.allocs >= after.frees)
+          s:pop(1)
+          s:gc(lib.GCCOLLECT)
+          local collected = s:memstats()
+          assert.True(collected.frees > after.frees)
+          assert.True(collected.lastfreed >= 10000)
+        end
+      end)
+    end)
+
+    describe('newbuffer', function()
+      it('works', function()
+        local s = lib.newstate()
+        nr(0, s:newbuffer(16))
+        assert.same(1, s:gettop())
+        assert.same(true, s:isuserdata(1))
+        assert.same(16, s:objlen(1))
+        assert.same(nil, s:touserdata(1))
+        for i = 0, 15 do
+          assert.same(0, s:readbuffer(1, 'u8', i))
+        end
+      end)
+      it('works with size zero', function()
+        local s = lib.newstate()
+        s:newbuffer(0)
+        assert.same(0, s:objlen(1))
+        assert.same('', s:readbuffer(1, 'string', 0, 0))
+      end)
+      it('fails on bad size', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (invalid size)', s.newbuffer, s, -1)
+        assertFails('bad argument #2 to \'?\' (invalid size)', s.newbuffer, s, 1.5)
+      end)
+      it('fails on full stack', function()
+        local s = lib.newstate()
+        for _ = 1, lib.MINSTACK do
+          s:pushnil()
+        end
+        assertFails('stack overflow', s.newbuffer, s, 1)
+      end)
+    end)
+
     describe('newtable', function()
       it('works', function()
         local s = lib.newstate()
@@ -665,6 +1420,72 @@ describe('lualua', function()
       end)
     end)
 
+    describe('newthread', function()
+      it('pushes a thread and returns its state', function()
+        local s = lib.newstate()
+        local t = nr(1, s:newthread())
+        assert.same('lualua state', getmetatable(t))
+        assert.same(1, s:gettop())
+        assert.True(s:isthread(1))
+        assert.same(0, t:gettop())
+        assert.same(0, nr(1, t:status()))
+      end)
+      it('resumes and yields', function()
+        local s = lib.newstate()
+        s:openlibs()
+        local t = s:newthread()
+        t:loadstring('local a = ...; local b = coroutine.yield(a + 1); return b * 2')
+        t:pushnumber(1)
+        assert.same(lib.YIELD, nr(1, t:resume(1)))
+        assert.same(lib.YIELD, t:status())
+        assert.same(2, t:tonumber(-1))
+        t:pop(1)
+        t:pushnumber(5)
+        assert.same(0, t:resume(1))
+        assert.same(10, t:tonumber(-1))
+        assert.same(0, t:status())
+      end)
+      it('reports errors', function()
+        local s = lib.newstate()
+        local t = s:newthread()
+        t:loadstring('error("moo")')
+        assert.same(lib.ERRRUN, t:resume(0))
+        assert.same(lib.ERRRUN, t:status())
+      end)
+      it('honors budgets', function()
+        local s = lib.newstate()
+        local t = s:newthread()
+        s:setbudget(1000)
+        t:loadstring('while true do end')
+        assert.same(lib.ERRBUDGET, t:resume(0))
+      end)
+      it('outlives the host reference to its state', function()
+        local t = lib.newstate():newthread()
+        collectgarbage()
+        t:pushnumber(42)
+        assert.same(42, t:tonumber(-1))
+      end)
+      it('keeps its sandbox alive when made in a callback', function()
+        local s = lib.newstate()
+        local t
+        s:pushcfunction(function(ss)
+          t = ss:newthread()
+          return 0
+        end)
+        s:call(0, 0)
+        s = nil
+        collectgarbage()
+        collectgarbage()
+        t:pushnumber(42)
+        assert.same(42, t:tonumber(-1))
+      end)
+      it('only resumes threads', function()
+        local s = lib.newstate()
+        s:loadstring('return')
+        assertFails('not a thread', s.resume, s, 0)
+      end)
+    end)
+
     describe('newuserdata', function()
       it('works', function()
         local s = lib.newstate()
@@ -674,6 +1495,112 @@ describe('lualua', function()
         assert.same(1, s:gettop())
         assert.same(true, s:isuserdata(1))
         assert.equal(t, s:touserdata(1))
+        assert.same(false, s:getmetatable(1))
+        s:openlibs()
+        s:loadstring('return getmetatable(...), debug.getmetatable(...)')
+        s:pushvalue(1)
+        s:call(1, 2)
+        assert.True(s:isnil(-2))
+        assert.True(s:isnil(-1))
+      end)
+      local function collects(setup)
+        local s = lib.newstate()
+        local weak = setmetatable({ s:newuserdata() }, { __mode = 'v' })
+        setup(s)
+        s:settop(0)
+        s:gc(lib.GCCOLLECT, 0)
+        collectgarbage()
+        return weak[1] == nil
+      end
+      it('releases its host table when collected', function()
+        assert.True(collects(function() end))
+      end)
+      it('releases its host table with a metatable set', function()
+        local gced = false
+        assert.True(collects(function(s)
+          s:newtable()
+          s:setmetatable(1)
+          s:getmetatable(1)
+          s:setmetatable(1)
+          s:pushnil()
+          s:setmetatable(1)
+          s:newtable()
+          s:setmetatable(1)
+        end))
+        assert.True(collects(function(s)
+          s:newtable()
+          s:pushcfunction(function()
+            gced = true
+            return 0
+          end)
+          s:setfield(-2, '__gc')
+          s:setmetatable(1)
+        end))
+        assert.True(gced)
+      end)
+      it('releases its host table with a metatable set by sandbox code', function()
+        assert.True(collects(function(s)
+          s:openlibs()
+          s:loadstring('debug.setmetatable(..., {})')
+          s:pushvalue(1)
+          s:call(1, 0)
+        end))
+      end)
+      it('leaves metatables alone', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:newuserdata()
+        s:newtable()
+        s:pushvalue(-1)
+        s:setmetatable(1)
+        s:getfield(-1, '__gc')
+        assert.True(s:isnil(-1))
+        s:pop(1)
+        assert.True(s:getmetatable(1))
+        assert.True(s:rawequal(2, 3))
+        s:loadstring('local u, mt = ... return getmetatable(u) == mt, rawget(getmetatable(u), "__gc")')
+        s:pushvalue(1)
+        s:pushvalue(2)
+        s:call(2, 2)
+        assert.True(s:toboolean(-2))
+        assert.True(s:isnil(-1))
+      end)
+      it('keeps its environment', function()
+        local s = lib.newstate()
+        s:newuserdata()
+        s:newtable()
+        assert.same(false, nr(1, s:setfenv(1)))
+        assert.same(1, s:gettop())
+        s:newbuffer(1)
+        s:newtable()
+        assert.same(false, nr(1, s:setfenv(2)))
+      end)
+      it('cannot be forged', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:newuserdata()
+        s:loadstring([[
+          local h = ...
+          local p = newproxy()
+          local forged = pcall(debug.setfenv, p, debug.getfenv(h))
+          local disowned = pcall(debug.setfenv, h, {})
+          debug.setmetatable(p, debug.getmetatable(h))
+          p = nil
+          collectgarbage()
+          return forged, disowned
+        ]])
+        s:pushvalue(1)
+        s:call(1, 2)
+        assert.False(s:toboolean(2))
+        assert.False(s:toboolean(3))
+        s:settop(1)
+        s:getfenv(1)
+        s:loadstring('return newproxy()')
+        s:call(0, 1)
+        s:insert(2)
+        assert.same(false, s:setfenv(2))
+        s:settop(1)
+        assert.same('table', type(s:touserdata(1)))
       end)
       it('fails on full stack', function()
         local s = lib.newstate()
@@ -842,6 +1769,81 @@ describe('lualua', function()
       end)
     end)
 
+    describe('openlualua', function()
+      it('pushes a native lualua', function()
+        local s = lib.newstate()
+        s:openlibs()
+        nr(0, s:openlualua())
+        assert.same(1, s:gettop())
+        assert.same(true, s:istable(1))
+        s:loadstring([[
+          local lualua = ...
+          local ss = lualua.newstate()
+          ss:loadstring('return 40 + ...')
+          ss:pushnumber(2)
+          ss:call(1, 1)
+          return ss:tonumber(-1), lualua.MINSTACK
+        ]])
+        s:insert(1)
+        s:call(1, 2)
+        assert.same(42, s:tonumber(1))
+        assert.same(lib.MINSTACK, s:tonumber(2))
+      end)
+      it('leaves out setchunkcache', function()
+        local s = lib.newstate()
+        s:openlualua()
+        s:getfield(1, 'setchunkcache')
+        assert.True(s:isnil(2))
+        s:getfield(1, 'chunkcachestats')
+        assert.True(s:isfunction(3))
+      end)
+      it('fails on full stack', function()
+        local s = lib.newstate()
+        for _ = 1, lib.MINSTACK do
+          s:pushnil()
+        end
+        assertFails('stack overflow', s.openlualua, s)
+      end)
+    end)
+
+    describe('pairs', function()
+      it('fails on invalid index', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('type error', s.pairs, s, 1)
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        local t = { foo = 'bar', baz = false }
+        for i = 1, 100 do
+          t[i] = i * i
+        end
+        s:pushtable(t)
+        local u = {}
+        for k, v in s:pairs(1, { max = 7 }) do
+          s:settop(lib.MINSTACK)
+          u[k] = v
+          s:settop(1)
+        end
+        assert.same(t, u)
+        assert.same(1, s:gettop())
+      end)
+      it('refs other values', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushvalue(1)
+        s:pushboolean(true)
+        s:rawset(1)
+        for k, v in s:pairs(1) do
+          assert.same('table', k.type)
+          assert.same(true, v)
+          s:rawgeti(lib.REGISTRYINDEX, k.ref)
+          assert.same(true, s:rawequal(1, -1))
+          s:unref(lib.REGISTRYINDEX, k.ref)
+        end
+      end)
+    end)
+
     describe('pcall', function()
       it('fails on empty stack', function()
         local s = lib.newstate()
@@ -871,6 +1873,14 @@ describe('lualua', function()
         assert.same(42, s:tonumber(3))
         assert.same(false, s:toboolean(4))
       end)
+      it('returns ERRBUDGET when out of budget', function()
+        local s = lib.newstate()
+        s:loadstring('while true do end')
+        assert.same(lib.ERRBUDGET, nr(1, s:pcall(0, 0, 0, { budget = 100, granularity = 10 })))
+        assert.same(1, s:gettop())
+        assert.same('instruction budget exceeded', s:tostring(1):sub(-27))
+        assert.same(0, s:getbudget())
+      end)
       it('fails on invalid errfunc index', function()
         local s = lib.newstate()
         s:loadstring('unknown()')
@@ -977,6 +1987,104 @@ describe('lualua', function()
       end)
     end)
 
+    describe('prepare', function()
+      local function ref(s, code)
+        s:loadstring(code)
+        return s:ref(lib.REGISTRYINDEX)
+      end
+      it('fails on invalid nresults', function()
+        local s = lib.newstate()
+        assertFails('bad argument #3 to \'?\' (invalid nresults)', s.prepare, s, 1, -2)
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        local f = nr(1, s:prepare(ref(s, 'local a, b = ... return a + b, a .. b, nil')))
+        assert.same({ 3, '12', n = 3 }, { n = select('#', f(1, 2)), f(1, 2) })
+        assert.same({ 3, '21' }, { nr(3, f('2', 1)) })
+        assert.same(1, s:gettop())
+      end)
+      it('adjusts results', function()
+        local s = lib.newstate()
+        local f = s:prepare(ref(s, 'return ...'), 2)
+        assert.same({ true }, { nr(2, f(true)) })
+        assert.same({ 1, 2 }, { nr(2, f(1, 2, 3)) })
+      end)
+      it('refs other results', function()
+        local s = lib.newstate()
+        local t = s:prepare(ref(s, 'return {}'), 1)()
+        assert.same('table', t.type)
+        s:rawgeti(lib.REGISTRYINDEX, t.ref)
+        assert.same(true, s:istable(-1))
+        s:unref(lib.REGISTRYINDEX, t.ref)
+      end)
+      it('raises errors', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:pushnumber(42)
+        local f = s:prepare(ref(s, 'error("moo", 0)'))
+        assertFails('moo', f)
+        assert.same(1, s:gettop())
+        local handler = ref(s, 'return "handled " .. ...')
+        assertFails('handled moo', s:prepare(ref(s, 'error("moo", 0)'), 0, { handler = handler }))
+        assert.same(1, s:gettop())
+      end)
+      it('fails on non-scalar arguments', function()
+        local s = lib.newstate()
+        local f = s:prepare(ref(s, 'return'))
+        assertFails('scalar expected, got table)', f, {})
+        s:pushnumber(42)
+        s:pushnumber(43)
+        assertFails('scalar expected, got table)', f, 1, {})
+        assert.same(2, s:gettop())
+        assert.same(43, s:tonumber(-1))
+      end)
+    end)
+
+    describe('profile_start', function()
+      local code = 'local function hot() for i = 1, 100 do end end for i = 1, 1000 do hot() end'
+      it('samples folded stacks', function()
+        local s = lib.newstate()
+        s:loadstring(code, '=prof')
+        nr(0, s:profile_start({ interval = 100 }))
+        s:call(0, 0)
+        local folded = nr(1, s:profile_stop())
+        local total, hot = 0, 0
+        for stack, count in folded:gmatch('([^\n]*) (%d+)\n') do
+          total = total + tonumber(count)
+          if stack:find('hot (prof:1)', 1, true) then
+            hot = hot + tonumber(count)
+          end
+        end
+        assert.True(total > 0)
+        assert.True(hot > total / 2)
+      end)
+      it('does not allocate in the sandbox', function()
+        if lib.hasallocator then
+          local s = lib.newstate()
+          s:loadstring(code)
+          local function allocs()
+            s:pushvalue(1)
+            local before = s:memstats().allocs
+            s:call(0, 0)
+            return s:memstats().allocs - before
+          end
+          local plain = allocs()
+          s:profile_start({ interval = 1 })
+          assert.same(plain, allocs())
+          s:profile_stop()
+        end
+      end)
+      it('rejects bad usage', function()
+        local s = lib.newstate()
+        assertFails('profiler not running', s.profile_stop, s)
+        assertFails('bad argument #2 to \'?\' (invalid interval)', s.profile_start, s, { interval = 0 })
+        s:profile_start()
+        assertFails('profiler already running', s.profile_start, s)
+        assert.same('', s:profile_stop())
+      end)
+    end)
+
     describe('pushboolean', function()
       it('no argument is false', function()
         local s = lib.newstate()
@@ -1037,6 +2145,15 @@ describe('lualua', function()
         assert.same(99, s:tonumber(2))
         assert.same(true, s:isnil(3))
       end)
+      it('releases the host function when collected', function()
+        local s = lib.newstate()
+        local weak = setmetatable({ function() end }, { __mode = 'v' })
+        s:pushcfunction(weak[1])
+        s:settop(0)
+        s:gc(lib.GCCOLLECT, 0)
+        collectgarbage()
+        assert.Nil(weak[1])
+      end)
       it('works with extra args', function()
         local s = lib.newstate()
         s:pushnumber(42)
@@ -1062,6 +2179,43 @@ describe('lualua', function()
         s:loadstring('moocow()')
         assert.errors(docall(s, 0, 0), 'womp womp')
       end)
+      it('reuses one state across callbacks', function()
+        local s = lib.newstate()
+        local states = {}
+        s:pushcfunction(function(ss)
+          table.insert(states, ss)
+          return 0
+        end)
+        s:pushvalue(-1)
+        s:call(0, 0)
+        s:call(0, 0)
+        assert.same(2, #states)
+        assert.equal(states[1], states[2])
+      end)
+      it('restores the state after nested callbacks', function()
+        local s = lib.newstate()
+        s:pushcfunction(function(ss)
+          ss:pushnumber(ss:tonumber(1) * 2)
+          return 1
+        end)
+        s:setglobal('double')
+        s:pushcfunction(function(ss)
+          ss:checkstack(lib.MINSTACK)
+          ss:getglobal('double')
+          ss:pushnumber(21)
+          ss:call(1, 1)
+          assert.same(2, ss:gettop())
+          assert.same('moo', ss:tostring(1))
+          for _ = 1, lib.MINSTACK do
+            ss:pushnil()
+          end
+          ss:settop(2)
+          return 1
+        end)
+        s:pushstring('moo')
+        s:call(1, 1)
+        assert.same(42, s:tonumber(1))
+      end)
       it('does not preserve reference equality', function()
         local s = lib.newstate()
         local f = function() end
@@ -1087,6 +2241,92 @@ describe('lualua', function()
       end)
     end)
 
+    describe('pushhostfunction', function()
+      it('works', function()
+        local s = lib.newstate()
+        s:pushhostfunction(function(...)
+          assert.same({ 42, 'foo', nil, true, n = 4 }, { n = select('#', ...), ... })
+          return 'bar', 99, nil
+        end)
+        s:pushnumber(42)
+        s:pushstring('foo')
+        s:pushnil()
+        s:pushboolean(true)
+        s:call(4, lib.MULTRET)
+        assert.same(3, s:gettop())
+        assert.same('bar', s:tostring(1))
+        assert.same(99, s:tonumber(2))
+        assert.same(true, s:isnil(3))
+      end)
+      it('fails on tables by default', function()
+        local s = lib.newstate()
+        s:pushhostfunction(function() end)
+        s:setglobal('f')
+        s:loadstring('f(1, {})')
+        assert.errors(docall(s, 0, 0), 'bad argument #2 to \'f\' (scalar expected, got table)')
+        s:pushhostfunction(function()
+          return {}
+        end)
+        assert.errors(docall(s, 0, 0), 'bad result #1 (scalar expected, got table)')
+      end)
+      it('fails on invalid tables', function()
+        local s = lib.newstate()
+        local f = function() end
+        assertFails('bad argument #3 to \'?\' (invalid tables)', s.pushhostfunction, s, f, { tables = 'deep' })
+        assertFails('bad argument #3 to \'?\' (invalid tables)', s.pushhostfunction, s, f, { tables = true })
+        assert.same(0, s:gettop())
+      end)
+      it('copies tables', function()
+        local s = lib.newstate()
+        s:pushhostfunction(function(t)
+          assert.same({ 1, foo = { 'bar' } }, t)
+          return { t.foo }
+        end, { tables = 'copy' })
+        s:pushtable({ 1, foo = { 'bar' } })
+        s:call(1, 1)
+        assert.same({ { 'bar' } }, s:totable(1))
+      end)
+      it('passes handles', function()
+        local s = lib.newstate()
+        local handle
+        s:pushhostfunction(function(t)
+          handle = t
+          return t
+        end, { tables = 'ref' })
+        s:newtable()
+        s:pushvalue(-1)
+        s:insert(1)
+        s:call(1, 1)
+        assert.same(true, s:rawequal(1, 2))
+        assert.same('table', handle.type)
+        s:unref(lib.REGISTRYINDEX, handle.ref)
+      end)
+      it('fails gracefully', function()
+        local s = lib.newstate()
+        s:pushhostfunction(function()
+          error('womp womp', 0)
+        end)
+        assert.errors(docall(s, 0, 0), 'womp womp')
+        assert.same(0, s:gettop())
+      end)
+    end)
+
+    describe('pushlstring', function()
+      it('pushes a prefix', function()
+        local s = lib.newstate()
+        nr(0, s:pushlstring('foo\0bar', 5))
+        assert.same('foo\0b', s:tostring(-1))
+        nr(0, s:pushlstring('foo', 0))
+        assert.same('', s:tostring(-1))
+      end)
+      it('fails on bad length', function()
+        local s = lib.newstate()
+        assertFails('bad argument #3 to \'?\' (length out of range)', s.pushlstring, s, 'foo', 4)
+        assertFails('bad argument #3 to \'?\' (length out of range)', s.pushlstring, s, 'foo', -1)
+        assert.same(0, s:gettop())
+      end)
+    end)
+
     describe('pushnumber', function()
       it('requires an argument', function()
         local s = lib.newstate()
@@ -1130,6 +2370,14 @@ describe('lualua', function()
         nr(0, s:pushstring(42))
         assert.same('42', s:tostring(-1))
       end)
+      it('works with embedded zeros', function()
+        local s = lib.newstate()
+        nr(0, s:pushstring('foo\0bar'))
+        assert.same('foo\0bar', s:tostring(-1))
+        s:pushvalue(-1)
+        assert.same('foo\0bar', s:checkstring(-1))
+        assertFails('foo\0bar', s.error, s)
+      end)
       it('fails on full stack', function()
         local s = lib.newstate()
         for _ = 1, lib.MINSTACK do
@@ -1139,6 +2387,68 @@ describe('lualua', function()
       end)
     end)
 
+    describe('pushtable', function()
+      it('requires a table', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (table expected, got no value)', s.pushtable, s)
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        nr(0, s:pushtable({ 42, 'foo', bar = 'baz', nested = { true } }))
+        assert.same(1, s:gettop())
+        assert.same(2, s:objlen(1))
+        s:rawgeti(1, 1)
+        assert.same(42, s:tonumber(-1))
+        s:rawgeti(1, 2)
+        assert.same('foo', s:tostring(-1))
+        s:getfield(1, 'bar')
+        assert.same('baz', s:tostring(-1))
+        s:getfield(1, 'nested')
+        s:rawgeti(-1, 1)
+        assert.same(true, s:toboolean(-1))
+        assert.same(6, s:gettop())
+      end)
+      it('preserves cycles and shared references', function()
+        local s = lib.newstate()
+        local t = { shared = {} }
+        t.self = t
+        t.again = t.shared
+        t[t.shared] = 'key'
+        nr(0, s:pushtable(t))
+        s:getfield(1, 'self')
+        assert.same(true, s:rawequal(1, 2))
+        s:getfield(1, 'shared')
+        s:getfield(1, 'again')
+        assert.same(true, s:rawequal(3, 4))
+        s:gettable(1)
+        assert.same('key', s:tostring(-1))
+      end)
+      it('fails on functions', function()
+        local s = lib.newstate()
+        assertFails('cannot copy a function value', s.pushtable, s, { print })
+        assert.same(0, s:gettop())
+      end)
+      it('honors depth', function()
+        local s = lib.newstate()
+        assertFails('table too deep', s.pushtable, s, { {} }, { depth = 1 })
+        assert.same(0, s:gettop())
+        nr(0, s:pushtable({ {} }, { depth = 2 }))
+        assert.same(1, s:gettop())
+      end)
+      it('works without presizing', function()
+        local s = lib.newstate()
+        nr(0, s:pushtable({ 1, 2, 3, x = 4 }, { presize = false }))
+        assert.same(3, s:objlen(1))
+      end)
+      it('fails on full stack', function()
+        local s = lib.newstate()
+        for _ = 1, lib.MINSTACK do
+          s:pushnil()
+        end
+        assertFails('stack overflow', s.pushtable, s, {})
+      end)
+    end)
+
     describe('pushvalue', function()
       it('requires an argument', function()
         local s = lib.newstate()
@@ -1281,6 +2591,35 @@ describe('lualua', function()
       end)
     end)
 
+    describe('rawgetrange', function()
+      it('fails on numbers', function()
+        local s = lib.newstate()
+        s:pushnumber(12345)
+        assertFails('type error', s.rawgetrange, s, -1)
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        s:pushtable({ 1, 2.5, 'foo', true })
+        assert.same({ 1, 2.5, 'foo', true }, nr(1, s:rawgetrange(-1)))
+        s:pushnumber(6)
+        s:rawseti(-2, 6)
+        assert.same({ 2.5, 'foo', true, nil, 6, nil }, s:rawgetrange(-1, 2, 7))
+        assert.same({}, s:rawgetrange(-1, 3, 2))
+        assert.same(1, s:gettop())
+      end)
+      it('refs other values', function()
+        local s = lib.newstate()
+        s:pushtable({ 42, {} })
+        local t = s:rawgetrange(1)
+        assert.same(42, t[1])
+        assert.same('table', t[2].type)
+        s:rawgeti(lib.REGISTRYINDEX, t[2].ref)
+        s:rawgeti(1, 2)
+        assert.same(true, s:rawequal(-1, -2))
+        s:unref(lib.REGISTRYINDEX, t[2].ref)
+      end)
+    end)
+
     describe('rawset', function()
       it('fails on empty stack', function()
         local s = lib.newstate()
@@ -1392,6 +2731,67 @@ describe('lualua', function()
       end)
     end)
 
+    describe('rawsetrange', function()
+      it('fails on numbers', function()
+        local s = lib.newstate()
+        s:pushnumber(12345)
+        assertFails('type error', s.rawsetrange, s, -1, 1, {})
+      end)
+      it('fails on non-scalars', function()
+        local s = lib.newstate()
+        s:newtable()
+        assertFails('bad argument #4 to \'?\' (scalar expected at 2)', s.rawsetrange, s, 1, 1, { 1, {} })
+        assert.same(0, s:gettop())
+      end)
+      it('works', function()
+        local s = lib.newstate()
+        s:pushtable({ 'a', 'b' })
+        s:pushnumber(42)
+        nr(0, s:rawsetrange(-2, 2, { 1, 'foo', false }))
+        assert.same(2, s:gettop())
+        assert.same({ 'a', 1, 'foo', false }, s:totable(1))
+      end)
+      it('round trips numbers', function()
+        local s = lib.newstate()
+        local t = {}
+        for i = 1, 1000 do
+          t[i] = i / 3
+        end
+        s:newtable()
+        s:rawsetrange(1, 1, t)
+        assert.same(1000, s:objlen(1))
+        assert.same(t, s:rawgetrange(1))
+      end)
+    end)
+
+    describe('readbuffer', function()
+      it('fails on non-buffers', function()
+        local s = lib.newstate()
+        s:newuserdata()
+        assertFails('not a buffer', s.readbuffer, s, 1, 'u8', 0)
+        assert.same(0, s:gettop())
+        s:pushstring('foo')
+        assertFails('not a buffer', s.readbuffer, s, 1, 'u8', 0)
+      end)
+      it('fails on bad kind', function()
+        local s = lib.newstate()
+        s:newbuffer(8)
+        assertFails('bad argument #3 to \'?\' (invalid option \'u16\')', s.readbuffer, s, 1, 'u16', 0)
+      end)
+      it('checks bounds', function()
+        local s = lib.newstate()
+        s:newbuffer(8)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.readbuffer, s, 1, 'u8', 8)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.readbuffer, s, 1, 'u8', -1)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.readbuffer, s, 1, 'u32', 5)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.readbuffer, s, 1, 'f64', 1)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.readbuffer, s, 1, 'string', 4, 5)
+        assertFails('bad argument #5 to \'?\' (invalid length)', s.readbuffer, s, 1, 'string', 0, 9)
+        assert.same(0, s:readbuffer(1, 'u32', 4))
+        assert.same(0, s:readbuffer(1, 'f64', 0))
+      end)
+    end)
+
     describe('ref', function()
       it('fails on empty stack', function()
         local s = lib.newstate()
@@ -1414,6 +2814,56 @@ describe('lualua', function()
       end)
     end)
 
+    describe('refstats', function()
+      it('counts refs', function()
+        local s = lib.newstate()
+        local base = nr(1, s:refstats())
+        assert.same({ callbacks = 0, userdata = 0, registry = base.registry }, base)
+        s:register('foo', function() end)
+        s:newuserdata()
+        s:pushvalue(-1)
+        local ref = s:ref(lib.REGISTRYINDEX)
+        assert.same({ callbacks = 1, userdata = 1, registry = base.registry + 1 }, s:refstats())
+        s:unref(lib.REGISTRYINDEX, ref)
+        s:pushnil()
+        s:setglobal('foo')
+        s:settop(0)
+        s:gc(lib.GCCOLLECT, 0)
+        assert.same(base, s:refstats())
+      end)
+    end)
+
+    describe('stats', function()
+      it('counts boundary crossings', function()
+        if not lib.stats then
+          return -- Built with LUALUA_NOSTATS.
+        end
+        local s = lib.newstate()
+        s:pushcfunction(function()
+          return 0
+        end)
+        s:call(0, 0)
+        s:newuserdata()
+        s:pop(1)
+        s:gc(lib.GCCOLLECT, 0)
+        s:pushstring('hello')
+        assertFails('stack underflow', s.pop, s, 2)
+        local t = nr(1, s:stats())
+        t.methods = nil
+        assert.same({
+          bytescopied = 5,
+          callbacks = 1,
+          calls = 8,
+          errors = 1,
+          gcuserdata = 1,
+          newuserdata = 1,
+          safecalls = 2, -- call and gc
+        }, t)
+        nr(0, s:resetstats())
+        assert.same({ stats = { calls = 1, time = 0 } }, s:stats().methods)
+      end)
+    end)
+
     describe('register', function()
       it('works', function()
         local s = lib.newstate()
@@ -1511,6 +2961,122 @@ describe('lualua', function()
       end
     end)
 
+    describe('resumeall', function()
+      it('resumes every thread once', function()
+        local s = lib.newstate()
+        s:openlibs()
+        local threads = {}
+        s:checkstack(100)
+        for i = 1, 100 do
+          threads[i] = s:newthread()
+          threads[i]:loadstring('for i = 1, 3 do coroutine.yield(i) end')
+        end
+        s:settop(0)
+        for _ = 1, 3 do
+          local statuses = nr(1, s:resumeall(threads))
+          for i = 1, 100 do
+            assert.same(lib.YIELD, statuses[i])
+            assert.same(1, threads[i]:gettop())
+          end
+        end
+        local statuses = s:resumeall(threads)
+        for i = 1, 100 do
+          assert.same(0, statuses[i])
+        end
+      end)
+      it('gives each thread its own budget', function()
+        local s = lib.newstate()
+        s:openlibs()
+        local t1, t2 = s:newthread(), s:newthread()
+        t1:loadstring('while true do end')
+        t2:loadstring('for i = 1, 100 do end coroutine.yield()')
+        assert.same({ lib.ERRBUDGET, lib.YIELD }, s:resumeall({ t1, t2 }, { budget = 1000 }))
+        assert.Nil(s:getbudget())
+      end)
+      it('kills threads that run out of budget', function()
+        local s = lib.newstate()
+        local t = s:newthread()
+        t:loadstring('while true do end')
+        assert.same({ lib.ERRBUDGET }, s:resumeall({ t }, { budget = 1000 }))
+        assert.same(lib.ERRRUN, t:status())
+      end)
+      it('leaves finished threads alone', function()
+        local s = lib.newstate()
+        s:openlibs()
+        local t1, t2, t3 = s:newthread(), s:newthread(), s:newthread()
+        t1:loadstring('return function() error("ran again") end')
+        t2:loadstring('return 1, 2')
+        t3:loadstring('error("moo")')
+        assert.same({ 0, 0, lib.ERRRUN }, s:resumeall({ t1, t2, t3 }))
+        local top3 = t3:gettop()
+        assert.same({ lib.ERRDEAD, lib.ERRDEAD, lib.ERRDEAD }, s:resumeall({ t1, t2, t3 }))
+        assert.same(1, t1:gettop())
+        assert.same(2, t2:gettop())
+        assert.same(2, t2:tonumber(-1))
+        assert.same(top3, t3:gettop())
+        t1:settop(0)
+        t1:loadstring('coroutine.yield()')
+        assert.same(lib.YIELD, t1:resume(0))
+        assert.same({ 0 }, s:resumeall({ t1 }))
+      end)
+      it('rejects non-threads', function()
+        local s = lib.newstate()
+        assertFails('bad thread #1', s.resumeall, s, { s })
+        assertFails('bad thread #1', s.resumeall, s, { lib.newstate():newthread() })
+      end)
+    end)
+
+    describe('setbudget', function()
+      it('starts without a budget', function()
+        local s = lib.newstate()
+        assert.Nil(nr(1, s:getbudget()))
+      end)
+      it('aborts runaway calls', function()
+        local s = lib.newstate()
+        nr(0, s:setbudget(10000))
+        s:loadstring('while true do end')
+        assert.same(lib.ERRBUDGET, s:pcall(0, 0, 0))
+        assert.same(0, s:getbudget())
+        s:settop(0)
+        s:loadstring('while true do end')
+        assertFails('instruction budget exceeded', docall(s, 0, 0))
+        assert.same(0, s:gettop())
+      end)
+      it('cannot be caught by sandbox code', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:setbudget(10000, 10)
+        s:loadstring('while true do pcall(function() while true do end end) end')
+        assert.same(lib.ERRBUDGET, s:pcall(0, 0, 0))
+      end)
+      it('charges completed calls', function()
+        local s = lib.newstate()
+        s:setbudget(1000000, 10)
+        s:loadstring('for i = 1, 1000 do end')
+        s:call(0, 0)
+        local remaining = s:getbudget()
+        assert.True(remaining > 0 and remaining < 1000000)
+        s:setbudget(1000000)
+        s:loadstring('for i = 1, 1000 do end')
+        s:call(0, 0)
+        assert.True(s:getbudget() > 0)
+      end)
+      it('can be cleared', function()
+        local s = lib.newstate()
+        s:setbudget(0)
+        assert.same(0, s:getbudget())
+        s:setbudget(nil)
+        assert.Nil(s:getbudget())
+        s:loadstring('for i = 1, 1000 do end')
+        s:call(0, 0)
+      end)
+      it('rejects bad arguments', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (negative budget)', s.setbudget, s, -1)
+        assertFails('bad argument #2 to \'?\' (invalid granularity)', s.setbudget, s, 1, 0)
+      end)
+    end)
+
     describe('setfenv', function()
       it('fails on invalid index', function()
         local s = lib.newstate()
@@ -1579,6 +3145,31 @@ describe('lualua', function()
         s:gettable(-2)
         assert.same(true, s:equal(1, 2))
       end)
+      it('honors metatables only for missing fields', function()
+        local s = lib.newstate()
+        local calls = 0
+        s:newtable()
+        s:pushstring('bar')
+        s:setfield(-2, 'foo')
+        s:newtable()
+        s:pushcfunction(function()
+          calls = calls + 1
+          return 0
+        end)
+        s:setfield(-2, '__newindex')
+        s:setmetatable(-2)
+        s:pushstring('baz')
+        nr(0, s:setfield(1, 'foo'))
+        s:pushstring('cow')
+        nr(0, s:setfield(1, 'moo'))
+        assert.same(1, calls)
+        assert.same(1, s:gettop())
+        s:getfield(1, 'foo')
+        assert.same('baz', s:tostring(-1))
+        s:pushstring('moo')
+        s:rawget(1)
+        assert.same(true, s:isnil(-1))
+      end)
       it('succeeds on full stack', function()
         local s = lib.newstate()
         s:newtable()
@@ -1684,12 +3275,81 @@ describe('lualua', function()
       end)
     end)
 
+    describe('setstringcache', function()
+      it('fails on negative size', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (negative size)', s.setstringcache, s, -1)
+      end)
+      it('is off by default', function()
+        local s = lib.newstate()
+        s:pushstring('foo')
+        assert.same({ size = 0, hits = 0, misses = 0 }, s:stringcachestats())
+      end)
+      it('hits on repeated strings', function()
+        local s = lib.newstate()
+        nr(0, s:setstringcache(16))
+        s:newtable()
+        for i = 1, 10 do
+          s:pushnumber(i)
+          s:setfield(1, 'foo')
+        end
+        s:getfield(1, 'foo')
+        assert.same(10, s:tonumber(-1))
+        assert.same({ size = 16, hits = 10, misses = 1 }, s:stringcachestats())
+      end)
+      it('survives collisions and collection', function()
+        local s = lib.newstate()
+        s:setstringcache(1)
+        for i = 1, 100 do
+          s:pushstring('foo' .. i)
+          s:pushstring('bar\0' .. i)
+          assert.same('foo' .. i, s:tostring(-2))
+          assert.same('bar\0' .. i, s:tostring(-1))
+          s:pop(2)
+        end
+        collectgarbage()
+        s:gc(lib.GCCOLLECT, 0)
+        s:pushstring('foo1')
+        assert.same('foo1', s:tostring(-1))
+        s:setstringcache(0)
+        s:pushstring('foo1')
+        assert.same('foo1', s:tostring(-1))
+      end)
+      it('is cleared when a pooled state is reset', function()
+        local p = lib.newpool(1)
+        local s = p:acquire()
+        s:setstringcache(4)
+        s:pushstring('foo')
+        p:release(s)
+        s = p:acquire()
+        s:pushstring('foo')
+        assert.same('foo', s:tostring(-1))
+        assert.same(2, s:stringcachestats().misses)
+      end)
+    end)
+
     describe('settable', function()
       it('fails on empty stack', function()
         local s = lib.newstate()
         assertFails('invalid index', s.settable, s, -1)
         assert.same(0, s:gettop())
       end)
+      it('fails on nil key', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushnil()
+        s:pushnumber(42)
+        assertFails('table index is nil', s.settable, s, 1)
+        assert.same(0, s:gettop())
+      end)
+      it('fails on NaN key', function()
+        local s = lib.newstate()
+        s:newtable()
+        s:pushnumber(0 / 0)
+        s:pushnumber(42)
+        assertFails('table index is NaN', s.settable, s, 1)
+        assert.same(0, s:gettop())
+      end)
       it('fails just setting itself', function()
         local s = lib.newstate()
         s:newtable()
@@ -1851,6 +3511,34 @@ describe('lualua', function()
       end)
     end)
 
+    describe('tolstring', function()
+      it('works', function()
+        local s = lib.newstate()
+        s:pushstring('foo\0bar')
+        s:pushnumber(42)
+        s:pushnil()
+        assert.same({ 'foo\0bar', 7 }, { nr(2, s:tolstring(1)) })
+        assert.same({ '42', 2 }, { nr(2, s:tolstring(2)) })
+        assert.same(nil, nr(1, s:tolstring(3)))
+      end)
+    end)
+
+    describe('tobuffer', function()
+      it('works', function()
+        local s = lib.newstate()
+        -- lualualua cannot push pointers, so it leaves tobuffer out.
+        if not s.tobuffer then
+          return
+        end
+        s:newbuffer(4)
+        s:newuserdata()
+        local p, n = nr(2, s:tobuffer(1))
+        assert.same('userdata', type(p))
+        assert.same(4, n)
+        assert.same(nil, nr(1, s:tobuffer(2)))
+      end)
+    end)
+
     describe('tonumber', function()
       it('works', function()
         local s = lib.newstate()
@@ -1883,6 +3571,65 @@ describe('lualua', function()
       end)
     end)
 
+    describe('totable', function()
+      it('works', function()
+        local s = lib.newstate()
+        s:loadstring('return { 42, "foo", bar = { baz = true } }')
+        s:call(0, 1)
+        assert.same({ 42, 'foo', bar = { baz = true } }, nr(1, s:totable(1)))
+        assert.same(1, s:gettop())
+      end)
+      it('works with pseudo-indices', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        s:setglobal('foo')
+        assert.same({ foo = 42 }, nr(1, s:totable(lib.GLOBALSINDEX)))
+      end)
+      it('preserves cycles', function()
+        local s = lib.newstate()
+        s:loadstring('local t = {}; t.t = t; return t')
+        s:call(0, 1)
+        local t = s:totable(-1)
+        assert.equal(t, t.t)
+      end)
+      it('fails on functions', function()
+        local s = lib.newstate()
+        s:loadstring('return { f = function() end }')
+        s:call(0, 1)
+        assertFails('cannot copy a function value', s.totable, s, 1)
+        assert.same(0, s:gettop())
+      end)
+      it('fails on non-table', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('type error', s.totable, s, 1)
+      end)
+      it('honors depth', function()
+        local s = lib.newstate()
+        s:loadstring('return { { {} } }')
+        s:call(0, 1)
+        assertFails('table too deep', s.totable, s, 1, { depth = 2 })
+      end)
+    end)
+
+    describe('tothread', function()
+      it('wraps sandbox threads', function()
+        local s = lib.newstate()
+        s:openlibs()
+        s:loadstring('return coroutine.create(function() return 42 end)')
+        s:call(0, 1)
+        local t = nr(1, s:tothread(1))
+        assert.same('lualua state', getmetatable(t))
+        assert.same(0, t:resume(0))
+        assert.same(42, t:tonumber(-1))
+      end)
+      it('returns nil on number', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assert.Nil(nr(1, s:tothread(1)))
+      end)
+    end)
+
     describe('touserdata', function()
       it('returns nil on number', function()
         local s = lib.newstate()
@@ -1890,5 +3637,121 @@ describe('lualua', function()
         assert.Nil(s:touserdata(-1))
       end)
     end)
+
+    describe('try', function()
+      it('returns the results of methods that work', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assert.same({ true, 42 }, { s:try('tonumber', -1) })
+        assert.same({ true }, { s:try('pop', 1) })
+        assert.same(0, s:gettop())
+      end)
+      it('keeps the stack on misuse', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assert.same({ false, 'invalid index' }, { s:try('gettable', -5) })
+        assert.same({ false, 'stack underflow' }, { s:try('settable', 1) })
+        assert.same(1, s:gettop())
+        assert.same(42, s:tonumber(1))
+      end)
+      it('pops the operands of methods that fail in the sandbox', function()
+        local s = lib.newstate()
+        s:pushnumber(1)
+        s:pushnumber(42)
+        s:pushstring('moo')
+        assert.same({ false, 'attempt to index a number value' }, { s:try('gettable', 2) })
+        assert.same(2, s:gettop())
+        s:pushnumber(7)
+        assert.same({ false, 'attempt to index a number value' }, { s:try('setfield', 2, 'moo') })
+        assert.same(2, s:gettop())
+        s:pushstring('oops')
+        assert.same({ false, 'oops' }, { s:try('error') })
+        assert.same(2, s:gettop())
+        assert.same(42, s:tonumber(2))
+      end)
+      it('drops partial copies', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        local ok, err = s:try('pushtable', { {}, { print } })
+        assert.False(ok)
+        assert.Not.Nil(err:find('cannot copy a function value$'))
+        assert.same(1, s:gettop())
+      end)
+      it('fails on unknown methods', function()
+        local s = lib.newstate()
+        assertFails('bad argument #2 to \'?\' (unknown method)', s.try, s, 'nonsense')
+      end)
+    end)
+
+    describe('unref', function()
+      it('fails on non-table', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('type error', s.unref, s, 1, 1)
+      end)
+      it('frees the ref for reuse', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        local ref = s:ref(lib.REGISTRYINDEX)
+        nr(0, s:unref(lib.REGISTRYINDEX, ref))
+        s:rawgeti(lib.REGISTRYINDEX, ref)
+        assert.same(false, s:tonumber(-1) == 42)
+        s:pushnumber(99)
+        assert.same(ref, s:ref(lib.REGISTRYINDEX))
+      end)
+      it('ignores NOREF and REFNIL', function()
+        local s = lib.newstate()
+        s:unref(lib.REGISTRYINDEX, lib.NOREF)
+        s:unref(lib.REGISTRYINDEX, lib.REFNIL)
+      end)
+    end)
+
+    describe('writebuffer', function()
+      it('round trips values', function()
+        local s = lib.newstate()
+        s:newbuffer(32)
+        nr(0, s:writebuffer(1, 'u8', 0, 255))
+        nr(0, s:writebuffer(1, 'u32', 1, 4294967295))
+        nr(0, s:writebuffer(1, 'f64', 5, 0.5))
+        nr(0, s:writebuffer(1, 'string', 13, 'foo\0bar'))
+        assert.same(255, s:readbuffer(1, 'u8', 0))
+        assert.same(4294967295, s:readbuffer(1, 'u32', 1))
+        assert.same(0.5, s:readbuffer(1, 'f64', 5))
+        assert.same('foo\0bar', s:readbuffer(1, 'string', 13, 7))
+        assert.same(0, s:readbuffer(1, 'u8', 20))
+      end)
+      it('checks values', function()
+        local s = lib.newstate()
+        s:newbuffer(8)
+        assertFails('bad argument #5 to \'?\' (value out of range)', s.writebuffer, s, 1, 'u8', 0, 256)
+        assertFails('bad argument #5 to \'?\' (value out of range)', s.writebuffer, s, 1, 'u8', 0, 1.5)
+        assertFails('bad argument #5 to \'?\' (value out of range)', s.writebuffer, s, 1, 'u32', 0, -1)
+        assertFails('bad argument #4 to \'?\' (out of bounds)', s.writebuffer, s, 1, 'string', 6, 'foo')
+        assert.same(0, s:readbuffer(1, 'u8', 6))
+      end)
+    end)
+
+    describe('xmove', function()
+      it('moves values between threads', function()
+        local s = lib.newstate()
+        local t = s:newthread()
+        s:pushnumber(42)
+        s:pushboolean(true)
+        nr(0, s:xmove(t, 2))
+        assert.same(1, s:gettop())
+        assert.same(2, t:gettop())
+        assert.same(42, t:tonumber(1))
+      end)
+      it('fails across sandboxes', function()
+        local s = lib.newstate()
+        s:pushnumber(42)
+        assertFails('states are not in the same sandbox', s.xmove, s, lib.newstate(), 1)
+      end)
+      it('fails on underflow', function()
+        local s = lib.newstate()
+        local t = s:newthread()
+        assertFails('stack underflow', s.xmove, s, t, 2)
+      end)
+    end)
   end)
 end)
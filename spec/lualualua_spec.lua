@@ -1,5 +1,6 @@
 describe('lualualua', function()
-  it('runs lualua_spec.lua', function()
+  -- Runs lualua_spec.lua in a sandbox, with pushlib pushing its lualua.
+  local function runspec(pushlib)
     local s = require('lualua').newstate()
     s:openlibs()
     s:loadstring([=[
@@ -26,12 +27,24 @@ describe('lualualua', function()
       end
     ]=])
     s:getglobal('require')
-    s:pushcfunction(require('lualualua'))
-    s:call(0, 1)
+    pushlib(s)
     s:call(2, 1)
     s:setglobal('require')
     local lualuaspec = require('pl.file').read('spec/lualua_spec.lua')
     s:loadstring(lualuaspec, '@spec/lualua_spec.lua')
     s:call(0, 0)
+  end
+
+  it('runs lualua_spec.lua', function()
+    runspec(function(s)
+      s:pushcfunction(require('lualualua'))
+      s:call(0, 1)
+    end)
+  end)
+
+  it('runs lualua_spec.lua natively', function()
+    runspec(function(s)
+      s:openlualua()
+    end)
   end)
 end)